@@ -0,0 +1,877 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fakefs.h"
+#include "fs.h"
+#include "gen.h"
+#include "iolimit.h"
+#include "mem.h"
+#include "repl.h"
+#include "scan.h"
+#include "tree.h"
+
+/* Scan, sort and delete throughput on generated trees, or the latency of
+ * browser commands replayed against them. Every scale runs in a child
+ * process, so peak RSS is per scale. Results are printed as one line of
+ * key=value pairs per phase; keys are only ever added. */
+
+#define BENCH_ROOT "/bench"
+#define MAX_SCALES 16
+#define MAX_COMMAND_TYPES 16
+#define MAX_LINE 4096
+#define DEFAULT_REPEAT 20
+#define MAX_BASELINE 256
+#define BASELINE_KEY 64
+#define DEFAULT_KEPT_FILES 10
+#define CONVERGE_INTERVAL 0.002
+#define MAX_CONVERGE_SAMPLES 65536
+
+/* Sessions may name entries through directives, so that one script works
+ * on any generated tree: @largest, @random, @random-dir, @random-file. */
+static const char DEFAULT_SESSION[] =
+    "@largest\n"
+    "@largest\n"
+    "..\n"
+    "@random-dir\n"
+    "@random-dir\n"
+    "..\n"
+    "..\n"
+    "/help\n"
+    "@largest\n"
+    "/rm @random-file\n"
+    "@random-dir\n"
+    "/rm @random-dir\n"
+    "..\n"
+    "..\n";
+
+struct command_latencies {
+    char type[16];
+    double *samples;
+    size_t len;
+    size_t cap;
+};
+
+struct replay {
+    struct command_latencies types[MAX_COMMAND_TYPES];
+    size_t type_count;
+    uint64_t rng;
+};
+
+/* results of an earlier run, e.g. of a build without PGO, by
+ * "phase/scale[/command]" */
+struct baseline_entry {
+    char key[BASELINE_KEY];
+    double value;
+};
+
+static struct baseline_entry baseline[MAX_BASELINE];
+static size_t baseline_len = 0;
+
+struct bench_options {
+    size_t scales[MAX_SCALES];
+    size_t scale_count;
+    char **gen_args;
+    size_t gen_arg_count;
+    struct scan_options scan;
+    const char *disk;      /* generate on disk below this directory */
+    const char *manifest;  /* only write the tree to this file */
+    const char *tree;      /* browse this manifest instead of generating */
+    const char *root;
+    const char *session;   /* replay this session instead of sort/delete */
+    const char *node_store;
+    enum delete_order delete_order;
+    unsigned repeat;
+    bool memory;           /* stop after the memory report */
+};
+
+enum {
+    OPT_SCALES = 256,
+    OPT_GEN,
+    OPT_DISK,
+    OPT_MANIFEST,
+    OPT_TREE,
+    OPT_ROOT,
+    OPT_SESSION,
+    OPT_REPEAT,
+    OPT_MEMORY,
+    OPT_DIRS_ONLY,
+    OPT_NODE_STORE,
+    OPT_SCAN_ORDER,
+    OPT_DELETE_ORDER,
+    OPT_BASELINE,
+    OPT_FS_LATENCY,
+    OPT_HELP,
+};
+
+static const struct option long_options[] = {
+    {"scales", required_argument, NULL, OPT_SCALES},
+    {"gen", required_argument, NULL, OPT_GEN},
+    {"jobs", required_argument, NULL, 'j'},
+    {"inode-order", no_argument, NULL, 'i'},
+    {"disk", required_argument, NULL, OPT_DISK},
+    {"manifest", required_argument, NULL, OPT_MANIFEST},
+    {"tree", required_argument, NULL, OPT_TREE},
+    {"root", required_argument, NULL, OPT_ROOT},
+    {"session", required_argument, NULL, OPT_SESSION},
+    {"repeat", required_argument, NULL, OPT_REPEAT},
+    {"memory", no_argument, NULL, OPT_MEMORY},
+    {"dirs-only", optional_argument, NULL, OPT_DIRS_ONLY},
+    {"node-store", required_argument, NULL, OPT_NODE_STORE},
+    {"scan-order", required_argument, NULL, OPT_SCAN_ORDER},
+    {"delete-order", required_argument, NULL, OPT_DELETE_ORDER},
+    {"baseline", required_argument, NULL, OPT_BASELINE},
+    {"fs-latency", required_argument, NULL, OPT_FS_LATENCY},
+    {"help", no_argument, NULL, OPT_HELP},
+    {NULL, 0, NULL, 0},
+};
+
+void print_usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fputs("  --scales N,N,...       tree sizes in entries (1e4,1e5,1e6)\n"
+          "  --gen KEY=VALUE        generator option: seed, fanout, depth,\n"
+          "                         files, name=MIN:MAX, size=MEDIAN:SIGMA,\n"
+          "                         hardlinks, flat=DIRS:ENTRIES\n"
+          "  -j, --jobs N           scanner threads (1)\n"
+          "  -i, --inode-order      scan in inode order\n"
+          "  --dirs-only[=K]        keep directories and K files of each (10)\n"
+          "  --node-store DIR       keep the scanned tree in a file in DIR\n"
+          "  --scan-order ORDER     depth-first, breadth-first, largest-first\n"
+          "                         or random\n"
+          "  --delete-order ORDER   tree for the order of the sorted tree\n"
+          "                         (the default), inode or auto\n"
+          "  --disk DIR             generate real files below DIR instead of\n"
+          "                         an in-memory tree\n"
+          "  --manifest FILE        write the tree of the first scale to FILE\n"
+          "                         for cleaner --fake-fs and exit\n"
+          "  --tree MANIFEST        use a snapshot instead of generating\n"
+          "  --root PATH            root of the snapshot (/bench)\n"
+          "  --session FILE         replay browser commands, one per line, and\n"
+          "                         report their latency; \"default\" replays a\n"
+          "                         built-in session\n"
+          "  --repeat N             replay the session N times (20)\n"
+          "  --memory               only generate, scan and report the bytes\n"
+          "                         per entry\n"
+          "  --baseline FILE        compare with the output of an earlier run,\n"
+          "                         e.g. of another build, and report gains\n"
+          "  --fs-latency SPEC      add latency to filesystem calls\n", stderr);
+}
+
+long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* entries, not nodes: collapsed files count one by one */
+size_t count_nodes(struct file *f)
+{
+    size_t count = 1;
+    if (f->type == FILE_TYPE_COLLAPSED) {
+        count = ((struct collapsed_files *) f)->count;
+    } else if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+        struct directory *d = (struct directory *) f;
+        for (struct file *cur = d->subdirs; cur; cur = cur->next) {
+            count += count_nodes(cur);
+        }
+    }
+    return count;
+}
+
+void sort_tree(struct file *f)
+{
+    if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+        struct directory *d = (struct directory *) f;
+        for (struct file *cur = sorted_subdirs(d); cur; cur = cur->next) {
+            sort_tree(cur);
+        }
+    }
+}
+
+const char *find_value(const char *line, const char *key)
+{
+    size_t len = strlen(key);
+    for (const char *p = line; p; p = strchr(p, ' ')) {
+        p += *p == ' ';
+        if (strncmp(p, key, len) == 0 && p[len] == '=') {
+            return p + len + 1;
+        }
+    }
+    return NULL;
+}
+
+/* Keeps throughput of the phases and median latency of the commands. */
+int load_baseline(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return -1;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), in) && baseline_len < MAX_BASELINE) {
+        const char *phase = find_value(line, "bench");
+        const char *scale = find_value(line, "scale");
+        const char *command = find_value(line, "command");
+        const char *value = find_value(line, command ? "p50_us"
+                                                     : "entries_per_s");
+        if (!phase || !scale || !value) {
+            continue;
+        }
+        struct baseline_entry *e = &baseline[baseline_len++];
+        snprintf(e->key, sizeof(e->key), "%.*s/%.*s%s%.*s",
+                 (int) strcspn(phase, " \n"), phase,
+                 (int) strcspn(scale, " \n"), scale, command ? "/" : "",
+                 command ? (int) strcspn(command, " \n") : 0,
+                 command ? command : "");
+        e->value = strtod(value, NULL);
+    }
+    fclose(in);
+    return 0;
+}
+
+/* gain > 1 is an improvement: more throughput, or less latency */
+void report_gain(const char *phase, size_t scale, const char *command,
+                 double value)
+{
+    char key[BASELINE_KEY];
+    snprintf(key, sizeof(key), "%s/%zu%s%s", phase, scale, command ? "/" : "",
+             command ? command : "");
+    for (size_t i = 0; i < baseline_len; ++i) {
+        if (strcmp(baseline[i].key, key) != 0 || baseline[i].value <= 0
+            || value <= 0) {
+            continue;
+        }
+        printf("bench=gain phase=%s scale=%zu", phase, scale);
+        if (command) {
+            printf(" command=%s", command);
+        }
+        printf(" baseline=%.1f current=%.1f gain=%.3f\n", baseline[i].value,
+               value, command ? baseline[i].value / value
+                              : value / baseline[i].value);
+        return;
+    }
+}
+
+void report(const char *phase, size_t scale, size_t entries, double seconds)
+{
+    uint64_t counts[FS_OP_COUNT];
+    fs_get_counts(counts);
+    printf("bench=%s scale=%zu entries=%zu seconds=%.6f entries_per_s=%.0f "
+           "peak_rss_kb=%ld", phase, scale, entries, seconds,
+           seconds > 0 ? entries / seconds : 0, peak_rss_kb());
+    for (int op = 0; op < FS_OP_COUNT; ++op) {
+        printf(" %s=%llu", fs_op_name(op), (unsigned long long) counts[op]);
+    }
+    putchar('\n');
+    report_gain(phase, scale, NULL, seconds > 0 ? entries / seconds : 0);
+    fflush(stdout);
+    fs_reset_counts();
+}
+
+/* Bytes per entry of the scanned tree, by kind. rss is the growth of the
+ * resident set over the scan; "other" is the part of it the counters do
+ * not explain (freed scratch memory, fragmentation, page granularity).
+ * With a node store, its pages in memory count towards rss too. */
+void report_memory(size_t scale, size_t entries, long rss_before_kb)
+{
+    struct mem_stats stats[MEM_KIND_COUNT];
+    mem_get_stats(stats);
+    double rss = (mem_rss_kb() - rss_before_kb) * 1024.;
+    double allocated = 0;
+    double requested = 0;
+    printf("bench=memory scale=%zu entries=%zu rss_per_entry=%.1f", scale,
+           entries, rss / entries);
+    for (int kind = 0; kind < MEM_KIND_COUNT; ++kind) {
+        printf(" %s_per_entry=%.1f", mem_kind_name(kind),
+               (double) stats[kind].requested / entries);
+        allocated += stats[kind].allocated;
+        requested += stats[kind].requested;
+    }
+    printf(" slack_per_entry=%.1f other_per_entry=%.1f",
+           (allocated - requested) / entries, (rss - allocated) / entries);
+    uint64_t mapped, resident;
+    mem_map_usage(&mapped, &resident);
+    if (mapped) {
+        printf(" store_mapped_per_entry=%.1f store_resident_per_entry=%.1f",
+               (double) mapped / entries, (double) resident / entries);
+    }
+    putchar('\n');
+    fflush(stdout);
+}
+
+/* Scans like build_tree(), noting how soon the size of the root gets close
+ * to its final value, which is what the percentages on screen depend on
+ * while a scan runs in the background. */
+struct file *scan_converging(const struct bench_options *opts,
+                             const char *root, size_t scale)
+{
+    struct file *tree;
+    double start = now_seconds();
+    struct scanner *s = scan_start(root, &opts->scan, &tree);
+    double *times = malloc(MAX_CONVERGE_SAMPLES * sizeof(*times));
+    off_t *sizes = malloc(MAX_CONVERGE_SAMPLES * sizeof(*sizes));
+    size_t n = 0;
+    while (!scan_wait(s, CONVERGE_INTERVAL)) {
+        if (n < MAX_CONVERGE_SAMPLES) {
+            times[n] = now_seconds() - start;
+            sizes[n++] = file_size(tree);
+        }
+    }
+    scan_stop(s);
+    double seconds = now_seconds() - start;
+    if (tree) {
+        static const int percents[] = {50, 90, 99};
+        printf("bench=converge scale=%zu order=%s", scale,
+               scan_order_name(opts->scan.order));
+        for (size_t i = 0; i < sizeof(percents) / sizeof(*percents); ++i) {
+            size_t j = 0;
+            while (j < n && sizes[j] * 100. < tree->size * (double) percents[i]) {
+                ++j;
+            }
+            printf(" bytes_%d_s=%.6f", percents[i], j < n ? times[j] : seconds);
+        }
+        putchar('\n');
+    }
+    free(times);
+    free(sizes);
+    return tree;
+}
+
+void init_generator(const struct bench_options *opts, size_t scale,
+                    struct gen_options *gen)
+{
+    gen_options_init(gen, scale);
+    for (size_t i = 0; i < opts->gen_arg_count; ++i) {
+        gen_parse_option(gen, opts->gen_args[i]);
+    }
+}
+
+int write_manifest(const struct bench_options *opts)
+{
+    struct gen_options gen;
+    init_generator(opts, opts->scales[0], &gen);
+    FILE *out = fopen(opts->manifest, "w");
+    if (!out) {
+        fprintf(stderr, "[ERROR] cannot open %s: %s\n", opts->manifest,
+                strerror(errno));
+        return 1;
+    }
+    struct gen_manifest_sink sink;
+    gen_manifest_sink_init(&sink, out);
+    long generated = gen_tree(&gen, BENCH_ROOT, &sink.sink);
+    if (fclose(out) != 0 || generated < 0) {
+        fprintf(stderr, "[ERROR] cannot write %s\n", opts->manifest);
+        return 1;
+    }
+    return 0;
+}
+
+struct command_latencies *find_latencies(struct replay *r, const char *type)
+{
+    for (size_t i = 0; i < r->type_count; ++i) {
+        if (strcmp(r->types[i].type, type) == 0) {
+            return &r->types[i];
+        }
+    }
+    if (r->type_count == MAX_COMMAND_TYPES) {
+        return NULL;
+    }
+    struct command_latencies *result = &r->types[r->type_count++];
+    snprintf(result->type, sizeof(result->type), "%s", type);
+    return result;
+}
+
+void record_latency(struct replay *r, const char *type, double seconds)
+{
+    struct command_latencies *c = find_latencies(r, type);
+    if (!c) {
+        return;
+    }
+    if (c->len == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->samples = realloc(c->samples, c->cap * sizeof(*c->samples));
+    }
+    c->samples[c->len++] = seconds;
+}
+
+void command_type(const char *line, char *type, size_t size)
+{
+    if (line[0] == '/') {
+        size_t len = strcspn(line + 1, " \t");
+        snprintf(type, size, "%.*s", (int) len, line + 1);
+    } else if (strcmp(line, "..") == 0) {
+        snprintf(type, size, "up");
+    } else {
+        snprintf(type, size, "navigate");
+    }
+}
+
+/* Picks the entry a directive stands for, or NULL if there is none. */
+struct file *resolve_directive(struct replay *r, struct file *cur,
+                               const char *directive)
+{
+    if (cur->type != S_IFDIR >> FILE_TYPE_OFFSET) {
+        return NULL;
+    }
+    struct directory *d = (struct directory *) cur;
+    if (strcmp(directive, "@largest") == 0) {
+        return sorted_subdirs(d);
+    }
+    int want_dir = strcmp(directive, "@random-dir") == 0 ? 1
+                   : strcmp(directive, "@random-file") == 0 ? 0 : -1;
+    if (want_dir < 0 && strcmp(directive, "@random") != 0) {
+        return NULL;
+    }
+    size_t count = 0;
+    for (struct file *f = d->subdirs; f; f = f->next) {
+        count += want_dir < 0
+                 || want_dir == (f->type == S_IFDIR >> FILE_TYPE_OFFSET);
+    }
+    if (!count) {
+        return NULL;
+    }
+    r->rng = r->rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    size_t pick = (r->rng >> 33) % count;
+    for (struct file *f = d->subdirs; f; f = f->next) {
+        if ((want_dir < 0
+             || want_dir == (f->type == S_IFDIR >> FILE_TYPE_OFFSET))
+            && pick-- == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/* Runs one command like the main loop does: the command, then rendering
+ * of the node it leads to. Returns false once the root is gone. */
+bool replay_line(struct replay *r, struct file **cur, const char *line)
+{
+    char command[MAX_LINE];
+    const char *directive = strchr(line, '@');
+    if (directive) {
+        struct file *target = resolve_directive(r, *cur, directive);
+        if (!target) {
+            return true;
+        }
+        snprintf(command, sizeof(command), "%.*s%s", (int) (directive - line),
+                 line, get_file_name(target->name));
+    } else {
+        snprintf(command, sizeof(command), "%s", line);
+    }
+    char type[16];
+    command_type(command, type, sizeof(type));
+
+    double start = now_seconds();
+    *cur = process_line(*cur, command);
+    double processed = now_seconds();
+    if (*cur) {
+        fs_chdir((*cur)->name);
+        print_node(*cur);
+        fflush(stdout);
+    }
+    double rendered = now_seconds();
+    record_latency(r, type, rendered - start);
+    if (*cur) {
+        record_latency(r, "render", rendered - processed);
+    }
+    return *cur != NULL;
+}
+
+char **read_session(const struct bench_options *opts, size_t *count)
+{
+    FILE *in;
+    bool builtin = strcmp(opts->session, "default") == 0;
+    if (builtin) {
+        in = fmemopen((void *) DEFAULT_SESSION, sizeof(DEFAULT_SESSION) - 1,
+                      "r");
+    } else if (!(in = fopen(opts->session, "r"))) {
+        return NULL;
+    }
+    char **lines = NULL;
+    size_t cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, in)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (is_empty_line(line) || line[0] == '#') {
+            continue;
+        }
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 64;
+            lines = realloc(lines, cap * sizeof(*lines));
+        }
+        lines[(*count)++] = strdup(line);
+    }
+    free(line);
+    fclose(in);
+    return lines;
+}
+
+double percentile(const double *sorted, size_t n, double q)
+{
+    size_t i = (size_t) ceil(q * n);
+    return sorted[i > 0 ? i - 1 : 0];
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int run_session(const struct bench_options *opts, size_t scale,
+                struct file *tree)
+{
+    size_t count = 0;
+    char **lines = read_session(opts, &count);
+    if (!count) {
+        fprintf(stderr, "[ERROR] cannot read session %s or it is empty\n",
+                opts->session);
+        return 1;
+    }
+    struct replay r = { .rng = 1 };
+
+    /* the output is rendered, but nobody needs to see it */
+    fflush(stdout);
+    fflush(stderr);
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+
+    struct file *cur = tree;
+    bool alive = true;
+    for (unsigned i = 0; i < opts->repeat && alive; ++i) {
+        for (size_t j = 0; j < count && alive; ++j) {
+            alive = replay_line(&r, &cur, lines[j]);
+        }
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    for (size_t i = 0; i < r.type_count; ++i) {
+        struct command_latencies *c = &r.types[i];
+        qsort(c->samples, c->len, sizeof(*c->samples), compare_doubles);
+        printf("bench=repl scale=%zu command=%s count=%zu p50_us=%.1f "
+               "p99_us=%.1f max_us=%.1f peak_rss_kb=%ld\n", scale, c->type,
+               c->len, percentile(c->samples, c->len, 0.5) * 1e6,
+               percentile(c->samples, c->len, 0.99) * 1e6,
+               c->samples[c->len - 1] * 1e6, peak_rss_kb());
+        report_gain("repl", scale, c->type,
+                    percentile(c->samples, c->len, 0.5) * 1e6);
+        free(c->samples);
+    }
+    fflush(stdout);
+    for (size_t i = 0; i < count; ++i) {
+        free(lines[i]);
+    }
+    free(lines);
+    if (cur) {
+        deallocate_files(tree);
+    }
+    return 0;
+}
+
+int load_tree(const struct bench_options *opts, struct fs_backend *fake_fs)
+{
+    FILE *in = fopen(opts->tree, "r");
+    long loaded = in ? fakefs_load(fake_fs, in) : -1;
+    if (in) {
+        fclose(in);
+    }
+    if (loaded < 0) {
+        fprintf(stderr, "[ERROR] cannot load %s\n", opts->tree);
+        return 1;
+    }
+    return 0;
+}
+
+int run_scale(const struct bench_options *opts, size_t scale)
+{
+    struct gen_options gen;
+    init_generator(opts, scale, &gen);
+
+    char *root;
+    struct fs_backend *fake_fs = NULL;
+    struct gen_fakefs_sink fake_sink;
+    struct gen_disk_sink disk_sink;
+    struct gen_sink *sink;
+    if (opts->tree) {
+        root = strdup(opts->root);
+        fake_fs = fakefs_create();
+        sink = NULL;
+        if (load_tree(opts, fake_fs) != 0) {
+            return 1;
+        }
+    } else if (opts->disk) {
+        char name[32];
+        sprintf(name, "bench.%zu", scale);
+        root = concat_path(opts->disk, name);
+        gen_disk_sink_init(&disk_sink);
+        sink = &disk_sink.sink;
+    } else {
+        root = strdup(BENCH_ROOT);
+        fake_fs = fakefs_create();
+        gen_fakefs_sink_init(&fake_sink, fake_fs);
+        sink = &fake_sink.sink;
+    }
+
+    double start = now_seconds();
+    if (sink) {
+        long generated = gen_tree(&gen, root, sink);
+        if (generated < 0) {
+            fprintf(stderr, "[ERROR] cannot generate %s: %s\n", root,
+                    strerror(errno));
+            return 1;
+        }
+        report("generate", scale, generated, now_seconds() - start);
+    }
+    if (opts->disk) {
+        gen_disk_sink_free(&disk_sink);
+    } else {
+        fs_set_backend(fake_fs);
+    }
+    fs_reset_counts();
+
+    if (opts->node_store && mem_map_open(opts->node_store) != 0) {
+        fprintf(stderr, "[ERROR] cannot create a node store in %s: %s\n",
+                opts->node_store, strerror(errno));
+        return 1;
+    }
+    long rss_before_kb = mem_rss_kb();
+    start = now_seconds();
+    struct file *tree = scan_converging(opts, root, scale);
+    if (!tree) {
+        fprintf(stderr, "[ERROR] cannot scan %s\n", root);
+        return 1;
+    }
+    double seconds = now_seconds() - start;
+    size_t entries = count_nodes(tree);
+    report("scan", scale, entries, seconds);
+    report_memory(scale, entries, rss_before_kb);
+    if (opts->memory) {
+        free(root);
+        return 0;
+    }
+
+    if (opts->session) {
+        int result = run_session(opts, scale, tree);
+        free(root);
+        return result;
+    }
+
+    start = now_seconds();
+    sort_tree(tree);
+    report("sort", scale, entries, now_seconds() - start);
+
+    start = now_seconds();
+    remove_file(tree);
+    report("delete", scale, entries, now_seconds() - start);
+
+    free(root);
+    if (fake_fs) {
+        fs_set_backend(&native_fs);
+        fakefs_destroy(fake_fs);
+    }
+    return 0;
+}
+
+bool parse_scales(struct bench_options *opts, char *list)
+{
+    opts->scale_count = 0;
+    for (char *item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+        char *end;
+        double scale = strtod(item, &end);
+        if (*end || scale < 1 || opts->scale_count == MAX_SCALES) {
+            return false;
+        }
+        opts->scales[opts->scale_count++] = (size_t) scale;
+    }
+    return opts->scale_count > 0;
+}
+
+/* as cleaner --dirs-only=K takes it */
+bool parse_files(const char *s, unsigned *count)
+{
+    char *end;
+    unsigned long value = strtoul(s, &end, 10);
+    *count = value;
+    return *s && !*end && value <= UINT32_MAX;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_options opts = {
+        .scales = {10000, 100000, 1000000},
+        .scale_count = 3,
+        .root = BENCH_ROOT,
+        .repeat = DEFAULT_REPEAT,
+        .delete_order = DELETE_TREE_ORDER,
+    };
+    scan_options_init(&opts.scan);
+    opts.scan.jobs = 1;
+    opts.gen_args = calloc(argc, sizeof(char *));
+    int exit_code = 0;
+    int opt;
+    int order;
+    struct gen_options check;
+    while ((opt = getopt_long(argc, argv, "ij:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_SCALES:
+            if (!parse_scales(&opts, optarg)) {
+                fprintf(stderr, "[ERROR] incorrect scales: %s\n", optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            break;
+        case OPT_GEN:
+            gen_options_init(&check, 0);
+            if (gen_parse_option(&check, optarg) != 0) {
+                fprintf(stderr, "[ERROR] incorrect generator option: %s\n",
+                        optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            opts.gen_args[opts.gen_arg_count++] = optarg;
+            break;
+        case 'j':
+            opts.scan.jobs = strtoul(optarg, NULL, 10);
+            if (!opts.scan.jobs) {
+                fprintf(stderr, "[ERROR] incorrect thread count: %s\n", optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            break;
+        case 'i':
+            opts.scan.inode_order = true;
+            break;
+        case OPT_DIRS_ONLY:
+            opts.scan.dirs_only = true;
+            opts.scan.keep_files = DEFAULT_KEPT_FILES;
+            if (optarg && !parse_files(optarg, &opts.scan.keep_files)) {
+                fprintf(stderr, "[ERROR] incorrect file count: %s\n", optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            break;
+        case OPT_NODE_STORE:
+            opts.node_store = optarg;
+            break;
+        case OPT_SCAN_ORDER:
+            if ((order = scan_order_parse(optarg)) < 0) {
+                fprintf(stderr, "[ERROR] unknown scan order: %s\n", optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            opts.scan.order = order;
+            break;
+        case OPT_DELETE_ORDER:
+            if ((order = delete_order_parse(optarg)) < 0) {
+                fprintf(stderr, "[ERROR] unknown delete order: %s\n", optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            opts.delete_order = order;
+            break;
+        case OPT_DISK:
+            opts.disk = optarg;
+            break;
+        case OPT_MANIFEST:
+            opts.manifest = optarg;
+            break;
+        case OPT_TREE:
+            opts.tree = optarg;
+            break;
+        case OPT_ROOT:
+            opts.root = optarg;
+            break;
+        case OPT_SESSION:
+            opts.session = optarg;
+            break;
+        case OPT_REPEAT:
+            opts.repeat = strtoul(optarg, NULL, 10);
+            if (!opts.repeat) {
+                fprintf(stderr, "[ERROR] incorrect repeat count: %s\n",
+                        optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            break;
+        case OPT_MEMORY:
+            opts.memory = true;
+            break;
+        case OPT_BASELINE:
+            if (load_baseline(optarg) != 0) {
+                fprintf(stderr, "[ERROR] cannot read %s\n", optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            break;
+        case OPT_FS_LATENCY:
+            if (fs_set_latency(optarg) != 0) {
+                fprintf(stderr, "[ERROR] incorrect latency: %s\n", optarg);
+                exit_code = 1;
+                goto exit;
+            }
+            break;
+        case OPT_HELP:
+            print_usage(argv[0]);
+            goto exit;
+        default:
+            print_usage(argv[0]);
+            exit_code = 1;
+            goto exit;
+        }
+    }
+
+    if (opts.manifest) {
+        exit_code = write_manifest(&opts);
+        goto exit;
+    }
+    set_delete_order(opts.delete_order);
+    printf("bench=config jobs=%u inode_order=%d delete_order=%s backend=%s\n",
+           opts.scan.jobs, opts.scan.inode_order,
+           delete_order_name(opts.delete_order), opts.disk ? "native" : "fake");
+    fflush(stdout);
+    for (size_t i = 0; i < opts.scale_count; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            exit_code = run_scale(&opts, opts.scales[i]);
+            free(opts.gen_args);
+            exit(exit_code);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "[ERROR] scale %zu failed\n", opts.scales[i]);
+            exit_code = 1;
+        }
+    }
+
+exit:
+    free(opts.gen_args);
+    return exit_code;
+}
@@ -1,10 +1,9 @@
-#include <assert.h>
-#include <ctype.h>
-#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,425 +13,361 @@
 #include <readline/readline.h>
 #include <readline/history.h>
 
-#define MAX_PRINTED 40
-#define MIN_PERCENTAGE 5.
-#define FILE_TYPE_OFFSET 12
-#define DIRECTORY_UNLISTABLE 020
-
-struct file {
-    struct file *next;
-    struct directory *parent;
-    char *name;
-    off_t size;
-    uint8_t type;
+#include "fakefs.h"
+#include "fs.h"
+#include "iolimit.h"
+#include "mem.h"
+#include "migrate.h"
+#include "repl.h"
+#include "scan.h"
+#include "sched.h"
+#include "stats.h"
+#include "trace.h"
+#include "tree.h"
+
+#define DEFAULT_ESTIMATE_SECONDS 10.
+#define TRACE_EVENTS_PER_THREAD 16384
+#define DEFAULT_KEPT_FILES 10
+
+enum {
+    OPT_IOPRIO = 256,
+    OPT_MAX_JOBS,
+    OPT_DEVICE_JOBS,
+    OPT_INODE_ORDER,
+    OPT_ESTIMATE,
+    OPT_DIRS_ONLY,
+    OPT_NODE_STORE,
+    OPT_SCAN_ORDER,
+    OPT_SIZE_HINTS,
+    OPT_DELETE_ORDER,
+    OPT_FAKE_FS,
+    OPT_RECORD,
+    OPT_STATS_AT_EXIT,
+    OPT_TRACE,
+    OPT_TRACE_SAMPLE,
+    OPT_TRACE_MIN_US,
+    OPT_FS_LATENCY,
+    OPT_FS_ERRORS,
+    OPT_MAX_STATS,
+    OPT_MAX_READDIRS,
+    OPT_MAX_UNLINKS,
+    OPT_MAX_FREE_RATE,
+    OPT_MAX_COPY_RATE,
+    OPT_ADAPTIVE_IO,
+    OPT_HELP,
 };
 
-struct directory {
-    struct file file;
-    struct file *subdirs;
-    off_t self_size;
-    bool subdirs_sorted;
+static const struct option long_options[] = {
+    {"jobs", required_argument, NULL, 'j'},
+    {"max-jobs", required_argument, NULL, OPT_MAX_JOBS},
+    {"device-jobs", required_argument, NULL, OPT_DEVICE_JOBS},
+    {"inode-order", no_argument, NULL, OPT_INODE_ORDER},
+    {"estimate", optional_argument, NULL, OPT_ESTIMATE},
+    {"dirs-only", optional_argument, NULL, OPT_DIRS_ONLY},
+    {"node-store", required_argument, NULL, OPT_NODE_STORE},
+    {"scan-order", required_argument, NULL, OPT_SCAN_ORDER},
+    {"size-hints", required_argument, NULL, OPT_SIZE_HINTS},
+    {"delete-order", required_argument, NULL, OPT_DELETE_ORDER},
+    {"fake-fs", required_argument, NULL, OPT_FAKE_FS},
+    {"record", required_argument, NULL, OPT_RECORD},
+    {"stats-at-exit", no_argument, NULL, OPT_STATS_AT_EXIT},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+    {"trace-min-us", required_argument, NULL, OPT_TRACE_MIN_US},
+    {"fs-latency", required_argument, NULL, OPT_FS_LATENCY},
+    {"fs-errors", required_argument, NULL, OPT_FS_ERRORS},
+    {"ioprio", required_argument, NULL, OPT_IOPRIO},
+    {"max-stats", required_argument, NULL, OPT_MAX_STATS},
+    {"max-readdirs", required_argument, NULL, OPT_MAX_READDIRS},
+    {"max-unlinks", required_argument, NULL, OPT_MAX_UNLINKS},
+    {"max-free-rate", required_argument, NULL, OPT_MAX_FREE_RATE},
+    {"max-copy-rate", required_argument, NULL, OPT_MAX_COPY_RATE},
+    {"adaptive-io", no_argument, NULL, OPT_ADAPTIVE_IO},
+    {"help", no_argument, NULL, OPT_HELP},
+    {NULL, 0, NULL, 0},
 };
 
-char *concat_path(const char *path_a, const char *path_b)
-{
-    size_t size_a = strlen(path_a);
-    size_t size_b = strlen(path_b);
-    uint8_t add_slash = (path_a[size_a - 1] != '/');
-    char *result = malloc(size_a + add_slash + size_b + 1);
-    char *p = stpncpy(result, path_a, size_a + 1);
-    if (add_slash) {
-        *(p++) = '/';
-    }
-    strncpy(p, path_b, size_b + 1);
-    return result;
-}
-
-char *get_file_name(const char *path)
+void print_usage(const char *program)
 {
-    const char *result = path;
-    uint8_t prev = 0;
-    for (const char *p = path; *p; ++p) {
-        if (*p == '/') {
-            prev = 1;
-        } else {
-            if (prev) {
-                result = p;
-            }
-            prev = 0;
-        }
-    }
-    return (char *) result;
+    fprintf(stderr, "usage: %s [options] [path]\n", program);
+    fputs("  -j, --jobs N           scan with N threads instead of adapting\n"
+          "  --max-jobs N           adapt the scanner up to N threads\n"
+          "  --device-jobs N        at most N threads on one device (st_dev);\n"
+          "                         threads are spread over the devices\n"
+          "                         found below path either way\n"
+          "  --inode-order          stat entries in inode order (for HDDs)\n"
+          "  --estimate[=SECONDS]   browse size estimates after SECONDS (10)\n"
+          "                         while the scan finishes in the background\n"
+          "  --dirs-only[=K]        keep only directories and the K largest\n"
+          "                         files of each (10) in memory\n"
+          "  --node-store DIR       keep the tree in a temporary file in DIR\n"
+          "                         that is paged in on demand, for trees\n"
+          "                         larger than the memory\n"
+          "  --scan-order ORDER     depth-first, breadth-first, largest-first\n"
+          "                         or random (the default with --estimate);\n"
+          "                         the directory on screen always goes first\n"
+          "  --size-hints MANIFEST  sizes of an earlier scan for largest-first,\n"
+          "                         in the --fake-fs format\n"
+          "  --delete-order ORDER   tree (the default) removes entries in the\n"
+          "                         order shown, inode those of big\n"
+          "                         directories by inode number, auto by\n"
+          "                         inode number on rotational disks only\n"
+          "  --fake-fs MANIFEST     browse an in-memory tree read from the\n"
+          "                         output of find -printf '%y %s %i %p\\n'\n"
+          "  --record FILE          append every command typed to FILE, for\n"
+          "                         replay with cleaner-bench --session\n"
+          "  --stats-at-exit        print the /stats counters when leaving\n"
+          "  --trace FILE           write a timeline of the worker threads to\n"
+          "                         FILE at exit, for chrome://tracing\n"
+          "  --trace-sample N       trace only every N-th span of a kind\n"
+          "  --trace-min-us US      drop spans shorter than US microseconds\n"
+          "  --fs-latency SPEC      add latency to filesystem calls, e.g.\n"
+          "                         stat=0.001,opendir=0.01,readdir=0,unlink=0\n"
+          "  --fs-errors SPEC       fail a fraction of calls, e.g.\n"
+          "                         stat=0.01:ESTALE,rmdir=0.5:EBUSY,seed=1;\n"
+          "                         ESTALE, EAGAIN and EINTR go away after\n"
+          "                         two tries\n"
+          "  --ioprio CLASS         idle, be[:0-7] or best-effort[:0-7]\n"
+          "  --max-stats N          at most N stat calls per second\n"
+          "  --max-readdirs N       at most N directory listings per second\n"
+          "  --max-unlinks N        at most N unlink/rmdir calls per second\n"
+          "  --max-free-rate MB     give back at most MB megabytes per second\n"
+          "                         of removed files over 1GB, which are\n"
+          "                         truncated in 64MB steps after the unlink\n"
+          "                         (processes holding them open lose the\n"
+          "                         data too)\n"
+          "  --max-copy-rate MB     copy at most MB megabytes per second in\n"
+          "                         /migrate\n"
+          "  --adaptive-io          back off when stat latency rises\n"
+          "  --help                 display this message\n", stderr);
 }
 
-void deallocate_files(struct file *file)
+bool parse_count(const char *s, unsigned *count)
 {
-    if (!file) {
-        return;
-    }
-    if (file->type == S_IFDIR >> FILE_TYPE_OFFSET) {
-        /* directory is both listable and listed */
-        struct directory *directory = (struct directory *)file;  /* XXX: sz */
-        deallocate_files(directory->subdirs);
-    }
-    deallocate_files(file->next);
-    free(file->name);
-    free(file);
-}
-
-struct file *reverse(struct file *f)
-{
-    if (!f) {
-        return f;
-    }
-    struct file *p = f, *x = f->next;
-    f->next = NULL;
-    while (x) {
-        struct file *c = x->next;
-        x->next = p;
-        p = x;
-        x = c;
-    }
-    return p;
-}
-
-struct file *merge(struct file *a, struct file *b)
-{
-    struct file *result = NULL;
-    while (a != NULL || b != NULL) {
-        struct file *old_result = result;
-        if (b == NULL || a != NULL && a->size > b->size) {
-            result = a;
-            a = a->next;
-        } else {
-            result = b;
-            b = b->next;
-        }
-        result->next = old_result;
-    }
-
-    return reverse(result);
+    char *end;
+    unsigned long value = strtoul(s, &end, 10);
+    *count = value;
+    return *s && !*end && value > 0 && value <= 4096;
 }
 
-struct file *do_merge_sort(struct file *files, off_t n)
+bool parse_files(const char *s, unsigned *count)
 {
-    if (n == 0) {
-        assert(!files);
-        return files;
-    } else if (n == 1) {
-        assert(files->next == NULL);
-        return files;
-    }
-    off_t m = n / 2;
-    struct file *middle = files;
-    for (off_t i = 1; i < m; ++i) {
-        middle = middle->next;
-    }
-    struct file *rest = middle->next;
-    middle->next = NULL;
-    return merge(do_merge_sort(files, m), do_merge_sort(rest, n - m));
+    char *end;
+    unsigned long value = strtoul(s, &end, 10);
+    *count = value;
+    return *s && !*end && value <= UINT32_MAX;
 }
 
-struct file *sorted_subdirs(struct directory *directory)
+bool parse_rate(const char *s, double *rate)
 {
-    if (!directory->subdirs_sorted) {
-        off_t count = 0;
-        for (struct file *cur = directory->subdirs; cur; cur = cur->next) {
-            ++count;
-        }
-        directory->subdirs = do_merge_sort(directory->subdirs, count);
-        directory->subdirs_sorted = true;
-    }
-    return directory->subdirs;
+    char *end;
+    *rate = strtod(s, &end);
+    return *s && !*end && *rate >= 0;
 }
 
-struct file *build_tree(const char *path)
+int main(int argc, char **argv)
 {
-    struct stat st;
-    if (lstat(path, &st)) {
-        err(errno, "[WARNING] stat failed: %s\n", path);
-        return NULL;
-    }
-    struct file *file;
-    struct directory *directory;
-    if (S_ISDIR(st.st_mode)) {
-        directory = malloc(sizeof(struct directory));
-        file = &directory->file;
-    } else {
-        file = malloc(sizeof(struct file));
-    }
-
-    file->next = NULL;
-    file->parent = NULL;
-    file->name = malloc(strlen(path) + 1);
-    strcpy(file->name, path);
-    file->type = (st.st_mode & S_IFMT) >> FILE_TYPE_OFFSET;
-    file->size = st.st_size;
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        directory->self_size = file->size;
-        if (dir) {
-            directory->subdirs = NULL;
-            struct dirent *dirent;
-            while ((dirent = readdir(dir))) {
-                if (strcmp(dirent->d_name, ".") == 0
-                    || strcmp(dirent->d_name, "..") == 0) {
-                    continue;
+    char *base_path;
+    int exit_code = 0;
+    int opt;
+    double rate;
+    int order;
+    struct fs_backend *fake_fs = NULL;
+    FILE *manifest;
+    FILE *record = NULL;
+    bool stats_at_exit = false;
+    const char *trace_path = NULL;
+    unsigned trace_sample = 1;
+    double trace_min_us = 0;
+    struct scan_options scan_options;
+    scan_options_init(&scan_options);
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+        case OPT_MAX_JOBS:
+        case OPT_DEVICE_JOBS:
+            if (!parse_count(optarg, opt == 'j' ? &scan_options.jobs
+                             : opt == OPT_MAX_JOBS ? &scan_options.max_jobs
+                             : &scan_options.device_jobs)) {
+                fprintf(stderr, "[ERROR] incorrect thread count: %s\n",
+                        optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            break;
+        case OPT_INODE_ORDER:
+            scan_options.inode_order = true;
+            break;
+        case OPT_ESTIMATE:
+            scan_options.estimate = DEFAULT_ESTIMATE_SECONDS;
+            if (optarg && (!parse_rate(optarg, &scan_options.estimate)
+                           || scan_options.estimate == 0)) {
+                fprintf(stderr, "[ERROR] incorrect time: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            break;
+        case OPT_DIRS_ONLY:
+            scan_options.dirs_only = true;
+            scan_options.keep_files = DEFAULT_KEPT_FILES;
+            if (optarg && !parse_files(optarg, &scan_options.keep_files)) {
+                fprintf(stderr, "[ERROR] incorrect file count: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            break;
+        case OPT_NODE_STORE:
+            if (!mem_map_enabled() && mem_map_open(optarg) != 0) {
+                fprintf(stderr, "[ERROR] cannot create a node store in %s: "
+                        "%s\n", optarg, strerror(errno));
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            break;
+        case OPT_SCAN_ORDER:
+            if ((order = scan_order_parse(optarg)) < 0) {
+                fprintf(stderr, "[ERROR] unknown scan order: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            scan_options.order = order;
+            break;
+        case OPT_SIZE_HINTS:
+            manifest = fopen(optarg, "r");
+            if (!manifest || sched_load_hints(manifest) < 0) {
+                fprintf(stderr, "[ERROR] cannot load size hints %s\n", optarg);
+                if (manifest) {
+                    fclose(manifest);
                 }
-                char *subpath = concat_path(path, dirent->d_name);
-                struct file *new_file = build_tree(subpath);
-                if (new_file) {
-                    new_file->parent = directory;
-                    new_file->next = directory->subdirs;
-                    directory->subdirs = new_file;
-                    file->size += new_file->size;
-                } else {
-                    fprintf(stderr, "[WARNING]: cannot find file %s\n",
-                            subpath);
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            fclose(manifest);
+            if (scan_options.order == SCAN_ORDER_AUTO) {
+                scan_options.order = SCAN_LARGEST_FIRST;
+            }
+            break;
+        case OPT_DELETE_ORDER:
+            if ((order = delete_order_parse(optarg)) < 0) {
+                fprintf(stderr, "[ERROR] unknown delete order: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            set_delete_order(order);
+            break;
+        case OPT_FAKE_FS:
+            if (!fake_fs) {
+                fake_fs = fakefs_create();
+            }
+            manifest = fopen(optarg, "r");
+            if (!manifest || fakefs_load(fake_fs, manifest) < 0) {
+                fprintf(stderr, "[ERROR] cannot load manifest %s\n", optarg);
+                if (manifest) {
+                    fclose(manifest);
                 }
-                free(subpath);
+                exit_code = 1;
+                goto exit_fake_fs;
             }
-            closedir(dir);
-            directory->subdirs_sorted = false;
-        } else {
-            file->type |= DIRECTORY_UNLISTABLE;
-            directory->subdirs = NULL;
-        }
-    }
-    return file;
-}
-
-void build_size_representation(char *str, off_t size)
-{   /* Maximum string size is 3 + 1 + 2 + 2 + 1 = 10*/
-    const static char PREFIXES[] = " kMGTPEZY";
-    double d_size = size;
-    uint32_t prefix_count = 0;
-    while (d_size > 1000.) {
-        d_size /= 1000.;
-        prefix_count += 1;
-    }
-
-    sprintf(str, "%.2f%cB", d_size, PREFIXES[prefix_count]);
-}
-
-char *trim_name(const char *name)
-{
-    if (name[0] == '.' && name[1] == '/') {
-        return (char *) (name + 2);
-    } else {
-        return (char *) name;
-    }
-}
-
-char *extract_name(char *line)
-{
-    char *start = line;
-    char *end = line;
-    while (*end) {
-        ++end;
-    }
-    --end;
-    while (*start && isspace(*start)) {
-        ++start;
-    }
-    if (!*start) {
-        return start;  /* empty line */
-    }
-    while (isspace(*end)) {
-        --end;
-    }
-    end[1] = '\0';
-    return start;
-
-}
-
-void print_node(struct file *f)
-{
-    char size[10];
-    build_size_representation(size, f->size);
-    printf("%s: %s\n", trim_name(f->name), size);
-    if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
-        struct directory *d = (struct directory *)f;
-        uint32_t printed = 0;
-        double explained = 0;
-        printf("%64s %8s %6s\n", "file name", "size", "%");
-        for (uint32_t i = 0; i < 80; ++i) {
-            putchar('-');
-        }
-        putchar('\n');
-        for (struct file *cur = sorted_subdirs(d); cur; cur=cur->next) {
-            if (++printed > MAX_PRINTED || explained > 100. - MIN_PERCENTAGE) {
-                break;
+            fclose(manifest);
+            fs_set_backend(fake_fs);
+            break;
+        case OPT_RECORD:
+            if (!record && !(record = fopen(optarg, "a"))) {
+                fprintf(stderr, "[ERROR] cannot open %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
             }
-            build_size_representation(size, cur->size);
-            double percentage = 100. * (double) cur->size / (double) f->size;
-            explained += percentage;
-            printf("%64s %8s %5.1f%%\n", get_file_name(cur->name),
-                   size, percentage);
-        }
-    }
-}
-
-struct file *next_entity(struct file *f, const char *s)
-{
-    if (strcmp("..", s) == 0) {
-        return &f->parent->file;
-    }
-    if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
-        struct directory *d = (struct directory *)f;
-        for (struct file *cur = d->subdirs; cur; cur = cur->next) {
-            if (strcmp(get_file_name(cur->name), s) == 0) {
-                return cur;
+            break;
+        case OPT_STATS_AT_EXIT:
+            stats_at_exit = true;
+            break;
+        case OPT_TRACE:
+            trace_path = optarg;
+            break;
+        case OPT_TRACE_SAMPLE:
+            if (!parse_count(optarg, &trace_sample)) {
+                fprintf(stderr, "[ERROR] incorrect sampling: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
             }
-        }
-    }
-
-    return NULL;
-}
-
-void update_size(struct directory *d)
-{
-    assert(d);
-    d->subdirs_sorted = false;
-    d->file.size = d->self_size;
-    for (struct file *f = d->subdirs; f; f = f->next) {
-        d->file.size += f->size;
-    }
-}
-
-bool remove_file_internal(struct file *f, bool remove_parent)
-{
-    bool result = true;
-    if (f->type & (S_IFDIR >> FILE_TYPE_OFFSET)) {
-        struct directory *d = (struct directory *)f;
-        struct file **subdirs = &d->subdirs;
-        while (*subdirs) {
-            struct file *nxt = (*subdirs)->next;
-            if (remove_file_internal(*subdirs, false)) {
-                free(*subdirs);
-                *subdirs = nxt;
-            } else {
-                subdirs = &(*subdirs)->next;
-                result = false;
+            break;
+        case OPT_TRACE_MIN_US:
+            if (!parse_rate(optarg, &trace_min_us)) {
+                fprintf(stderr, "[ERROR] incorrect time: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
             }
-        }
-
-        if (!result) {
-            fprintf(stderr, "[WARNING] skipping %s; not all children removed\n",
-                f->name);
-        } else {
-            if (rmdir(f->name) != 0) {
-                err(errno, "[ERROR] cannot remove %s; skipping", f->name);
-                result = false;
+            break;
+        case OPT_FS_LATENCY:
+        case OPT_FS_ERRORS:
+            if ((opt == OPT_FS_LATENCY ? fs_set_latency(optarg)
+                                       : fs_set_errors(optarg)) != 0) {
+                fprintf(stderr, "[ERROR] incorrect fault spec: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
             }
-        }
-        update_size(d);
-    } else {
-        if (unlink(f->name) != 0) {
-            if (rmdir(f->name) != 0) {
-                err(errno, "[ERROR] cannot remove %s; skipping", f->name);
-                result = false;
+            break;
+        case OPT_IOPRIO:
+            if (set_ioprio(optarg) != 0) {
+                fprintf(stderr, "[ERROR] cannot set I/O priority %s\n",
+                        optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
             }
-        }
-    }
-    struct directory *parent = f->parent;
-    if (result && remove_parent) {
-        struct directory *d = parent;
-        if (d) {
-            struct file **subdirs = &d->subdirs;
-            while (*subdirs) {
-                struct file *nxt = (*subdirs)->next;
-                if (*subdirs == f) {
-                    *subdirs = nxt;
-                } else {
-                    subdirs = &(*subdirs)->next;
-                }
+            break;
+        case OPT_MAX_STATS:
+        case OPT_MAX_READDIRS:
+        case OPT_MAX_UNLINKS:
+            if (!parse_rate(optarg, &rate)) {
+                fprintf(stderr, "[ERROR] incorrect rate: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
             }
-        }
-        free(f);
-    }
-
-    if (remove_parent) {
-        struct directory *d = parent;
-        while (d) {
-            update_size(d);
-            d = d->file.parent;
-        }
-    }
-    return result;
-}
-
-bool remove_file(struct file *f)
-{
-    return remove_file_internal(f, true);
-}
-
-bool is_empty_line(const char *s)
-{
-    if (!s) {
-        return true;
-    }
-    for(; *s; ++s) {
-        if (!isspace(*s)) {
-            return false;
+            io_set_rate(opt == OPT_MAX_STATS ? IO_STAT
+                        : opt == OPT_MAX_READDIRS ? IO_READDIR : IO_UNLINK,
+                        rate);
+            break;
+        case OPT_MAX_FREE_RATE:
+            if (!parse_rate(optarg, &rate)) {
+                fprintf(stderr, "[ERROR] incorrect rate: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            io_set_rate(IO_TRUNCATE, rate * (1 << 20) / TRUNCATE_STEP);
+            break;
+        case OPT_MAX_COPY_RATE:
+            if (!parse_rate(optarg, &rate)) {
+                fprintf(stderr, "[ERROR] incorrect rate: %s\n", optarg);
+                exit_code = 1;
+                goto exit_fake_fs;
+            }
+            io_set_rate(IO_COPY, rate * (1 << 20) / MIGRATE_CHUNK);
+            break;
+        case OPT_ADAPTIVE_IO:
+            io_set_adaptive(true);
+            break;
+        case OPT_HELP:
+            print_usage(argv[0]);
+            goto exit_fake_fs;
+        default:
+            print_usage(argv[0]);
+            exit_code = 1;
+            goto exit_fake_fs;
         }
     }
-    return true;
-}
-
-struct file *process_rm(struct file *cur, char *line)
-{
-    struct file *to_remove;
-    if (is_empty_line(line)) {
-        to_remove = cur;
-    } else {
-        to_remove = next_entity(cur, line);
-    }
-    struct file *parent = &to_remove->parent->file;
-    remove_file(to_remove);
-    if (parent == NULL) {
-        fprintf(stderr, "[INFO] removed root directory; exiting\n");
+    if (trace_path) {
+        trace_init(TRACE_EVENTS_PER_THREAD, trace_sample, trace_min_us * 1e-6);
+        trace_thread_name("main");
     }
-    return parent;
-}
-
-void process_help(char *line)
-{
-    if (!is_empty_line(line)) {
-        fprintf(stderr, "[ERROR] wrong command: /help %s\n", line);
-        return;
-    }
-    puts("Enter file name to go to this directory or .. to go up one level");
-    puts("/rm [file] to remove file or current directory if not stated");
-    puts("/help to display this message");
-}
-
-struct file *process_command(struct file *cur, char *line)
-{
-    char *cmd = strsep(&line, " \t\n");
-    if (strcmp(cmd, "/rm") == 0) {
-        return process_rm(cur, line);
-    } else if (strcmp(cmd, "/help") == 0) {
-        process_help(line);
-        return cur;
-    } else {
-        fprintf(stderr, "command not recognized: %s\n", cmd);
-        return cur;
-    }
-}
-
-int main(int argc, char **argv)
-{
-    char *base_path;
-    int exit_code = 0;
-    if (argc == 1) {
-        base_path = getcwd(NULL, 0);
-    } else if (argc == 2) {
-        base_path = realpath(argv[1], NULL);
+    if (optind == argc) {
+        base_path = fs_is_native() ? getcwd(NULL, 0) : strdup("/");
+    } else if (optind + 1 == argc) {
+        base_path = fs_is_native() ? realpath(argv[optind], NULL)
+                                   : strdup(argv[optind]);
     } else {
         fprintf(stderr, "[ERROR] incorrect arguments\n");
         exit_code = 1;
-        goto exit_vanilla;
+        goto exit_fake_fs;
     }
     int original_wd_fd = open(".", O_RDONLY);
     if (original_wd_fd == -1) {
@@ -441,46 +376,65 @@ int main(int argc, char **argv)
         goto exit_deallocate_path;
     }
     printf("[INFO] building tree, please wait\n");
-    struct file *tree = build_tree(base_path);
+    struct file *tree;
+    scanner = scan_start(base_path, &scan_options, &tree);
     if (!tree) {
         fprintf(stderr, "[ERROR] failed to build a tree, check path\n");
         exit_code = 1;
         goto exit_original_fd;
     }
+    if (scan_options.estimate > 0) {
+        if (!scan_wait(scanner, scan_options.estimate)) {
+            printf("[INFO] showing estimates, the scan continues in the "
+                   "background\n");
+        }
+    } else {
+        scan_wait(scanner, -1);
+        finish_scan();
+    }
     struct file *cur = tree;
     char *line = NULL;
     for (;;) {
-        chdir(cur->name);
+        fs_chdir(cur->name);
         print_node(cur);
         line = readline("> ");
         if (!line) {
             break;
         }
-        if (*line == '/') {
-            cur = process_command(cur, line);
-            if (cur == NULL) {
-                exit_code = 0;
-                goto exit_tree;
-            }
-        } else {
-            char *name = extract_name(line);
-            struct file *nxt = next_entity(cur, name);
-            if (!nxt) {
-                fprintf(stderr, "[ERROR] no such file: %s\n", name);
-            } else {
-                cur = nxt;
-            }
+        if (record) {
+            fprintf(record, "%s\n", line);
+            fflush(record);
         }
+        cur = process_line(cur, line);
         free(line);
+        if (cur == NULL) {
+            tree = NULL;  /* removed along with the root */
+            exit_code = 0;
+            goto exit_tree;
+        }
     }
 
 exit_tree:
+    scan_stop(scanner);
+    if (stats_at_exit) {
+        stats_print(stderr);
+    }
+    if (trace_path && trace_write(trace_path) != 0) {
+        fprintf(stderr, "[ERROR] cannot write trace %s\n", trace_path);
+    }
     deallocate_files(tree);
 exit_original_fd:
     fchdir(original_wd_fd);
     close(original_wd_fd);
 exit_deallocate_path:
     free(base_path);
-exit_vanilla:
+exit_fake_fs:
+    if (record) {
+        fclose(record);
+    }
+    if (fake_fs) {
+        fs_set_backend(&native_fs);
+        fakefs_destroy(fake_fs);
+    }
     return exit_code;
 }
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+
+#define RETRY_ATTEMPTS 6
+#define RETRY_FIRST_DELAY 0.05
+#define MIN_TABLE_SIZE 64
+
+/* open addressing by directory path, grown at half load */
+static struct error_dir **table = NULL;
+static size_t table_size = 0;
+static size_t table_len = 0;
+static uint64_t total = 0;
+static uint64_t retried = 0;
+static uint64_t recovered = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool errors_transient(int error)
+{
+    return error == EINTR || error == ESTALE || error == EAGAIN;
+}
+
+double errors_retry_delay(unsigned attempt)
+{
+    if (attempt > RETRY_ATTEMPTS) {
+        return -1;
+    }
+    double delay = RETRY_FIRST_DELAY;
+    for (unsigned i = 1; i < attempt; ++i) {
+        delay *= 2;
+    }
+    return delay;
+}
+
+uint64_t hash_dir(const char *path, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct error_dir **find_slot(struct error_dir **slots, size_t size,
+                             const char *path, size_t len)
+{
+    size_t i = hash_dir(path, len) & (size - 1);
+    while (slots[i] && (strlen(slots[i]->path) != len
+                        || strncmp(slots[i]->path, path, len) != 0)) {
+        i = (i + 1) & (size - 1);
+    }
+    return &slots[i];
+}
+
+void grow_table(void)
+{
+    size_t size = table_size ? table_size * 2 : MIN_TABLE_SIZE;
+    struct error_dir **slots = calloc(size, sizeof(*slots));
+    for (size_t i = 0; i < table_size; ++i) {
+        if (table[i]) {
+            *find_slot(slots, size, table[i]->path,
+                       strlen(table[i]->path)) = table[i];
+        }
+    }
+    free(table);
+    table = slots;
+    table_size = size;
+}
+
+void errors_record(enum fs_op op, const char *path, int error)
+{
+    const char *slash = strrchr(path, '/');
+    /* the slot keeps exactly the len bytes it is looked up by */
+    size_t len = slash == path ? 1 : slash ? (size_t) (slash - path) : 0;
+    const char *name = slash ? slash + 1 : path;
+    pthread_mutex_lock(&lock);
+    if (2 * (table_len + 1) > table_size) {
+        grow_table();
+    }
+    struct error_dir **slot = find_slot(table, table_size, path, len);
+    if (!*slot) {
+        *slot = calloc(1, sizeof(**slot));
+        (*slot)->path = strndup(path, len);
+        ++table_len;
+    }
+    struct error_dir *d = *slot;
+    if (d->samples < ERROR_SAMPLES) {
+        struct error_sample *sample = &d->sample[d->samples++];
+        sample->name = strdup(name);
+        sample->error = error;
+        sample->op = op;
+    }
+    ++d->count;
+    ++total;
+    pthread_mutex_unlock(&lock);
+}
+
+void errors_retried(bool success)
+{
+    pthread_mutex_lock(&lock);
+    ++retried;
+    recovered += success;
+    pthread_mutex_unlock(&lock);
+}
+
+uint64_t errors_count(void)
+{
+    pthread_mutex_lock(&lock);
+    uint64_t result = total;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int compare_counts(const void *a, const void *b)
+{
+    uint64_t count_a = (*(struct error_dir *const *) a)->count;
+    uint64_t count_b = (*(struct error_dir *const *) b)->count;
+    return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+void errors_print(FILE *out, size_t max_dirs)
+{
+    pthread_mutex_lock(&lock);
+    fprintf(out, "%llu errors in %zu directories; %llu transient ones "
+            "retried, %llu of them recovered\n", (unsigned long long) total,
+            table_len, (unsigned long long) retried,
+            (unsigned long long) recovered);
+    if (table_len == 0) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    struct error_dir **dirs = malloc(table_len * sizeof(*dirs));
+    size_t count = 0;
+    for (size_t i = 0; i < table_size; ++i) {
+        if (table[i]) {
+            dirs[count++] = table[i];
+        }
+    }
+    qsort(dirs, count, sizeof(*dirs), compare_counts);
+    fprintf(out, "%10s  %s\n", "errors", "directory");
+    for (int i = 0; i < 80; ++i) {
+        fputc('-', out);
+    }
+    fputc('\n', out);
+    for (size_t i = 0; i < count && i < max_dirs; ++i) {
+        fprintf(out, "%10llu  %s\n", (unsigned long long) dirs[i]->count,
+                dirs[i]->path[0] ? dirs[i]->path : ".");
+        for (unsigned j = 0; j < dirs[i]->samples; ++j) {
+            struct error_sample *sample = &dirs[i]->sample[j];
+            fprintf(out, "%10s    %s: %s failed, %s\n", "", sample->name,
+                    fs_op_name(sample->op), strerror(sample->error));
+        }
+        if (dirs[i]->count > dirs[i]->samples) {
+            fprintf(out, "%10s    ...\n", "");
+        }
+    }
+    if (count > max_dirs) {
+        fprintf(out, "... and %zu more directories\n", count - max_dirs);
+    }
+    free(dirs);
+    pthread_mutex_unlock(&lock);
+}
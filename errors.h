@@ -0,0 +1,43 @@
+#ifndef ERRORS_H
+#define ERRORS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fs.h"
+
+/* Failed filesystem calls of the scanner and the delete engine. They do
+ * not stop either: every failure is counted against the directory that
+ * holds the entry, with the first few kept as samples, and the work goes
+ * on without the entry. */
+
+#define ERROR_SAMPLES 4
+
+struct error_sample {
+    char *name;
+    int error;
+    enum fs_op op;
+};
+
+struct error_dir {
+    char *path;
+    uint64_t count;
+    unsigned samples;
+    struct error_sample sample[ERROR_SAMPLES];
+};
+
+/* EINTR, ESTALE and EAGAIN, which may well not happen again */
+bool errors_transient(int error);
+/* Seconds to wait before attempt (from 1) at a call that failed with a
+ * transient error; negative once it is not worth another try. */
+double errors_retry_delay(unsigned attempt);
+
+void errors_record(enum fs_op op, const char *path, int error);
+/* a transient failure was retried, and whether that worked out */
+void errors_retried(bool recovered);
+uint64_t errors_count(void);
+/* Writes the totals and the directories with the most errors. */
+void errors_print(FILE *out, size_t max_dirs);
+
+#endif
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fakefs.h"
+
+#define FAKE_DEV 1
+#define FAKE_DIR_SIZE 4096
+#define FAKE_BLOCK_SIZE 512
+
+struct fake_node {
+    char *name;
+    struct fake_node *parent;
+    struct fake_node *hash_next;
+    struct fake_node **children;
+    struct fake_node **buckets;
+    size_t count;
+    size_t cap;
+    size_t bucket_count;
+    size_t index;  /* position in parent->children */
+    mode_t mode;
+    off_t size;
+    ino_t ino;
+    bool detached;  /* unlinked, maybe still open */
+};
+
+struct fakefs {
+    struct fs_backend backend;
+    pthread_rwlock_t lock;
+    struct fake_node root;
+    /* removed nodes live until destroy, open directories may list them */
+    struct fake_node *removed;
+    ino_t next_ino;
+};
+
+struct fake_dir {
+    struct fake_node **entries;
+    size_t count;
+    size_t pos;
+    struct fs_dirent entry;
+};
+
+uint64_t hash_name(const char *name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct fake_node *find_child(struct fake_node *dir, const char *name,
+                             size_t len)
+{
+    if (!dir->bucket_count) {
+        return NULL;
+    }
+    struct fake_node *cur = dir->buckets[hash_name(name, len)
+                                         % dir->bucket_count];
+    for (; cur; cur = cur->hash_next) {
+        if (strncmp(cur->name, name, len) == 0 && cur->name[len] == '\0') {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+void insert_bucket(struct fake_node *dir, struct fake_node *node)
+{
+    struct fake_node **bucket = &dir->buckets[
+        hash_name(node->name, strlen(node->name)) % dir->bucket_count];
+    node->hash_next = *bucket;
+    *bucket = node;
+}
+
+void attach_child(struct fake_node *dir, struct fake_node *node)
+{
+    if (dir->count == dir->cap) {
+        dir->cap = dir->cap ? dir->cap * 2 : 8;
+        dir->children = realloc(dir->children,
+                                dir->cap * sizeof(*dir->children));
+        /* keep the chains short: one bucket per possible child */
+        free(dir->buckets);
+        dir->bucket_count = dir->cap;
+        dir->buckets = calloc(dir->bucket_count, sizeof(*dir->buckets));
+        for (size_t i = 0; i < dir->count; ++i) {
+            insert_bucket(dir, dir->children[i]);
+        }
+    }
+    node->parent = dir;
+    node->index = dir->count;
+    dir->children[dir->count++] = node;
+    insert_bucket(dir, node);
+}
+
+void detach_child(struct fakefs *fake, struct fake_node *node)
+{
+    struct fake_node *dir = node->parent;
+    struct fake_node **bucket = &dir->buckets[
+        hash_name(node->name, strlen(node->name)) % dir->bucket_count];
+    while (*bucket != node) {
+        bucket = &(*bucket)->hash_next;
+    }
+    *bucket = node->hash_next;
+    dir->children[node->index] = dir->children[--dir->count];
+    dir->children[node->index]->index = node->index;
+    node->hash_next = fake->removed;
+    node->detached = true;
+    fake->removed = node;
+}
+
+/* Resolves an absolute path; with create set, missing directories are
+ * made on the way. */
+struct fake_node *lookup(struct fakefs *fake, const char *path, bool create)
+{
+    if (path[0] != '/') {
+        errno = ENOENT;
+        return NULL;
+    }
+    struct fake_node *node = &fake->root;
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') {
+            ++p;
+        }
+        size_t len = strcspn(p, "/");
+        if (len == 0) {
+            break;
+        }
+        if (!S_ISDIR(node->mode)) {
+            errno = ENOTDIR;
+            return NULL;
+        }
+        struct fake_node *next;
+        if (len == 1 && p[0] == '.') {
+            next = node;
+        } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+            next = node->parent ? node->parent : node;
+        } else if (!(next = find_child(node, p, len))) {
+            if (!create) {
+                errno = ENOENT;
+                return NULL;
+            }
+            next = calloc(1, sizeof(*next));
+            next->name = strndup(p, len);
+            next->mode = S_IFDIR | 0755;
+            next->size = FAKE_DIR_SIZE;
+            next->ino = fake->next_ino++;
+            attach_child(node, next);
+        }
+        node = next;
+        p += len;
+    }
+    return node;
+}
+
+void fill_stat(const struct fake_node *node, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = FAKE_DEV;
+    st->st_ino = node->ino;
+    st->st_mode = node->mode;
+    st->st_nlink = node->detached ? 0 : 1;
+    st->st_size = node->size;
+    st->st_blksize = FAKE_DIR_SIZE;
+    st->st_blocks = (node->size + FAKE_BLOCK_SIZE - 1) / FAKE_BLOCK_SIZE;
+}
+
+int fake_lstat(struct fs_backend *fs, const char *path, struct stat *st)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    pthread_rwlock_rdlock(&fake->lock);
+    struct fake_node *node = lookup(fake, path, false);
+    if (node) {
+        fill_stat(node, st);
+    }
+    pthread_rwlock_unlock(&fake->lock);
+    return node ? 0 : -1;
+}
+
+struct fs_dir *fake_opendir(struct fs_backend *fs, const char *path)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    struct fake_dir *dir = NULL;
+    pthread_rwlock_rdlock(&fake->lock);
+    struct fake_node *node = lookup(fake, path, false);
+    if (node && !S_ISDIR(node->mode)) {
+        errno = ENOTDIR;
+    } else if (node) {
+        /* a snapshot, so that removals do not shift entries under us */
+        dir = malloc(sizeof(*dir));
+        dir->count = node->count;
+        dir->pos = 0;
+        dir->entries = NULL;
+        if (node->count) {
+            dir->entries = malloc(node->count * sizeof(*dir->entries));
+            memcpy(dir->entries, node->children,
+                   node->count * sizeof(*dir->entries));
+        }
+    }
+    pthread_rwlock_unlock(&fake->lock);
+    return (struct fs_dir *) dir;
+}
+
+struct fs_dirent *fake_readdir(struct fs_backend *fs, struct fs_dir *d)
+{
+    struct fake_dir *dir = (struct fake_dir *) d;
+    if (dir->pos == dir->count) {
+        return NULL;
+    }
+    struct fake_node *node = dir->entries[dir->pos++];
+    dir->entry.name = node->name;
+    dir->entry.ino = node->ino;
+    return &dir->entry;
+}
+
+void fake_closedir(struct fs_backend *fs, struct fs_dir *d)
+{
+    struct fake_dir *dir = (struct fake_dir *) d;
+    free(dir->entries);
+    free(dir);
+}
+
+int fake_remove(struct fs_backend *fs, const char *path, bool directory)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    int result = -1;
+    pthread_rwlock_wrlock(&fake->lock);
+    struct fake_node *node = lookup(fake, path, false);
+    if (!node) {
+        /* errno is set by lookup */
+    } else if (node == &fake->root) {
+        errno = EBUSY;
+    } else if (directory && !S_ISDIR(node->mode)) {
+        errno = ENOTDIR;
+    } else if (!directory && S_ISDIR(node->mode)) {
+        errno = EISDIR;
+    } else if (node->count) {
+        errno = ENOTEMPTY;
+    } else {
+        detach_child(fake, node);
+        result = 0;
+    }
+    pthread_rwlock_unlock(&fake->lock);
+    return result;
+}
+
+int fake_unlink(struct fs_backend *fs, const char *path)
+{
+    return fake_remove(fs, path, false);
+}
+
+int fake_rmdir(struct fs_backend *fs, const char *path)
+{
+    return fake_remove(fs, path, true);
+}
+
+int fake_chdir(struct fs_backend *fs, const char *path)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    int result = 0;
+    pthread_rwlock_rdlock(&fake->lock);
+    struct fake_node *node = lookup(fake, path, false);
+    if (!node) {
+        result = -1;
+    } else if (!S_ISDIR(node->mode)) {
+        errno = ENOTDIR;
+        result = -1;
+    }
+    pthread_rwlock_unlock(&fake->lock);
+    return result;
+}
+
+/* the node itself stands for the open file; removed nodes stay around */
+struct fs_file *fake_open_file(struct fs_backend *fs, const char *path)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    pthread_rwlock_rdlock(&fake->lock);
+    struct fake_node *node = lookup(fake, path, false);
+    if (node && !S_ISREG(node->mode)) {
+        errno = EINVAL;
+        node = NULL;
+    }
+    pthread_rwlock_unlock(&fake->lock);
+    return (struct fs_file *) node;
+}
+
+int fake_fstat(struct fs_backend *fs, struct fs_file *file, struct stat *st)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    pthread_rwlock_rdlock(&fake->lock);
+    fill_stat((struct fake_node *) file, st);
+    pthread_rwlock_unlock(&fake->lock);
+    return 0;
+}
+
+int fake_truncate(struct fs_backend *fs, struct fs_file *file, off_t length)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    pthread_rwlock_wrlock(&fake->lock);
+    ((struct fake_node *) file)->size = length;
+    pthread_rwlock_unlock(&fake->lock);
+    return 0;
+}
+
+void fake_close_file(struct fs_backend *fs, struct fs_file *file)
+{
+}
+
+struct fs_backend *fakefs_create(void)
+{
+    struct fakefs *fake = calloc(1, sizeof(*fake));
+    fake->backend.lstat = fake_lstat;
+    fake->backend.opendir = fake_opendir;
+    fake->backend.readdir = fake_readdir;
+    fake->backend.closedir = fake_closedir;
+    fake->backend.unlink = fake_unlink;
+    fake->backend.rmdir = fake_rmdir;
+    fake->backend.chdir = fake_chdir;
+    fake->backend.open_file = fake_open_file;
+    fake->backend.fstat = fake_fstat;
+    fake->backend.truncate = fake_truncate;
+    fake->backend.close_file = fake_close_file;
+    pthread_rwlock_init(&fake->lock, NULL);
+    fake->root.name = strdup("/");
+    fake->root.mode = S_IFDIR | 0755;
+    fake->root.size = FAKE_DIR_SIZE;
+    fake->root.ino = 2;
+    fake->next_ino = 3;
+    return &fake->backend;
+}
+
+void free_fake_node(struct fake_node *node)
+{
+    for (size_t i = 0; i < node->count; ++i) {
+        free_fake_node(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    free(node->buckets);
+    free(node->name);
+}
+
+void fakefs_destroy(struct fs_backend *fs)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    free_fake_node(&fake->root);
+    while (fake->removed) {
+        struct fake_node *next = fake->removed->hash_next;
+        free_fake_node(fake->removed);
+        free(fake->removed);
+        fake->removed = next;
+    }
+    pthread_rwlock_destroy(&fake->lock);
+    free(fake);
+}
+
+int fakefs_add(struct fs_backend *fs, const char *path, mode_t mode,
+               off_t size, ino_t ino)
+{
+    struct fakefs *fake = (struct fakefs *) fs;
+    int result = 0;
+    pthread_rwlock_wrlock(&fake->lock);
+    const char *slash = strrchr(path, '/');
+    struct fake_node *node;
+    if (!slash) {
+        errno = ENOENT;
+        result = -1;
+    } else if (slash[1] == '\0' || S_ISDIR(mode)) {
+        /* directories may already exist as parents of earlier entries */
+        if ((node = lookup(fake, path, true))) {
+            node->mode = mode;
+            node->size = size;
+            node->ino = ino ? ino : node->ino;
+        } else {
+            result = -1;
+        }
+    } else {
+        char *dir_path = strndup(path, slash - path + 1);
+        struct fake_node *dir = lookup(fake, dir_path, true);
+        free(dir_path);
+        if (!dir) {
+            result = -1;
+        } else if (!S_ISDIR(dir->mode)) {
+            errno = ENOTDIR;
+            result = -1;
+        } else if (find_child(dir, slash + 1, strlen(slash + 1))) {
+            errno = EEXIST;
+            result = -1;
+        } else {
+            node = calloc(1, sizeof(*node));
+            node->name = strdup(slash + 1);
+            node->mode = mode;
+            node->size = size;
+            node->ino = ino ? ino : fake->next_ino++;
+            attach_child(dir, node);
+        }
+    }
+    pthread_rwlock_unlock(&fake->lock);
+    return result;
+}
+
+mode_t find_type(char type)
+{
+    switch (type) {
+    case 'f':
+        return S_IFREG;
+    case 'd':
+        return S_IFDIR;
+    case 'l':
+        return S_IFLNK;
+    case 'b':
+        return S_IFBLK;
+    case 'c':
+        return S_IFCHR;
+    case 'p':
+        return S_IFIFO;
+    case 's':
+        return S_IFSOCK;
+    default:
+        return 0;
+    }
+}
+
+long fakefs_load(struct fs_backend *fs, FILE *manifest)
+{
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    long count = 0;
+    while ((len = getline(&line, &line_cap, manifest)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        char type;
+        long long size;
+        unsigned long long ino;
+        int path_offset = 0;
+        if (sscanf(line, "%c %lld %llu %n", &type, &size, &ino,
+                   &path_offset) != 3 || !path_offset || !find_type(type)
+            || fakefs_add(fs, line + path_offset, find_type(type) | 0644,
+                          size, ino) != 0) {
+            count = -1;
+            break;
+        }
+        ++count;
+    }
+    free(line);
+    return count;
+}
@@ -0,0 +1,20 @@
+#ifndef FAKEFS_H
+#define FAKEFS_H
+
+#include <stdio.h>
+
+#include "fs.h"
+
+/* An in-memory filesystem for benchmarks and experiments. Paths are
+ * absolute; missing parent directories are created on demand. */
+
+struct fs_backend *fakefs_create(void);
+void fakefs_destroy(struct fs_backend *fs);
+/* ino 0 picks a fresh inode number; entries sharing one are hard links */
+int fakefs_add(struct fs_backend *fs, const char *path, mode_t mode,
+               off_t size, ino_t ino);
+/* Reads lines of "TYPE SIZE INO PATH" as printed by
+ * find PATH -printf '%y %s %i %p\n'; returns the number of entries or -1. */
+long fakefs_load(struct fs_backend *fs, FILE *manifest);
+
+#endif
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "errors.h"
+#include "fs.h"
+#include "iolimit.h"
+#include "stats.h"
+
+#define ERROR_RATE_SCALE 1000000
+/* a path that draws a transient fault fails this many calls, then works */
+#define TRANSIENT_FAULT_REPEAT 2
+#define FAULT_ATTEMPT_SLOTS (1 << 16)
+
+struct native_dir {
+    DIR *dir;
+    struct fs_dirent entry;
+};
+
+struct native_file {
+    int fd;
+};
+
+struct fault {
+    double latency;
+    uint32_t error_rate;  /* per ERROR_RATE_SCALE calls */
+    int error;
+};
+
+static const char *const op_names[FS_OP_COUNT] = {
+    "stat", "opendir", "readdir", "unlink", "rmdir", "truncate",
+};
+
+static const struct {
+    const char *name;
+    int value;
+} error_names[] = {
+    {"EACCES", EACCES},
+    {"EAGAIN", EAGAIN},
+    {"EBUSY", EBUSY},
+    {"EINTR", EINTR},
+    {"EIO", EIO},
+    {"ENOENT", ENOENT},
+    {"ENOTEMPTY", ENOTEMPTY},
+    {"EPERM", EPERM},
+    {"ESTALE", ESTALE},
+};
+
+static struct fs_backend *backend = &native_fs;
+static struct fault faults[FS_OP_COUNT];
+static bool faults_enabled = false;
+static uint64_t fault_seed = 0;
+static uint64_t calls[FS_OP_COUNT];
+/* calls that drew a transient fault, by hash of op and path; paths that
+ * share a slot share the count */
+static uint32_t fault_attempts[FAULT_ATTEMPT_SLOTS];
+
+int native_lstat(struct fs_backend *fs, const char *path, struct stat *st)
+{
+    return lstat(path, st);
+}
+
+struct fs_dir *native_opendir(struct fs_backend *fs, const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return NULL;
+    }
+    struct native_dir *result = malloc(sizeof(*result));
+    result->dir = dir;
+    return (struct fs_dir *) result;
+}
+
+struct fs_dirent *native_readdir(struct fs_backend *fs, struct fs_dir *dir)
+{
+    struct native_dir *native = (struct native_dir *) dir;
+    struct dirent *dirent = readdir(native->dir);
+    if (!dirent) {
+        return NULL;
+    }
+    native->entry.name = dirent->d_name;
+    native->entry.ino = dirent->d_ino;
+    return &native->entry;
+}
+
+void native_closedir(struct fs_backend *fs, struct fs_dir *dir)
+{
+    struct native_dir *native = (struct native_dir *) dir;
+    closedir(native->dir);
+    free(native);
+}
+
+int native_unlink(struct fs_backend *fs, const char *path)
+{
+    return unlink(path);
+}
+
+int native_rmdir(struct fs_backend *fs, const char *path)
+{
+    return rmdir(path);
+}
+
+int native_chdir(struct fs_backend *fs, const char *path)
+{
+    return chdir(path);
+}
+
+struct fs_file *native_open_file(struct fs_backend *fs, const char *path)
+{
+    /* O_NONBLOCK keeps a FIFO or a mandatory lock from hanging the delete */
+    int fd = open(path, O_WRONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    struct native_file *result = malloc(sizeof(*result));
+    result->fd = fd;
+    return (struct fs_file *) result;
+}
+
+int native_fstat(struct fs_backend *fs, struct fs_file *file, struct stat *st)
+{
+    return fstat(((struct native_file *) file)->fd, st);
+}
+
+int native_truncate(struct fs_backend *fs, struct fs_file *file, off_t length)
+{
+    return ftruncate(((struct native_file *) file)->fd, length);
+}
+
+void native_close_file(struct fs_backend *fs, struct fs_file *file)
+{
+    close(((struct native_file *) file)->fd);
+    free(file);
+}
+
+struct fs_backend native_fs = {
+    native_lstat,
+    native_opendir,
+    native_readdir,
+    native_closedir,
+    native_unlink,
+    native_rmdir,
+    native_chdir,
+    native_open_file,
+    native_fstat,
+    native_truncate,
+    native_close_file,
+};
+
+const char *fs_op_name(enum fs_op op)
+{
+    return op_names[op];
+}
+
+void fs_get_counts(uint64_t counts[FS_OP_COUNT])
+{
+    for (int op = 0; op < FS_OP_COUNT; ++op) {
+        counts[op] = __atomic_load_n(&calls[op], __ATOMIC_RELAXED);
+    }
+}
+
+void fs_reset_counts(void)
+{
+    for (int op = 0; op < FS_OP_COUNT; ++op) {
+        __atomic_store_n(&calls[op], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void fs_set_backend(struct fs_backend *fs)
+{
+    backend = fs;
+}
+
+bool fs_is_native(void)
+{
+    return backend == &native_fs;
+}
+
+bool fs_is_rotational(dev_t dev)
+{
+    if (!fs_is_native()) {
+        return false;
+    }
+    /* a partition has its queue in the directory of the whole disk */
+    static const char *const formats[] = {
+        "/sys/dev/block/%u:%u/queue/rotational",
+        "/sys/dev/block/%u:%u/../queue/rotational",
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), formats[i], major(dev), minor(dev));
+        FILE *in = fopen(path, "r");
+        if (in) {
+            int rotational = fgetc(in);
+            fclose(in);
+            return rotational == '1';
+        }
+    }
+    return false;
+}
+
+int find_op(const char *name, size_t len)
+{
+    for (int op = 0; op < FS_OP_COUNT; ++op) {
+        if (strlen(op_names[op]) == len && strncmp(op_names[op], name, len) == 0) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+int find_error(const char *name)
+{
+    for (size_t i = 0; i < sizeof(error_names) / sizeof(*error_names); ++i) {
+        if (strcmp(error_names[i].name, name) == 0) {
+            return error_names[i].value;
+        }
+    }
+    return 0;
+}
+
+/* Calls parse_item(op, value, value_end) for every op=value of spec. */
+int parse_spec(const char *spec, int (*parse_item)(int, const char *,
+                                                   const char *))
+{
+    while (*spec) {
+        const char *end = strchr(spec, ',');
+        if (!end) {
+            end = spec + strlen(spec);
+        }
+        const char *eq = memchr(spec, '=', end - spec);
+        if (!eq) {
+            return -1;
+        }
+        int op = find_op(spec, eq - spec);
+        if (eq - spec == 4 && strncmp(spec, "seed", 4) == 0) {
+            op = FS_OP_COUNT;
+        }
+        if (op < 0 || parse_item(op, eq + 1, end) != 0) {
+            return -1;
+        }
+        spec = *end ? end + 1 : end;
+    }
+    faults_enabled = true;
+    return 0;
+}
+
+int parse_latency(int op, const char *value, const char *value_end)
+{
+    char *end;
+    double latency = strtod(value, &end);
+    if (op == FS_OP_COUNT || end != value_end || end == value || latency < 0) {
+        return -1;
+    }
+    faults[op].latency = latency;
+    return 0;
+}
+
+int parse_error(int op, const char *value, const char *value_end)
+{
+    char *end;
+    if (op == FS_OP_COUNT) {
+        fault_seed = strtoull(value, &end, 10);
+        return end == value_end && end != value ? 0 : -1;
+    } else if (op == FS_READDIR || op == FS_TRUNCATE) {
+        return -1;  /* no path to pick the failing calls by */
+    }
+    double rate = strtod(value, &end);
+    if (end == value || rate < 0 || rate > 1) {
+        return -1;
+    }
+    int error = EIO;
+    if (end != value_end) {
+        char name[16];
+        size_t len = value_end - end - 1;
+        if (*end != ':' || len == 0 || len >= sizeof(name)) {
+            return -1;
+        }
+        memcpy(name, end + 1, len);
+        name[len] = '\0';
+        if (!(error = find_error(name))) {
+            return -1;
+        }
+    }
+    faults[op].error_rate = (uint32_t) (rate * ERROR_RATE_SCALE);
+    faults[op].error = error;
+    return 0;
+}
+
+int fs_set_latency(const char *spec)
+{
+    return parse_spec(spec, parse_latency);
+}
+
+int fs_set_errors(const char *spec)
+{
+    return parse_spec(spec, parse_error);
+}
+
+/* Counts the call and sleeps for the injected latency; returns -1 with
+ * errno set if the call has to fail. */
+int inject_fault(enum fs_op op, const char *path)
+{
+    __atomic_add_fetch(&calls[op], 1, __ATOMIC_RELAXED);
+    STATS_ADD(STATS_LSTAT + op, 1);
+    if (!faults_enabled) {
+        return 0;
+    }
+    struct fault *fault = &faults[op];
+    if (fault->latency > 0) {
+        sleep_seconds(fault->latency);
+    }
+    if (fault->error_rate && path) {
+        /* FNV-1a keeps the outcome independent of thread interleaving */
+        uint64_t hash = 14695981039346656037ULL ^ fault_seed ^ op;
+        for (const char *p = path; *p; ++p) {
+            hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+        }
+        /* a transient error goes away after a few tries, like a real
+         * one would, so that the retries have something to recover */
+        if (hash % ERROR_RATE_SCALE < fault->error_rate
+            && (!errors_transient(fault->error)
+                || __atomic_fetch_add(&fault_attempts[(hash >> 32)
+                                                      % FAULT_ATTEMPT_SLOTS],
+                                      1, __ATOMIC_RELAXED)
+                   < TRANSIENT_FAULT_REPEAT)) {
+            errno = fault->error;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* the phase times include injected latency, like a slow disk would */
+int fs_lstat(const char *path, struct stat *st)
+{
+    STATS_START(start);
+    int result = inject_fault(FS_LSTAT, path) ? -1
+                 : backend->lstat(backend, path, st);
+    STATS_END(PHASE_STAT, start);
+    return result;
+}
+
+struct fs_dir *fs_opendir(const char *path)
+{
+    STATS_START(start);
+    struct fs_dir *result = inject_fault(FS_OPENDIR, path) ? NULL
+                            : backend->opendir(backend, path);
+    STATS_END(PHASE_LIST, start);
+    return result;
+}
+
+struct fs_dirent *fs_readdir(struct fs_dir *dir)
+{
+    STATS_START(start);
+    inject_fault(FS_READDIR, NULL);  /* only latency, like fs_truncate */
+    struct fs_dirent *result = backend->readdir(backend, dir);
+    STATS_END(PHASE_LIST, start);
+    return result;
+}
+
+void fs_closedir(struct fs_dir *dir)
+{
+    backend->closedir(backend, dir);
+}
+
+int fs_unlink(const char *path)
+{
+    STATS_START(start);
+    int result = inject_fault(FS_UNLINK, path) ? -1
+                 : backend->unlink(backend, path);
+    STATS_END(PHASE_DELETE, start);
+    return result;
+}
+
+int fs_rmdir(const char *path)
+{
+    STATS_START(start);
+    int result = inject_fault(FS_RMDIR, path) ? -1
+                 : backend->rmdir(backend, path);
+    STATS_END(PHASE_DELETE, start);
+    return result;
+}
+
+int fs_chdir(const char *path)
+{
+    return backend->chdir(backend, path);
+}
+
+struct fs_file *fs_open_file(const char *path)
+{
+    return backend->open_file(backend, path);
+}
+
+int fs_fstat(struct fs_file *file, struct stat *st)
+{
+    return backend->fstat(backend, file, st);
+}
+
+/* only latency applies: errors need a path to pick the failing calls */
+int fs_truncate(struct fs_file *file, off_t length)
+{
+    STATS_START(start);
+    inject_fault(FS_TRUNCATE, NULL);
+    int result = backend->truncate(backend, file, length);
+    STATS_END(PHASE_DELETE, start);
+    return result;
+}
+
+void fs_close_file(struct fs_file *file)
+{
+    backend->close_file(backend, file);
+}
@@ -0,0 +1,82 @@
+#ifndef FS_H
+#define FS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* All filesystem access of the scanner, the delete engine and the browser
+ * goes through a backend, so that they can run against an in-memory tree
+ * (see fakefs.h) and with injected latency and errors. Failures return -1
+ * or NULL and set errno, like the system calls they stand for. */
+
+struct fs_dir;
+struct fs_file;
+
+struct fs_dirent {
+    const char *name;
+    ino_t ino;
+};
+
+struct fs_backend {
+    int (*lstat)(struct fs_backend *fs, const char *path, struct stat *st);
+    struct fs_dir *(*opendir)(struct fs_backend *fs, const char *path);
+    /* the entry stays valid until the next call on the same dir */
+    struct fs_dirent *(*readdir)(struct fs_backend *fs, struct fs_dir *dir);
+    void (*closedir)(struct fs_backend *fs, struct fs_dir *dir);
+    int (*unlink)(struct fs_backend *fs, const char *path);
+    int (*rmdir)(struct fs_backend *fs, const char *path);
+    int (*chdir)(struct fs_backend *fs, const char *path);
+    /* a regular file opened for writing, without following symlinks */
+    struct fs_file *(*open_file)(struct fs_backend *fs, const char *path);
+    int (*fstat)(struct fs_backend *fs, struct fs_file *file, struct stat *st);
+    int (*truncate)(struct fs_backend *fs, struct fs_file *file,
+                    off_t length);
+    void (*close_file)(struct fs_backend *fs, struct fs_file *file);
+};
+
+enum fs_op {
+    FS_LSTAT,
+    FS_OPENDIR,
+    FS_READDIR,
+    FS_UNLINK,
+    FS_RMDIR,
+    FS_TRUNCATE,
+    FS_OP_COUNT
+};
+
+extern struct fs_backend native_fs;
+
+const char *fs_op_name(enum fs_op op);
+/* calls made through the backend since the last reset */
+void fs_get_counts(uint64_t counts[FS_OP_COUNT]);
+void fs_reset_counts(void);
+
+void fs_set_backend(struct fs_backend *backend);
+bool fs_is_native(void);
+/* whether dev is a spinning disk, as sysfs says; false for the fake fs
+ * and for devices without a block queue, like network filesystems */
+bool fs_is_rotational(dev_t dev);
+
+/* spec is a comma separated list of op=seconds, e.g. "stat=0.002" */
+int fs_set_latency(const char *spec);
+/* spec is a comma separated list of op=rate[:ERRNO] and seed=N, for stat,
+ * opendir, unlink and rmdir; whether an op fails depends only on the seed,
+ * the op and the path. A transient error (see errors_transient) fails the
+ * first two calls of a path and then lets it through. */
+int fs_set_errors(const char *spec);
+
+int fs_lstat(const char *path, struct stat *st);
+struct fs_dir *fs_opendir(const char *path);
+struct fs_dirent *fs_readdir(struct fs_dir *dir);
+void fs_closedir(struct fs_dir *dir);
+int fs_unlink(const char *path);
+int fs_rmdir(const char *path);
+int fs_chdir(const char *path);
+struct fs_file *fs_open_file(const char *path);
+int fs_fstat(struct fs_file *file, struct stat *st);
+int fs_truncate(struct fs_file *file, off_t length);
+void fs_close_file(struct fs_file *file);
+
+#endif
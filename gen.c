@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fakefs.h"
+#include "gen.h"
+#include "tree.h"
+
+#define GEN_MAX_NAME 255
+#define GEN_LINK_POOL 1024
+#define GEN_DIR_SIZE 4096
+#define GEN_FIRST_INO 3
+#define GEN_MIN_DIR_CAP 64
+
+struct gen_state {
+    uint64_t rng;
+    ino_t next_ino;
+    /* recent files, candidates for hard links */
+    ino_t pool_ino[GEN_LINK_POOL];
+    off_t pool_size[GEN_LINK_POOL];
+    size_t pool_len;
+};
+
+struct gen_queue {
+    char **paths;
+    unsigned *depths;
+    size_t head;
+    size_t len;
+    size_t cap;
+};
+
+void gen_options_init(struct gen_options *opts, size_t entries)
+{
+    opts->seed = 1;
+    opts->entries = entries;
+    opts->fanout = 4;
+    opts->max_depth = 12;
+    opts->files_per_dir = 12;
+    opts->name_min = 4;
+    opts->name_max = 20;
+    opts->size_mu = log(16384);
+    opts->size_sigma = 2.5;
+    opts->hardlinks = 0.01;
+    opts->flat_dirs = 1;
+    opts->flat_entries = entries / 10;
+}
+
+int gen_parse_option(struct gen_options *opts, const char *option)
+{
+    const char *value = strchr(option, '=');
+    if (!value) {
+        return -1;
+    }
+    size_t key_len = value - option;
+    ++value;
+    char *end;
+    double a;
+    double b;
+    if (key_len == 4 && strncmp(option, "seed", 4) == 0) {
+        opts->seed = strtoull(value, &end, 10);
+    } else if (key_len == 6 && strncmp(option, "fanout", 6) == 0) {
+        opts->fanout = strtod(value, &end);
+    } else if (key_len == 5 && strncmp(option, "depth", 5) == 0) {
+        opts->max_depth = strtoul(value, &end, 10);
+    } else if (key_len == 5 && strncmp(option, "files", 5) == 0) {
+        opts->files_per_dir = strtod(value, &end);
+    } else if (key_len == 9 && strncmp(option, "hardlinks", 9) == 0) {
+        opts->hardlinks = strtod(value, &end);
+    } else if (key_len == 4 && strncmp(option, "name", 4) == 0) {
+        /* name=MIN:MAX */
+        opts->name_min = strtoul(value, &end, 10);
+        if (*end != ':') {
+            return -1;
+        }
+        opts->name_max = strtoul(end + 1, &end, 10);
+        if (opts->name_min < 1 || opts->name_max < opts->name_min
+            || opts->name_max > GEN_MAX_NAME - 16) {
+            return -1;
+        }
+    } else if (key_len == 4 && strncmp(option, "size", 4) == 0) {
+        /* size=MEDIAN:SIGMA, the median in bytes */
+        a = strtod(value, &end);
+        if (*end != ':' || a < 1) {
+            return -1;
+        }
+        b = strtod(end + 1, &end);
+        opts->size_mu = log(a);
+        opts->size_sigma = b;
+    } else if (key_len == 4 && strncmp(option, "flat", 4) == 0) {
+        /* flat=DIRS:ENTRIES */
+        opts->flat_dirs = strtoul(value, &end, 10);
+        if (*end != ':') {
+            return -1;
+        }
+        opts->flat_entries = strtoul(end + 1, &end, 10);
+    } else {
+        return -1;
+    }
+    return *end || end == value ? -1 : 0;
+}
+
+uint64_t gen_random(struct gen_state *state)
+{
+    /* splitmix64 */
+    uint64_t z = (state->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+double gen_uniform(struct gen_state *state)
+{
+    return (gen_random(state) >> 11) * (1. / 9007199254740992.);
+}
+
+size_t gen_geometric(struct gen_state *state, double mean)
+{
+    if (mean <= 0) {
+        return 0;
+    }
+    double p = 1. / (1. + mean);
+    return (size_t) floor(log(1. - gen_uniform(state)) / log(1. - p));
+}
+
+double gen_normal(struct gen_state *state)
+{
+    double u = 1. - gen_uniform(state);
+    double v = gen_uniform(state);
+    return sqrt(-2. * log(u)) * cos(2. * M_PI * v);
+}
+
+/* A random name made unique by the entry's index after the last dot. */
+void gen_name(struct gen_state *state, const struct gen_options *opts,
+              size_t index, char *name)
+{
+    static const char ALPHABET[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+    char suffix[24];
+    int suffix_len = 0;
+    do {
+        suffix[suffix_len++] = "0123456789abcdefghijklmnopqrstuvwxyz"[index % 36];
+        index /= 36;
+    } while (index);
+    unsigned len = opts->name_min
+                   + gen_random(state) % (opts->name_max - opts->name_min + 1);
+    int prefix_len = (int) len - suffix_len - 1;
+    if (prefix_len < 1) {
+        prefix_len = 1;
+    }
+    for (int i = 0; i < prefix_len; ++i) {
+        *(name++) = ALPHABET[gen_random(state) % (sizeof(ALPHABET) - 1)];
+    }
+    *(name++) = '.';
+    while (suffix_len) {
+        *(name++) = suffix[--suffix_len];
+    }
+    *name = '\0';
+}
+
+int gen_file(struct gen_state *state, const struct gen_options *opts,
+             const char *dir, size_t index, struct gen_sink *sink)
+{
+    char name[GEN_MAX_NAME + 1];
+    gen_name(state, opts, index, name);
+    char *path = concat_path(dir, name);
+    ino_t ino;
+    off_t size;
+    if (state->pool_len && gen_uniform(state) < opts->hardlinks) {
+        size_t i = gen_random(state) % state->pool_len;
+        ino = state->pool_ino[i];
+        size = state->pool_size[i];
+    } else {
+        ino = state->next_ino++;
+        size = (off_t) exp(opts->size_mu + opts->size_sigma
+                                           * gen_normal(state));
+        size_t i = state->pool_len < GEN_LINK_POOL ? state->pool_len++
+                   : gen_random(state) % GEN_LINK_POOL;
+        state->pool_ino[i] = ino;
+        state->pool_size[i] = size;
+    }
+    int result = sink->emit(sink, path, S_IFREG | 0644, size, ino);
+    free(path);
+    return result;
+}
+
+void gen_queue_push(struct gen_queue *queue, char *path, unsigned depth)
+{
+    if (queue->len == queue->cap) {
+        queue->cap = queue->cap ? queue->cap * 2 : 64;
+        queue->paths = realloc(queue->paths, queue->cap * sizeof(char *));
+        queue->depths = realloc(queue->depths, queue->cap * sizeof(unsigned));
+    }
+    queue->paths[queue->len] = path;
+    queue->depths[queue->len] = depth;
+    ++queue->len;
+}
+
+long gen_tree(const struct gen_options *opts, const char *root,
+              struct gen_sink *sink)
+{
+    struct gen_state state = {
+        .rng = opts->seed,
+        .next_ino = GEN_FIRST_INO,
+    };
+    struct gen_queue queue = {0};
+    long count = 0;
+    int failed = sink->emit(sink, root, S_IFDIR | 0755, GEN_DIR_SIZE,
+                            state.next_ino++);
+
+    for (size_t i = 0; i < opts->flat_dirs && !failed; ++i) {
+        char name[32];
+        sprintf(name, "FLAT.%zu", i);  /* no generated name is upper case */
+        char *dir = concat_path(root, name);
+        failed = sink->emit(sink, dir, S_IFDIR | 0755, GEN_DIR_SIZE,
+                            state.next_ino++);
+        ++count;
+        for (size_t j = 0; j < opts->flat_entries && !failed; ++j) {
+            failed = gen_file(&state, opts, dir, j, sink);
+            ++count;
+        }
+        free(dir);
+    }
+
+    /* breadth first, so that the shape does not depend on the target */
+    gen_queue_push(&queue, strdup(root), 0);
+    while (queue.head < queue.len && (size_t) count < opts->entries
+           && !failed) {
+        char *dir = queue.paths[queue.head];
+        unsigned depth = queue.depths[queue.head];
+        ++queue.head;
+        size_t files = gen_geometric(&state, opts->files_per_dir);
+        size_t subdirs = depth < opts->max_depth
+                         ? gen_geometric(&state, opts->fanout) : 0;
+        if (queue.head == queue.len && !subdirs) {
+            /* never let the tree die out before the target */
+            if (depth < opts->max_depth) {
+                subdirs = 1;
+            } else {
+                files = opts->entries - count;
+            }
+        }
+        size_t index = 0;
+        for (size_t i = 0; i < files && (size_t) count < opts->entries
+                           && !failed; ++i) {
+            failed = gen_file(&state, opts, dir, index++, sink);
+            ++count;
+        }
+        for (size_t i = 0; i < subdirs && (size_t) count < opts->entries
+                           && !failed; ++i) {
+            char name[GEN_MAX_NAME + 1];
+            gen_name(&state, opts, index++, name);
+            char *path = concat_path(dir, name);
+            failed = sink->emit(sink, path, S_IFDIR | 0755, GEN_DIR_SIZE,
+                                state.next_ino++);
+            gen_queue_push(&queue, path, depth + 1);
+            ++count;
+        }
+        free(dir);
+    }
+    for (; queue.head < queue.len; ++queue.head) {
+        free(queue.paths[queue.head]);
+    }
+    free(queue.paths);
+    free(queue.depths);
+    return failed ? -1 : count;
+}
+
+int emit_fakefs(struct gen_sink *sink, const char *path, mode_t mode,
+                off_t size, ino_t ino)
+{
+    struct gen_fakefs_sink *fake = (struct gen_fakefs_sink *) sink;
+    return fakefs_add(fake->fs, path, mode, size, ino);
+}
+
+void gen_fakefs_sink_init(struct gen_fakefs_sink *sink, struct fs_backend *fs)
+{
+    sink->sink.emit = emit_fakefs;
+    sink->fs = fs;
+}
+
+int emit_manifest(struct gen_sink *sink, const char *path, mode_t mode,
+                  off_t size, ino_t ino)
+{
+    struct gen_manifest_sink *manifest = (struct gen_manifest_sink *) sink;
+    return fprintf(manifest->out, "%c %lld %llu %s\n", S_ISDIR(mode) ? 'd' : 'f',
+                   (long long) size, (unsigned long long) ino, path) < 0;
+}
+
+void gen_manifest_sink_init(struct gen_manifest_sink *sink, FILE *out)
+{
+    sink->sink.emit = emit_manifest;
+    sink->out = out;
+}
+
+int emit_disk(struct gen_sink *sink, const char *path, mode_t mode,
+              off_t size, ino_t ino)
+{
+    struct gen_disk_sink *disk = (struct gen_disk_sink *) sink;
+    if (S_ISDIR(mode)) {
+        return mkdir(path, mode & 07777) != 0 && errno != EEXIST;
+    }
+    if (ino < disk->cap && disk->paths[ino]) {
+        return link(disk->paths[ino], path);
+    }
+    /* sparse files: the tree shape matters here, not the data */
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode & 07777);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = ftruncate(fd, size);
+    close(fd);
+    if (ino >= disk->cap) {
+        size_t cap = disk->cap ? disk->cap : 1024;
+        while (cap <= ino) {
+            cap *= 2;
+        }
+        disk->paths = realloc(disk->paths, cap * sizeof(*disk->paths));
+        memset(disk->paths + disk->cap, 0,
+               (cap - disk->cap) * sizeof(*disk->paths));
+        disk->cap = cap;
+    }
+    disk->paths[ino] = strdup(path);
+    return result;
+}
+
+void gen_disk_sink_init(struct gen_disk_sink *sink)
+{
+    sink->sink.emit = emit_disk;
+    sink->paths = NULL;
+    sink->cap = 0;
+}
+
+void gen_disk_sink_free(struct gen_disk_sink *sink)
+{
+    for (size_t i = 0; i < sink->cap; ++i) {
+        free(sink->paths[i]);
+    }
+    free(sink->paths);
+}
+
+uint64_t hash_path(const char *path, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Returns the slot of the directory named path[0..len), or the empty slot
+ * where it belongs. */
+struct directory **find_dir_slot(struct gen_tree_sink *sink, const char *path,
+                                 size_t len)
+{
+    size_t mask = sink->dir_cap - 1;
+    size_t i = hash_path(path, len) & mask;
+    while (sink->dirs[i]) {
+        const char *name = sink->dirs[i]->file.name;
+        if (strncmp(name, path, len) == 0 && name[len] == '\0') {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &sink->dirs[i];
+}
+
+void add_dir(struct gen_tree_sink *sink, struct directory *directory)
+{
+    if (2 * (sink->dir_count + 1) > sink->dir_cap) {
+        struct directory **old = sink->dirs;
+        size_t old_cap = sink->dir_cap;
+        sink->dir_cap = old_cap ? old_cap * 2 : GEN_MIN_DIR_CAP;
+        sink->dirs = calloc(sink->dir_cap, sizeof(*sink->dirs));
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (old[i]) {
+                const char *name = old[i]->file.name;
+                *find_dir_slot(sink, name, strlen(name)) = old[i];
+            }
+        }
+        free(old);
+    }
+    const char *name = directory->file.name;
+    *find_dir_slot(sink, name, strlen(name)) = directory;
+    ++sink->dir_count;
+}
+
+int emit_tree(struct gen_sink *sink, const char *path, mode_t mode,
+              off_t size, ino_t ino)
+{
+    struct gen_tree_sink *tree = (struct gen_tree_sink *) sink;
+    struct file *file = new_file(path, mode, size);
+    if (!tree->root) {
+        tree->root = file;
+    } else {
+        const char *slash = strrchr(path, '/');
+        size_t len = slash == path ? 1 : (size_t) (slash - path);
+        struct directory *parent = *find_dir_slot(tree, path, len);
+        if (!parent) {
+            free_file(file);
+            return -1;
+        }
+        file->parent = parent;
+        file->next = parent->subdirs;
+        parent->subdirs = file;
+    }
+    if (S_ISDIR(mode)) {
+        add_dir(tree, (struct directory *) file);
+    }
+    return 0;
+}
+
+void gen_tree_sink_init(struct gen_tree_sink *sink)
+{
+    sink->sink.emit = emit_tree;
+    sink->root = NULL;
+    sink->dirs = NULL;
+    sink->dir_count = 0;
+    sink->dir_cap = 0;
+}
+
+void finish_directory(struct directory *directory)
+{
+    for (struct file *f = directory->subdirs; f; f = f->next) {
+        if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+            finish_directory((struct directory *) f);
+        }
+    }
+    update_size(directory);
+    directory->scan_state = SCAN_COMPLETE;
+}
+
+struct file *gen_tree_sink_finish(struct gen_tree_sink *sink)
+{
+    struct file *root = sink->root;
+    if (root && root->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+        finish_directory((struct directory *) root);
+    }
+    free(sink->dirs);
+    gen_tree_sink_init(sink);
+    return root;
+}
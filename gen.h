@@ -0,0 +1,78 @@
+#ifndef GEN_H
+#define GEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "fs.h"
+#include "tree.h"
+
+/* Deterministic generator of realistic trees: the same options always
+ * produce the same entries in the same order. */
+
+struct gen_options {
+    uint64_t seed;
+    size_t entries;         /* total number of entries to create */
+    double fanout;          /* mean subdirectories per directory (geometric) */
+    unsigned max_depth;
+    double files_per_dir;   /* mean files per directory (geometric) */
+    unsigned name_min;      /* name lengths are uniform in [min, max] */
+    unsigned name_max;
+    double size_mu;         /* file sizes are log-normal, in bytes */
+    double size_sigma;
+    double hardlinks;       /* fraction of files that link an earlier one */
+    size_t flat_dirs;       /* huge flat directories directly under root */
+    size_t flat_entries;    /* files in each of them */
+};
+
+struct gen_sink {
+    /* returns 0 on success */
+    int (*emit)(struct gen_sink *sink, const char *path, mode_t mode,
+                off_t size, ino_t ino);
+};
+
+void gen_options_init(struct gen_options *opts, size_t entries);
+/* Parses one "key=value" generator option; returns 0 on success. */
+int gen_parse_option(struct gen_options *opts, const char *option);
+/* Emits the root directory and then the entries below it; returns the
+ * number of entries emitted or -1 if the sink failed. */
+long gen_tree(const struct gen_options *opts, const char *root,
+              struct gen_sink *sink);
+
+/* sinks; the caller keeps them alive while generating */
+struct gen_fakefs_sink {
+    struct gen_sink sink;
+    struct fs_backend *fs;
+};
+
+struct gen_manifest_sink {
+    struct gen_sink sink;
+    FILE *out;
+};
+
+struct gen_disk_sink {
+    struct gen_sink sink;
+    char **paths;       /* generated inode number -> first path, for links */
+    size_t cap;
+};
+
+/* builds struct file nodes directly, without a filesystem in between */
+struct gen_tree_sink {
+    struct gen_sink sink;
+    struct file *root;
+    struct directory **dirs;   /* open addressing by path */
+    size_t dir_count;
+    size_t dir_cap;
+};
+
+void gen_fakefs_sink_init(struct gen_fakefs_sink *sink, struct fs_backend *fs);
+void gen_manifest_sink_init(struct gen_manifest_sink *sink, FILE *out);
+void gen_disk_sink_init(struct gen_disk_sink *sink);
+void gen_disk_sink_free(struct gen_disk_sink *sink);
+void gen_tree_sink_init(struct gen_tree_sink *sink);
+/* Returns the tree with sizes and scan states as a finished scan leaves
+ * them; the caller owns it. */
+struct file *gen_tree_sink_finish(struct gen_tree_sink *sink);
+
+#endif
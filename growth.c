@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "growth.h"
+#include "iolimit.h"
+
+struct candidate {
+    struct file *file;
+    double key;
+};
+
+/* the n candidates with the largest keys, smallest on top */
+struct candidate_heap {
+    struct candidate *items;
+    size_t len;
+    size_t cap;
+};
+
+struct file_sample {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    off_t allocated;
+    double mtime;
+};
+
+struct writer_search {
+    struct growing_file *files;
+    size_t n;
+    /* the process last counted for each file; proc_walk_fds() visits the
+     * fds of a process one after another */
+    pid_t *last_writer;
+};
+
+/* statx only asks for what is needed and does not sync with the server
+ * on network filesystems; lstat where the kernel has no statx */
+int take_sample(const char *path, bool mtime, struct file_sample *sample)
+{
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+    unsigned mask = STATX_TYPE | STATX_INO | STATX_SIZE | STATX_BLOCKS
+                    | (mtime ? STATX_MTIME : 0);
+    if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask,
+              &stx) == 0) {
+        sample->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        sample->ino = stx.stx_ino;
+        sample->size = stx.stx_size;
+        sample->allocated = (off_t) stx.stx_blocks * 512;
+        sample->mtime = stx.stx_mtime.tv_sec + stx.stx_mtime.tv_nsec * 1e-9;
+        return 0;
+    } else if (errno != ENOSYS) {
+        return -1;
+    }
+#endif
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return -1;
+    }
+    sample->dev = st.st_dev;
+    sample->ino = st.st_ino;
+    sample->size = st.st_size;
+    sample->allocated = (off_t) st.st_blocks * 512;
+    sample->mtime = st.st_mtim.tv_sec + st.st_mtim.tv_nsec * 1e-9;
+    return 0;
+}
+
+void swap_candidates(struct candidate *a, struct candidate *b)
+{
+    struct candidate tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+void offer_candidate(struct candidate_heap *heap, struct file *file,
+                     double key)
+{
+    size_t i;
+    if (heap->len < heap->cap) {
+        i = heap->len++;
+        heap->items[i] = (struct candidate) {file, key};
+        while (i > 0 && heap->items[(i - 1) / 2].key > heap->items[i].key) {
+            swap_candidates(&heap->items[(i - 1) / 2], &heap->items[i]);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+    if (key <= heap->items[0].key) {
+        return;
+    }
+    heap->items[0] = (struct candidate) {file, key};
+    i = 0;
+    for (;;) {
+        size_t smallest = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < heap->len;
+             ++child) {
+            if (heap->items[child].key < heap->items[smallest].key) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) {
+            return;
+        }
+        swap_candidates(&heap->items[i], &heap->items[smallest]);
+        i = smallest;
+    }
+}
+
+void collect_candidates(struct file *f, enum growth_pick how,
+                        struct candidate_heap *heap)
+{
+    if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+        for (struct file *child = ((struct directory *) f)->subdirs; child;
+             child = child->next) {
+            collect_candidates(child, how, heap);
+        }
+        return;
+    }
+    if (f->type != S_IFREG >> FILE_TYPE_OFFSET) {
+        return;
+    }
+    struct file_sample sample;
+    if (how == GROWTH_LARGEST) {
+        offer_candidate(heap, f, file_size(f));
+    } else if (take_sample(f->name, true, &sample) == 0) {
+        offer_candidate(heap, f, sample.mtime);
+    }
+}
+
+size_t growth_candidates(struct file *f, enum growth_pick how, size_t n,
+                         struct growing_file **files)
+{
+    struct candidate_heap heap = {malloc(n * sizeof(*heap.items)), 0, n};
+    collect_candidates(f, how, &heap);
+    *files = calloc(heap.len + 1, sizeof(**files));
+    for (size_t i = 0; i < heap.len; ++i) {
+        (*files)[i].file = heap.items[i].file;
+    }
+    n = heap.len;
+    free(heap.items);
+    return n;
+}
+
+void growth_sample(struct growing_file *files, size_t n, double seconds,
+                   double interval)
+{
+    for (size_t i = 0; i < n; ++i) {
+        struct file_sample sample;
+        if (take_sample(files[i].file->name, false, &sample) != 0) {
+            files[i].gone = true;
+            continue;
+        }
+        files[i].dev = sample.dev;
+        files[i].ino = sample.ino;
+        files[i].size = sample.size;
+        files[i].allocated = sample.allocated;
+    }
+    double end = now_seconds() + seconds;
+    while (now_seconds() < end) {
+        sleep_seconds(interval);
+        for (size_t i = 0; i < n; ++i) {
+            struct growing_file *g = &files[i];
+            struct file_sample sample;
+            if (g->gone) {
+                continue;
+            }
+            /* a new file under the name is a rotation, not growth */
+            if (take_sample(g->file->name, false, &sample) != 0
+                || sample.dev != g->dev || sample.ino != g->ino) {
+                g->gone = true;
+                continue;
+            }
+            if (sample.allocated > g->allocated) {
+                g->grown += sample.allocated - g->allocated;
+            }
+            g->size = sample.size;
+            g->allocated = sample.allocated;
+        }
+    }
+}
+
+int compare_identity(const void *a, const void *b)
+{
+    const struct growing_file *x = a;
+    const struct growing_file *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+void visit_writer(void *arg, pid_t pid, int fd, const char *link,
+                  const struct stat *st)
+{
+    struct writer_search *search = arg;
+    if (!S_ISREG(st->st_mode)) {
+        return;
+    }
+    struct growing_file key = {.dev = st->st_dev, .ino = st->st_ino};
+    struct growing_file *g = bsearch(&key, search->files, search->n,
+                                     sizeof(*search->files), compare_identity);
+    if (!g) {
+        return;
+    }
+    int flags = proc_fd_flags(pid, fd);
+    if (flags < 0 || (flags & O_ACCMODE) == O_RDONLY) {
+        return;  /* readers like tail -f are not to blame */
+    }
+    pid_t *last = &search->last_writer[g - search->files];
+    if (*last == pid) {
+        return;  /* another fd of the same process */
+    }
+    *last = pid;
+    if (g->writer_count < GROWTH_WRITERS) {
+        g->writers[g->writer_count].pid = pid;
+        proc_comm(pid, g->writers[g->writer_count].comm);
+    }
+    ++g->writer_count;
+}
+
+unsigned growth_attribute(struct growing_file *files, size_t n)
+{
+    /* only the files that grew are looked up, by dev and inode */
+    struct growing_file *grown = malloc(n * sizeof(*grown) + 1);
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (files[i].grown > 0) {
+            grown[len++] = files[i];
+        }
+    }
+    unsigned unreadable = 0;
+    if (len > 0) {
+        qsort(grown, len, sizeof(*grown), compare_identity);
+        struct writer_search search = {grown, len,
+                                       calloc(len, sizeof(pid_t))};
+        unreadable = proc_walk_fds(visit_writer, &search);
+        free(search.last_writer);
+    }
+    for (size_t i = 0, j = 0; i < n && j < len; ++i) {
+        if (files[i].grown > 0) {
+            struct growing_file *g = bsearch(&files[i], grown, len,
+                                             sizeof(*grown), compare_identity);
+            files[i].writer_count = g->writer_count;
+            memcpy(files[i].writers, g->writers, sizeof(g->writers));
+            ++j;
+        }
+    }
+    free(grown);
+    return unreadable;
+}
@@ -0,0 +1,49 @@
+#ifndef GROWTH_H
+#define GROWTH_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "held.h"
+#include "tree.h"
+
+/* Which files are growing right now, and who writes them. Only a few
+ * candidates from the tree are re-stat'ed, so that sampling stays cheap
+ * enough to leave running during a disk-full incident. */
+
+#define GROWTH_WRITERS 4
+
+enum growth_pick {
+    GROWTH_LARGEST,  /* by size in the tree */
+    GROWTH_RECENT,   /* by mtime, which takes a stat of every file */
+};
+
+struct growth_writer {
+    pid_t pid;
+    char comm[HELD_COMM_SIZE];
+};
+
+struct growing_file {
+    struct file *file;
+    dev_t dev;
+    ino_t ino;
+    off_t size;        /* at the last sample */
+    off_t allocated;
+    off_t grown;       /* allocated bytes added over all samples */
+    bool gone;         /* stopped sampling: removed or replaced */
+    unsigned writer_count;
+    struct growth_writer writers[GROWTH_WRITERS];
+};
+
+/* The n files below f picked by how; returns how many there were. */
+size_t growth_candidates(struct file *f, enum growth_pick how, size_t n,
+                         struct growing_file **files);
+/* Stats the files every interval for seconds, adding up what they grow;
+ * truncations and rotations do not hide the writes before them. */
+void growth_sample(struct growing_file *files, size_t n, double seconds,
+                   double interval);
+/* Finds the processes that have the grown files open for writing; returns
+ * the number of processes whose fds could not be listed. */
+unsigned growth_attribute(struct growing_file *files, size_t n);
+
+#endif
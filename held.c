@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "held.h"
+#include "iolimit.h"
+#include "tree.h"
+
+#define PROC_PATH_SIZE 64
+
+/* the pids in /proc and the fds below them */
+bool parse_number(const char *name, int *number)
+{
+    char *end;
+    long value = strtol(name, &end, 10);
+    *number = value;
+    return *name && !*end && value >= 0 && value <= INT32_MAX;
+}
+
+void proc_comm(pid_t pid, char comm[HELD_COMM_SIZE])
+{
+    char path[PROC_PATH_SIZE];
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int) pid);
+    comm[0] = '\0';
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return;
+    }
+    if (fgets(comm, HELD_COMM_SIZE, in)) {
+        comm[strcspn(comm, "\n")] = '\0';
+    }
+    fclose(in);
+}
+
+int proc_fd_flags(pid_t pid, int fd)
+{
+    char path[PROC_PATH_SIZE];
+    snprintf(path, sizeof(path), "/proc/%d/fdinfo/%d", (int) pid, fd);
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return -1;
+    }
+    char line[128];
+    int flags = -1;
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "flags: %o", (unsigned *) &flags) == 1) {
+            break;
+        }
+    }
+    fclose(in);
+    return flags;
+}
+
+/* whether the file was root or somewhere below it */
+bool was_below(const char *root, const char *target)
+{
+    size_t len = strlen(root);
+    while (len > 1 && root[len - 1] == '/') {
+        --len;
+    }
+    return strncmp(target, root, len) == 0
+           && (target[len] == '/' || target[len] == ' '
+               || target[len] == '\0' || len == 1);
+}
+
+void held_append(struct held_list *list, const struct held_file *held)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, list->cap * sizeof(*list->items));
+    }
+    list->items[list->len++] = *held;
+}
+
+/* Returns whether the fds of the process could be listed; one that just
+ * exited counts as listed. */
+bool walk_process(pid_t pid, void (*visit)(void *, pid_t, int, const char *,
+                                           const struct stat *),
+                  void *arg)
+{
+    char path[PROC_PATH_SIZE];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int) pid);
+    DIR *fds = opendir(path);
+    if (!fds) {
+        return errno == ENOENT;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(fds))) {
+        int fd;
+        if (!parse_number(entry->d_name, &fd)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int) pid, fd);
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            visit(arg, pid, fd, path, &st);
+        }
+    }
+    closedir(fds);
+    return true;
+}
+
+unsigned proc_walk_fds(void (*visit)(void *arg, pid_t pid, int fd,
+                                     const char *link, const struct stat *st),
+                       void *arg)
+{
+    DIR *proc = opendir("/proc");
+    if (!proc) {
+        return 1;
+    }
+    unsigned unreadable = 0;
+    int self = getpid();
+    struct dirent *entry;
+    while ((entry = readdir(proc))) {
+        int pid;
+        /* our own deleted file is the node store */
+        if (parse_number(entry->d_name, &pid) && pid != self) {
+            unreadable += !walk_process(pid, visit, arg);
+        }
+    }
+    closedir(proc);
+    return unreadable;
+}
+
+struct held_search {
+    struct held_list *list;
+    const char *root;
+    dev_t dev;
+};
+
+void visit_held(void *arg, pid_t pid, int fd, const char *link,
+                const struct stat *st)
+{
+    struct held_search *search = arg;
+    if (!S_ISREG(st->st_mode) || st->st_nlink || !st->st_blocks) {
+        return;
+    }
+    char target[PATH_MAX];
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    if (len < 0) {
+        return;
+    }
+    target[len] = '\0';
+    if (st->st_dev != search->dev && !was_below(search->root, target)) {
+        return;
+    }
+    struct held_file held = {
+        .path = strdup(target),
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .allocated = (off_t) st->st_blocks * 512,
+        .holders = malloc(sizeof(struct held_holder)),
+        .holder_count = 1,
+    };
+    held.holders[0].pid = pid;
+    held.holders[0].fd = fd;
+    proc_comm(pid, held.holders[0].comm);
+    held_append(search->list, &held);
+}
+
+int compare_held_inodes(const void *a, const void *b)
+{
+    const struct held_file *x = a;
+    const struct held_file *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    const struct held_holder *h = x->holders;
+    const struct held_holder *k = y->holders;
+    if (h->pid != k->pid) {
+        return h->pid < k->pid ? -1 : 1;
+    }
+    return h->fd < k->fd ? -1 : h->fd > k->fd;
+}
+
+/* Every fd was appended as a file of its own; those of one inode are
+ * merged into its first. */
+void merge_holders(struct held_list *list, size_t first)
+{
+    struct held_file *items = list->items + first;
+    size_t n = list->len - first;
+    qsort(items, n, sizeof(*items), compare_held_inodes);
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct held_file *last = len ? &items[len - 1] : NULL;
+        if (!last || last->dev != items[i].dev || last->ino != items[i].ino) {
+            items[len++] = items[i];
+            continue;
+        }
+        last->holders = realloc(last->holders, (last->holder_count + 1)
+                                               * sizeof(*last->holders));
+        last->holders[last->holder_count++] = items[i].holders[0];
+        /* the blocks of the latest stat */
+        last->allocated = items[i].allocated;
+        free(items[i].holders);
+        free(items[i].path);
+    }
+    list->len = first + len;
+}
+
+void held_find(struct held_list *list, const char *root, dev_t dev)
+{
+    struct held_search search = {list, root, dev};
+    size_t first = list->len;
+    list->unreadable += proc_walk_fds(visit_held, &search);
+    merge_holders(list, first);
+}
+
+/* our own descriptor, so that the fd cannot be reused under us; -1 with
+ * ESTALE if it no longer refers to the file */
+int open_holder(const struct held_file *held, const struct held_holder *h,
+                struct stat *st)
+{
+    char path[PROC_PATH_SIZE];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int) h->pid, h->fd);
+    int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, st) != 0 || st->st_dev != held->dev
+        || st->st_ino != held->ino || st->st_nlink) {
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+    return fd;
+}
+
+off_t held_truncate(const struct held_file *held)
+{
+    struct stat st;
+    int fd = -1;
+    int open_error = ESTALE;
+    for (size_t i = 0; i < held->holder_count && fd < 0; ++i) {
+        fd = open_holder(held, &held->holders[i], &st);
+        if (fd < 0 && errno != ENOENT && errno != ESTALE) {
+            open_error = errno;
+        }
+    }
+    if (fd < 0) {
+        errno = open_error;
+        return -1;
+    }
+    off_t length = st.st_size;
+    int error = 0;
+    while (length > 0) {
+        length = length > TRUNCATE_STEP ? length - TRUNCATE_STEP : 0;
+        io_throttle(IO_TRUNCATE);
+        if (ftruncate(fd, length) != 0) {
+            error = errno;
+            break;
+        }
+    }
+    struct stat after;
+    if (fstat(fd, &after) != 0) {
+        after.st_blocks = st.st_blocks;
+    }
+    close(fd);
+    if (error && after.st_blocks == st.st_blocks) {
+        errno = error;
+        return -1;
+    }
+    return (off_t) (st.st_blocks - after.st_blocks) * 512;
+}
+
+void held_list_free(struct held_list *list)
+{
+    for (size_t i = 0; i < list->len; ++i) {
+        free(list->items[i].path);
+        free(list->items[i].holders);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->len = 0;
+    list->cap = 0;
+    list->unreadable = 0;
+}
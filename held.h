@@ -0,0 +1,60 @@
+#ifndef HELD_H
+#define HELD_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Deleted files that processes keep open. Their space only comes back
+ * when the last descriptor is closed, which no amount of deleting other
+ * files helps with; truncating them through /proc/<pid>/fd frees it right
+ * away, at the cost of the data the process would still read. */
+
+#define HELD_COMM_SIZE 17  /* /proc/<pid>/comm is at most 16 characters */
+
+/* one fd of a process that has the file open */
+struct held_holder {
+    pid_t pid;
+    int fd;
+    char comm[HELD_COMM_SIZE];
+};
+
+/* one deleted inode, however many fds keep it */
+struct held_file {
+    char *path;       /* as the fd link shows it, "... (deleted)" */
+    dev_t dev;
+    ino_t ino;
+    off_t allocated;  /* what truncating frees */
+    struct held_holder *holders;  /* by pid and fd */
+    size_t holder_count;
+};
+
+struct held_list {
+    struct held_file *items;
+    size_t len;
+    size_t cap;
+    unsigned unreadable;  /* processes whose fds could not be listed */
+};
+
+/* Calls visit for every open fd of every process but this one, with its
+ * /proc/<pid>/fd/<n> link and what stat() says through it. Returns the
+ * number of processes whose fds could not be listed. */
+unsigned proc_walk_fds(void (*visit)(void *arg, pid_t pid, int fd,
+                                     const char *link, const struct stat *st),
+                       void *arg);
+/* comm is empty if the process is gone */
+void proc_comm(pid_t pid, char comm[HELD_COMM_SIZE]);
+/* the open flags of the fd, -1 if it is gone */
+int proc_fd_flags(pid_t pid, int fd);
+
+/* Appends the regular files without a name left that are open in any
+ * other process, take up space and live on dev or were below root; once
+ * each, with all the fds that hold them. */
+void held_find(struct held_list *list, const char *root, dev_t dev);
+/* Truncates the file through /proc, in steps paced like removing a big
+ * file, through the first holder whose fd still refers to it. Returns the
+ * bytes freed, or -1 with errno set (ESTALE if no fd does any more). */
+off_t held_truncate(const struct held_file *held);
+void held_list_free(struct held_list *list);
+
+#endif
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iolimit.h"
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_BE_LEVELS 8
+
+#define BUCKET_BURST_SECONDS 0.1
+#define ADAPT_EWMA_WEIGHT 0.05
+#define ADAPT_WINDOW 64
+#define ADAPT_HIGH 3.
+#define ADAPT_LOW 1.5
+#define ADAPT_MIN_DELAY 0.0001
+#define ADAPT_MAX_DELAY 0.1
+#define ADAPT_BASELINE_DRIFT (1. / 256)
+
+/* limited and enabled are read without the locks, so that the default of
+ * no limits costs the workers no shared lock on every call */
+struct token_bucket {
+    pthread_mutex_t lock;
+    bool limited;
+    double rate;
+    double burst;
+    double tokens;
+    double last;
+};
+
+struct adaptive_state {
+    pthread_mutex_t lock;
+    bool enabled;
+    double ewma;
+    double baseline;
+    double delay;
+    unsigned samples;
+};
+
+static struct token_bucket buckets[IO_OP_COUNT] = {
+    { PTHREAD_MUTEX_INITIALIZER, false, 0, 0, 0, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, false, 0, 0, 0, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, false, 0, 0, 0, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, false, 0, 0, 0, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, false, 0, 0, 0, 0 },
+};
+
+static struct adaptive_state adaptive = { PTHREAD_MUTEX_INITIALIZER };
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void sleep_seconds(double seconds)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) seconds;
+    ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) != 0) {
+        /* interrupted; sleep the rest */
+    }
+}
+
+void deadline_after(struct timespec *deadline, double seconds)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += (time_t) seconds;
+    deadline->tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+    deadline->tv_sec += deadline->tv_nsec / 1000000000;
+    deadline->tv_nsec %= 1000000000;
+}
+
+int set_ioprio(const char *spec)
+{
+    int class;
+    int level = 0;
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t) (colon - spec) : strlen(spec);
+    if (len == 4 && strncmp(spec, "idle", len) == 0) {
+        class = IOPRIO_CLASS_IDLE;
+        if (colon) {
+            return -1;
+        }
+    } else if ((len == 2 && strncmp(spec, "be", len) == 0)
+               || (len == 11 && strncmp(spec, "best-effort", len) == 0)) {
+        class = IOPRIO_CLASS_BE;
+        if (colon) {
+            char *end;
+            level = strtol(colon + 1, &end, 10);
+            if (*end || end == colon + 1 || level < 0
+                || level >= IOPRIO_BE_LEVELS) {
+                return -1;
+            }
+        } else {
+            level = IOPRIO_BE_LEVELS - 1;
+        }
+    } else {
+        return -1;
+    }
+    /* threads created later inherit the priority of the main thread */
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                   class << IOPRIO_CLASS_SHIFT | level);
+}
+
+void io_set_rate(enum io_op op, double per_second)
+{
+    struct token_bucket *b = &buckets[op];
+    pthread_mutex_lock(&b->lock);
+    b->rate = per_second > 0 ? per_second : 0;
+    b->burst = b->rate * BUCKET_BURST_SECONDS;
+    if (b->burst < 1) {
+        b->burst = 1;
+    }
+    b->tokens = b->burst;
+    b->last = now_seconds();
+    __atomic_store_n(&b->limited, b->rate > 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void io_set_adaptive(bool enabled)
+{
+    pthread_mutex_lock(&adaptive.lock);
+    __atomic_store_n(&adaptive.enabled, enabled, __ATOMIC_RELEASE);
+    adaptive.ewma = 0;
+    adaptive.baseline = 0;
+    adaptive.delay = 0;
+    adaptive.samples = 0;
+    pthread_mutex_unlock(&adaptive.lock);
+}
+
+void io_throttle(enum io_op op)
+{
+    struct token_bucket *b = &buckets[op];
+    bool limited = __atomic_load_n(&b->limited, __ATOMIC_ACQUIRE);
+    bool adapting = __atomic_load_n(&adaptive.enabled, __ATOMIC_ACQUIRE);
+    if (!limited && !adapting) {
+        return;
+    }
+    double wait = 0;
+    if (limited) {
+        pthread_mutex_lock(&b->lock);
+        if (b->rate > 0) {
+            double now = now_seconds();
+            b->tokens += (now - b->last) * b->rate;
+            b->last = now;
+            if (b->tokens > b->burst) {
+                b->tokens = b->burst;
+            }
+            /* take the token now and sleep off the debt outside the
+             * lock, so that waiting threads are served in arrival order */
+            b->tokens -= 1;
+            if (b->tokens < 0) {
+                wait = -b->tokens / b->rate;
+            }
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    if (adapting) {
+        pthread_mutex_lock(&adaptive.lock);
+        if (adaptive.enabled) {
+            wait += adaptive.delay;
+        }
+        pthread_mutex_unlock(&adaptive.lock);
+    }
+
+    if (wait > 0) {
+        sleep_seconds(wait);
+    }
+}
+
+void io_record_latency(enum io_op op, double seconds)
+{
+    if (op != IO_STAT
+        || !__atomic_load_n(&adaptive.enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&adaptive.lock);
+    if (!adaptive.enabled) {
+        pthread_mutex_unlock(&adaptive.lock);
+        return;
+    }
+    if (adaptive.samples == 0 && adaptive.ewma == 0) {
+        adaptive.ewma = seconds;
+    } else {
+        adaptive.ewma += (seconds - adaptive.ewma) * ADAPT_EWMA_WEIGHT;
+    }
+    if (++adaptive.samples < ADAPT_WINDOW) {
+        pthread_mutex_unlock(&adaptive.lock);
+        return;
+    }
+    adaptive.samples = 0;
+    if (adaptive.baseline == 0 || adaptive.ewma < adaptive.baseline) {
+        adaptive.baseline = adaptive.ewma;
+    } else {
+        /* let a lasting shift in latency become the new normal */
+        adaptive.baseline += (adaptive.ewma - adaptive.baseline)
+                             * ADAPT_BASELINE_DRIFT;
+    }
+
+    double old_delay = adaptive.delay;
+    if (adaptive.ewma > adaptive.baseline * ADAPT_HIGH) {
+        adaptive.delay = old_delay ? old_delay * 2 : ADAPT_MIN_DELAY;
+        if (adaptive.delay > ADAPT_MAX_DELAY) {
+            adaptive.delay = ADAPT_MAX_DELAY;
+        }
+    } else if (adaptive.ewma < adaptive.baseline * ADAPT_LOW) {
+        adaptive.delay /= 2;
+        if (adaptive.delay < ADAPT_MIN_DELAY) {
+            adaptive.delay = 0;
+        }
+    }
+    if (old_delay == 0 && adaptive.delay > 0) {
+        fprintf(stderr, "[INFO] stat latency %.2fms (baseline %.2fms); "
+                "backing off\n", adaptive.ewma * 1e3, adaptive.baseline * 1e3);
+    } else if (old_delay > 0 && adaptive.delay == 0) {
+        fprintf(stderr, "[INFO] stat latency %.2fms back to normal\n",
+                adaptive.ewma * 1e3);
+    }
+    pthread_mutex_unlock(&adaptive.lock);
+}
@@ -0,0 +1,33 @@
+#ifndef IOLIMIT_H
+#define IOLIMIT_H
+
+#include <stdbool.h>
+#include <time.h>
+
+enum io_op {
+    IO_STAT,
+    IO_READDIR,  /* one directory listing (opendir + readdir loop) */
+    IO_UNLINK,   /* unlink or rmdir */
+    IO_TRUNCATE, /* one step of shrinking a big file, see TRUNCATE_STEP */
+    IO_COPY,     /* one chunk of a migrated file, see MIGRATE_CHUNK */
+    IO_OP_COUNT
+};
+
+double now_seconds(void);
+void sleep_seconds(double seconds);
+/* for pthread_cond_timedwait() */
+void deadline_after(struct timespec *deadline, double seconds);
+
+/* spec is "idle", "be[:level]" or "best-effort[:level]"; returns 0 on success */
+int set_ioprio(const char *spec);
+
+/* per_second <= 0 means unlimited */
+void io_set_rate(enum io_op op, double per_second);
+void io_set_adaptive(bool enabled);
+
+/* blocks the calling thread until op is allowed by the limits */
+void io_throttle(enum io_op op);
+/* feeds the adaptive controller with the latency of a finished op */
+void io_record_latency(enum io_op op, double seconds);
+
+#endif
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mem.h"
+#include "stats.h"
+
+/* glibc keeps the chunk size in front of every allocation */
+#define CHUNK_HEADER sizeof(size_t)
+/* address space reserved up front, so that a region never moves */
+#define MAP_RESERVE ((size_t) 1 << 40)
+#define MAP_FIRST_EXTENT ((size_t) 64 << 20)
+#define MAP_MAX_EXTENT ((size_t) 1 << 30)
+/* handed to one thread at a time, so that its nodes end up together */
+#define MAP_CHUNK ((size_t) 64 << 10)
+#define MAP_ALIGN 16
+#define MAP_CLASSES (PATH_MAX / MAP_ALIGN + 1)
+#define MINCORE_BATCH 4096
+
+/* nodes and names are apart, a sort or a size update only touches nodes */
+enum {
+    MAP_NODES,
+    MAP_NAMES,
+    MAP_REGION_COUNT
+};
+
+struct map_region {
+    char *base;
+    size_t mapped;  /* bytes from base backed by the file */
+    size_t used;    /* bytes from base handed out to threads */
+    void *free_lists[MAP_CLASSES];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int fd;
+    off_t file_size;
+    size_t extent;  /* size of the next one */
+    int advice;
+    bool full;
+    struct map_region regions[MAP_REGION_COUNT];
+} store = {PTHREAD_MUTEX_INITIALIZER, -1};
+
+/* what is left of the chunk a thread allocates from, per region */
+static __thread char *chunk_pos[MAP_REGION_COUNT];
+static __thread char *chunk_end[MAP_REGION_COUNT];
+
+static const char *const kind_names[MEM_KIND_COUNT] = {
+    "files", "directories", "names", "indexes",
+};
+
+static struct mem_stats stats[MEM_KIND_COUNT];
+
+const char *mem_kind_name(enum mem_kind kind)
+{
+    return kind_names[kind];
+}
+
+void mem_get_stats(struct mem_stats result[MEM_KIND_COUNT])
+{
+    for (int kind = 0; kind < MEM_KIND_COUNT; ++kind) {
+        result[kind].objects = __atomic_load_n(&stats[kind].objects,
+                                               __ATOMIC_RELAXED);
+        result[kind].requested = __atomic_load_n(&stats[kind].requested,
+                                                 __ATOMIC_RELAXED);
+        result[kind].allocated = __atomic_load_n(&stats[kind].allocated,
+                                                 __ATOMIC_RELAXED);
+    }
+}
+
+long mem_rss_kb(void)
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long pages = -1;
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = -1;
+        }
+        fclose(statm);
+    }
+    return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+bool mem_map_enabled(void)
+{
+    return store.fd != -1;
+}
+
+bool in_store(const void *p)
+{
+    for (int i = 0; i < MAP_REGION_COUNT && mem_map_enabled(); ++i) {
+        const char *base = store.regions[i].base;
+        if ((const char *) p >= base && (const char *) p < base + MAP_RESERVE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t round_to_class(size_t size)
+{
+    return (size + MAP_ALIGN - 1) & ~(size_t) (MAP_ALIGN - 1);
+}
+
+int mem_map_open(const char *dir)
+{
+    int fd = open(dir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    if (fd == -1 && errno == EOPNOTSUPP) {
+        char *path;
+        if (asprintf(&path, "%s/.cleaner-store-XXXXXX", dir) < 0) {
+            return -1;
+        }
+        if ((fd = mkostemp(path, O_CLOEXEC)) != -1) {
+            unlink(path);
+        }
+        free(path);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    for (int i = 0; i < MAP_REGION_COUNT; ++i) {
+        void *base = mmap(NULL, MAP_RESERVE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            int error = errno;
+            while (i-- > 0) {
+                munmap(store.regions[i].base, MAP_RESERVE);
+                store.regions[i].base = NULL;
+            }
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        store.regions[i].base = base;
+    }
+    store.extent = MAP_FIRST_EXTENT;
+    store.advice = MADV_NORMAL;
+    store.fd = fd;
+    return 0;
+}
+
+/* Maps the next extent of the file behind the used part of the region;
+ * called with the lock held. */
+bool grow_region(struct map_region *r)
+{
+    if (store.full || r->mapped + store.extent > MAP_RESERVE) {
+        return false;
+    }
+    /* allocating the blocks now turns a full disk into an error here
+     * instead of a SIGBUS on the first write to the page */
+    int error = posix_fallocate(store.fd, store.file_size, store.extent);
+    void *p = MAP_FAILED;
+    if (!error) {
+        p = mmap(r->base + r->mapped, store.extent, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, store.fd, store.file_size);
+        error = p == MAP_FAILED ? errno : 0;
+    }
+    if (error) {
+        fprintf(stderr, "[WARNING] node store cannot grow (%s), keeping the "
+                "rest of the tree in memory\n", strerror(error));
+        store.full = true;
+        return false;
+    }
+    madvise(p, store.extent, store.advice);
+    store.file_size += store.extent;
+    r->mapped += store.extent;
+    if (store.extent < MAP_MAX_EXTENT) {
+        store.extent *= 2;
+    }
+    return true;
+}
+
+/* NULL if the kind stays on the heap or the store is full */
+void *map_alloc(enum mem_kind kind, size_t size)
+{
+    size_t rounded = round_to_class(size);
+    size_t class = rounded / MAP_ALIGN;
+    if (kind == MEM_INDEX || class >= MAP_CLASSES) {
+        return NULL;
+    }
+    int region = kind == MEM_NAME ? MAP_NAMES : MAP_NODES;
+    struct map_region *r = &store.regions[region];
+    void *result = NULL;
+    if (__atomic_load_n(&r->free_lists[class], __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&store.lock);
+        if ((result = r->free_lists[class])) {
+            __atomic_store_n(&r->free_lists[class], *(void **) result,
+                             __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&store.lock);
+        if (result) {
+            return result;
+        }
+    }
+    if ((size_t) (chunk_end[region] - chunk_pos[region]) < rounded) {
+        pthread_mutex_lock(&store.lock);
+        if (r->used + MAP_CHUNK > r->mapped && !grow_region(r)) {
+            pthread_mutex_unlock(&store.lock);
+            return NULL;
+        }
+        chunk_pos[region] = r->base + r->used;
+        chunk_end[region] = chunk_pos[region] + MAP_CHUNK;
+        r->used += MAP_CHUNK;
+        pthread_mutex_unlock(&store.lock);
+    }
+    result = chunk_pos[region];
+    chunk_pos[region] += rounded;
+    return result;
+}
+
+void map_free(enum mem_kind kind, void *p, size_t size)
+{
+    struct map_region *r = &store.regions[kind == MEM_NAME ? MAP_NAMES
+                                                           : MAP_NODES];
+    size_t class = round_to_class(size) / MAP_ALIGN;
+    pthread_mutex_lock(&store.lock);
+    *(void **) p = r->free_lists[class];
+    __atomic_store_n(&r->free_lists[class], p, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&store.lock);
+}
+
+void mem_map_advise(enum mem_access access)
+{
+    if (!mem_map_enabled()) {
+        return;
+    }
+    pthread_mutex_lock(&store.lock);
+    /* a scan fills the store front to back, browsing then faults single
+     * nodes back in and readahead around them would be wasted */
+    store.advice = access == MEM_ACCESS_SCAN ? MADV_SEQUENTIAL : MADV_RANDOM;
+    for (int i = 0; i < MAP_REGION_COUNT; ++i) {
+        struct map_region *r = &store.regions[i];
+        if (r->mapped) {
+            madvise(r->base, r->mapped, store.advice);
+        }
+    }
+    pthread_mutex_unlock(&store.lock);
+}
+
+void mem_map_usage(uint64_t *mapped, uint64_t *resident)
+{
+    *mapped = *resident = 0;
+    if (!mem_map_enabled()) {
+        return;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned char pages[MINCORE_BATCH];
+    pthread_mutex_lock(&store.lock);
+    for (int i = 0; i < MAP_REGION_COUNT; ++i) {
+        struct map_region *r = &store.regions[i];
+        *mapped += r->mapped;
+        for (size_t offset = 0; offset < r->mapped;
+             offset += MINCORE_BATCH * page) {
+            size_t len = r->mapped - offset;
+            if (len > MINCORE_BATCH * page) {
+                len = MINCORE_BATCH * page;
+            }
+            if (mincore(r->base + offset, len, pages) != 0) {
+                continue;
+            }
+            for (size_t j = 0; j < len / page; ++j) {
+                *resident += (pages[j] & 1) * page;
+            }
+        }
+    }
+    pthread_mutex_unlock(&store.lock);
+}
+
+void mem_account(enum mem_kind kind, void *p, int64_t objects, int64_t size)
+{
+    int64_t chunk = in_store(p) ? (int64_t) round_to_class(llabs(size))
+                                : (int64_t) (malloc_usable_size(p)
+                                             + CHUNK_HEADER);
+    if (objects < 0 || size < 0) {
+        chunk = -chunk;
+    }
+    __atomic_add_fetch(&stats[kind].objects, objects, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats[kind].requested, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats[kind].allocated, chunk, __ATOMIC_RELAXED);
+}
+
+void *mem_alloc(enum mem_kind kind, size_t size)
+{
+    void *result = mem_map_enabled() ? map_alloc(kind, size) : NULL;
+    if (!result) {
+        result = malloc(size);
+    }
+    STATS_ADD(STATS_ALLOCS, 1);
+    STATS_ADD(STATS_ALLOC_BYTES, size);
+    if (result) {
+        mem_account(kind, result, 1, size);
+    }
+    return result;
+}
+
+void *mem_realloc(enum mem_kind kind, void *p, size_t old_size, size_t size)
+{
+    if (mem_map_enabled() && kind != MEM_INDEX) {
+        void *result = mem_alloc(kind, size);
+        if (result && p) {
+            memcpy(result, p, old_size < size ? old_size : size);
+            mem_free(kind, p, old_size);
+        }
+        return result;
+    }
+    if (p) {
+        mem_account(kind, p, -1, -(int64_t) old_size);
+    }
+    void *result = realloc(p, size);
+    STATS_ADD(STATS_ALLOCS, 1);
+    STATS_ADD(STATS_ALLOC_BYTES, size);
+    if (result) {
+        mem_account(kind, result, 1, size);
+    } else if (p) {
+        mem_account(kind, p, 1, old_size);
+    }
+    return result;
+}
+
+char *mem_strdup(const char *s)
+{
+    size_t size = strlen(s) + 1;
+    char *result = mem_alloc(MEM_NAME, size);
+    if (result) {
+        memcpy(result, s, size);
+    }
+    return result;
+}
+
+void mem_free(enum mem_kind kind, void *p, size_t size)
+{
+    if (p) {
+        mem_account(kind, p, -1, -(int64_t) size);
+        if (in_store(p)) {
+            map_free(kind, p, size);
+        } else {
+            free(p);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Allocations of the in-memory tree go through these, so that the bytes
+ * per entry can be reported by kind. "allocated" counts whole allocator
+ * chunks, the difference to "requested" is allocator slack. */
+
+enum mem_kind {
+    MEM_FILE,       /* struct file of non-directories */
+    MEM_DIRECTORY,  /* struct directory */
+    MEM_NAME,       /* paths stored in the nodes */
+    MEM_INDEX,      /* arrays pointing into the tree, e.g. the scan queue */
+    MEM_KIND_COUNT
+};
+
+struct mem_stats {
+    uint64_t objects;
+    uint64_t requested;
+    uint64_t allocated;
+};
+
+/* Where the nodes and names live while the tree is scanned and browsed;
+ * only makes a difference with a store opened by mem_map_open. */
+enum mem_access {
+    MEM_ACCESS_SCAN,    /* written once, in allocation order */
+    MEM_ACCESS_BROWSE,  /* read along paths scattered over the tree */
+};
+
+const char *mem_kind_name(enum mem_kind kind);
+void mem_get_stats(struct mem_stats stats[MEM_KIND_COUNT]);
+/* resident set size of the process, from /proc/self/statm */
+long mem_rss_kb(void);
+
+void *mem_alloc(enum mem_kind kind, size_t size);
+void *mem_realloc(enum mem_kind kind, void *p, size_t old_size, size_t size);
+char *mem_strdup(const char *s);
+/* size is the one requested for p */
+void mem_free(enum mem_kind kind, void *p, size_t size);
+
+/* Moves later files, directories and names out of the heap into a
+ * temporary file in dir, mapped in extents that grow as the tree does, so
+ * that the kernel can page out the parts of the tree nobody looks at.
+ * Indexes stay on the heap. Returns -1 with errno set on failure. */
+int mem_map_open(const char *dir);
+bool mem_map_enabled(void);
+void mem_map_advise(enum mem_access access);
+/* bytes of the store mapped and, of these, resident in memory */
+void mem_map_usage(uint64_t *mapped, uint64_t *resident);
+
+#endif
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "gen.h"
+#include "iolimit.h"
+#include "repl.h"
+#include "tree.h"
+
+/* The tree algorithms on their own: every width is one generated directory
+ * of that many files, built in memory without any filesystem. Results are
+ * one line of key=value pairs per algorithm and width. */
+
+#define MICRO_ROOT "/micro"
+#define MAX_WIDTHS 16
+#define MIN_SECONDS 0.2
+#define MAX_REPS 1000
+#define LOOKUP_ELEMENTS 10000000
+
+struct micro_options {
+    size_t widths[MAX_WIDTHS];
+    size_t width_count;
+    char **gen_args;
+    size_t gen_arg_count;
+    unsigned sort_threads;
+};
+
+struct timing {
+    double seconds;   /* of the fastest repetition */
+    uint64_t cycles;
+    unsigned reps;
+};
+
+enum {
+    OPT_WIDTHS = 256,
+    OPT_GEN,
+    OPT_SORT_THREADS,
+    OPT_HELP,
+};
+
+static struct option long_options[] = {
+    {"widths", required_argument, NULL, OPT_WIDTHS},
+    {"gen", required_argument, NULL, OPT_GEN},
+    {"sort-threads", required_argument, NULL, OPT_SORT_THREADS},
+    {"help", no_argument, NULL, OPT_HELP},
+    {0, 0, 0, 0},
+};
+
+void print_usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fputs("  --widths N,N,...       directory widths (10 to 1e7, by 10x)\n"
+          "  --gen KEY=VALUE        generator option, see cleaner-bench\n"
+          "  --sort-threads N       threads of parallel_sort (the CPUs, at\n"
+          "                         least 2)\n",
+          stderr);
+}
+
+/* Cycles where the CPU has a cycle counter, nanoseconds elsewhere. */
+static inline uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t) (now_seconds() * 1e9);
+#endif
+}
+
+uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+void start_rep(double *start, uint64_t *start_cycles)
+{
+    *start = now_seconds();
+    *start_cycles = read_cycles();
+}
+
+void end_rep(struct timing *t, double start, uint64_t start_cycles)
+{
+    uint64_t cycles = read_cycles() - start_cycles;
+    double seconds = now_seconds() - start;
+    if (!t->reps || seconds < t->seconds) {
+        t->seconds = seconds;
+        t->cycles = cycles;
+    }
+    ++t->reps;
+}
+
+bool more_reps(const struct timing *t, double total)
+{
+    return t->reps == 0 || (total < MIN_SECONDS && t->reps < MAX_REPS);
+}
+
+void report(const char *algorithm, size_t width, size_t elements,
+            const struct timing *t)
+{
+    printf("micro=%s width=%zu elements=%zu reps=%u seconds=%.9f "
+           "ns_per_element=%.2f cycles_per_element=%.2f\n", algorithm, width,
+           elements, t->reps, t->seconds, t->seconds * 1e9 / elements,
+           (double) t->cycles / elements);
+    fflush(stdout);
+}
+
+void shuffle_sizes(struct directory *d, uint64_t *rng)
+{
+    for (struct file *f = d->subdirs; f; f = f->next) {
+        /* ties are frequent, like in real directories */
+        f->size = next_random(rng) % (1 << 20);
+    }
+}
+
+/* Checks once that the parallel sort puts ties in the serial order too. */
+void bench_parallel_sort(struct directory *d, size_t width, unsigned threads,
+                         uint64_t *rng)
+{
+    struct file **before = malloc(width * sizeof(*before));
+    struct file **after = malloc(width * sizeof(*after));
+    struct timing t = {0};
+    double start;
+    uint64_t start_cycles;
+    double total = 0;
+    while (more_reps(&t, total)) {
+        shuffle_sizes(d, rng);
+        size_t n = 0;
+        for (struct file *f = d->subdirs; f; f = f->next) {
+            before[n++] = f;
+        }
+        start_rep(&start, &start_cycles);
+        d->subdirs = do_parallel_merge_sort(d->subdirs, width, threads);
+        end_rep(&t, start, start_cycles);
+        total += now_seconds() - start;
+        if (t.reps > 1) {
+            continue;
+        }
+        n = 0;
+        for (struct file *f = d->subdirs; f; f = f->next) {
+            after[n++] = f;
+        }
+        for (size_t i = 0; i < width; ++i) {
+            before[i]->next = i + 1 < width ? before[i + 1] : NULL;
+        }
+        d->subdirs = do_merge_sort(before[0], width);
+        n = 0;
+        for (struct file *f = d->subdirs; f; f = f->next, ++n) {
+            if (f != after[n]) {
+                fprintf(stderr, "[WARNING] parallel sort differs at %zu of "
+                        "width %zu\n", n, width);
+                break;
+            }
+        }
+    }
+    report("parallel_sort", width, width, &t);
+    free(before);
+    free(after);
+}
+
+void bench_sorting(struct directory *d, size_t width, uint64_t *rng)
+{
+    struct timing sort = {0};
+    struct timing merge_timing = {0};
+    struct timing reverse_timing = {0};
+    double start;
+    uint64_t start_cycles;
+    double total = 0;
+    while (more_reps(&sort, total)) {
+        shuffle_sizes(d, rng);
+        start_rep(&start, &start_cycles);
+        d->subdirs = do_merge_sort(d->subdirs, width);
+        end_rep(&sort, start, start_cycles);
+        total += now_seconds() - start;
+    }
+    report("sort", width, width, &sort);
+
+    total = 0;
+    while (more_reps(&merge_timing, total)) {
+        /* alternate elements of a sorted list are two sorted lists */
+        struct file *halves[2] = {NULL, NULL};
+        struct file **tails[2] = {&halves[0], &halves[1]};
+        int i = 0;
+        for (struct file *f = d->subdirs; f; f = f->next, i ^= 1) {
+            *tails[i] = f;
+            tails[i] = &f->next;
+        }
+        *tails[0] = *tails[1] = NULL;
+        start_rep(&start, &start_cycles);
+        d->subdirs = merge(halves[0], halves[1]);
+        end_rep(&merge_timing, start, start_cycles);
+        total += now_seconds() - start;
+    }
+    report("merge", width, width, &merge_timing);
+
+    total = 0;
+    while (more_reps(&reverse_timing, total)) {
+        start_rep(&start, &start_cycles);
+        d->subdirs = reverse(d->subdirs);
+        end_rep(&reverse_timing, start, start_cycles);
+        total += now_seconds() - start;
+    }
+    report("reverse", width, width, &reverse_timing);
+}
+
+void bench_lookup(struct directory *d, size_t width, uint64_t *rng)
+{
+    size_t queries = LOOKUP_ELEMENTS / width;
+    if (queries < 1) {
+        queries = 1;
+    }
+    /* names to look for, and how far into the list each of them is */
+    char **names = malloc(queries * sizeof(*names));
+    size_t elements = 0;
+    for (size_t i = 0; i < queries; ++i) {
+        size_t index = next_random(rng) % width;
+        struct file *f = d->subdirs;
+        for (size_t j = 0; j < index; ++j) {
+            f = f->next;
+        }
+        names[i] = strdup(get_file_name(f->name));
+        elements += index + 1;
+    }
+    struct timing t = {0};
+    double start;
+    uint64_t start_cycles;
+    double total = 0;
+    size_t found = 0;
+    while (more_reps(&t, total)) {
+        start_rep(&start, &start_cycles);
+        for (size_t i = 0; i < queries; ++i) {
+            found += next_entity(&d->file, names[i]) != NULL;
+        }
+        end_rep(&t, start, start_cycles);
+        total += now_seconds() - start;
+    }
+    if (found != queries * t.reps) {
+        fprintf(stderr, "[WARNING] next_entity missed %zu names\n",
+                queries * t.reps - found);
+    }
+    report("next_entity", width, elements, &t);
+    for (size_t i = 0; i < queries; ++i) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+void bench_update_size(struct directory *d, size_t width)
+{
+    struct timing t = {0};
+    double start;
+    uint64_t start_cycles;
+    double total = 0;
+    while (more_reps(&t, total)) {
+        start_rep(&start, &start_cycles);
+        update_size(d);
+        end_rep(&t, start, start_cycles);
+        total += now_seconds() - start;
+    }
+    report("update_size", width, width, &t);
+}
+
+/* Both walk the list too, as every caller of them does. */
+void bench_formatting(struct directory *d, size_t width)
+{
+    struct timing sizes = {0};
+    struct timing names = {0};
+    double start;
+    uint64_t start_cycles;
+    double total = 0;
+    char str[16];
+    size_t checksum = 0;
+    while (more_reps(&sizes, total)) {
+        start_rep(&start, &start_cycles);
+        for (struct file *f = d->subdirs; f; f = f->next) {
+            build_size_representation(str, f->size);
+            checksum += str[0];
+        }
+        end_rep(&sizes, start, start_cycles);
+        total += now_seconds() - start;
+    }
+    report("build_size_representation", width, width, &sizes);
+
+    total = 0;
+    while (more_reps(&names, total)) {
+        start_rep(&start, &start_cycles);
+        for (struct file *f = d->subdirs; f; f = f->next) {
+            checksum += *get_file_name(f->name);
+        }
+        end_rep(&names, start, start_cycles);
+        total += now_seconds() - start;
+    }
+    report("get_file_name", width, width, &names);
+    if (checksum == 0) {
+        putchar('\n');  /* keeps the loops from being optimized away */
+    }
+}
+
+int run_width(const struct micro_options *opts, size_t width)
+{
+    struct gen_options gen;
+    gen_options_init(&gen, width);
+    for (size_t i = 0; i < opts->gen_arg_count; ++i) {
+        gen_parse_option(&gen, opts->gen_args[i]);
+    }
+    gen.entries = width + 1;
+    gen.flat_dirs = 1;
+    gen.flat_entries = width;
+
+    struct gen_tree_sink sink;
+    gen_tree_sink_init(&sink);
+    if (gen_tree(&gen, MICRO_ROOT, &sink.sink) < 0) {
+        fprintf(stderr, "[ERROR] cannot generate width %zu\n", width);
+        deallocate_files(gen_tree_sink_finish(&sink));
+        return 1;
+    }
+    struct file *root = gen_tree_sink_finish(&sink);
+    struct file *flat = ((struct directory *) root)->subdirs;
+    struct directory *d = (struct directory *) flat;
+
+    uint64_t rng = gen.seed * 0x9e3779b97f4a7c15ULL + 1;
+    bench_lookup(d, width, &rng);
+    bench_update_size(d, width);
+    bench_formatting(d, width);
+    bench_sorting(d, width, &rng);
+    bench_parallel_sort(d, width, opts->sort_threads, &rng);
+    deallocate_files(root);
+    return 0;
+}
+
+bool parse_widths(struct micro_options *opts, char *list)
+{
+    opts->width_count = 0;
+    for (char *item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+        char *end;
+        double width = strtod(item, &end);
+        if (*end || width < 1 || opts->width_count == MAX_WIDTHS) {
+            return false;
+        }
+        opts->widths[opts->width_count++] = (size_t) width;
+    }
+    return opts->width_count > 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct micro_options opts = {
+        .widths = {10, 100, 1000, 10000, 100000, 1000000, 10000000},
+        .width_count = 7,
+    };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.sort_threads = cpus > MAX_SORT_THREADS ? MAX_SORT_THREADS
+                        : cpus > 2 ? cpus : 2;
+    opts.gen_args = calloc(argc, sizeof(char *));
+    int opt;
+    struct gen_options check;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_WIDTHS:
+            if (!parse_widths(&opts, optarg)) {
+                fprintf(stderr, "[ERROR] incorrect widths: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_GEN:
+            gen_options_init(&check, 1);
+            if (gen_parse_option(&check, optarg) != 0) {
+                fprintf(stderr, "[ERROR] incorrect generator option: %s\n",
+                        optarg);
+                return 1;
+            }
+            opts.gen_args[opts.gen_arg_count++] = optarg;
+            break;
+        case OPT_SORT_THREADS:
+            opts.sort_threads = strtoul(optarg, NULL, 10);
+            if (opts.sort_threads < 1 || opts.sort_threads > 4096) {
+                fprintf(stderr, "[ERROR] incorrect thread count: %s\n",
+                        optarg);
+                return 1;
+            }
+            break;
+        case OPT_HELP:
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int exit_code = 0;
+    for (size_t i = 0; i < opts.width_count && !exit_code; ++i) {
+        exit_code = run_width(&opts, opts.widths[i]);
+    }
+    free(opts.gen_args);
+    return exit_code;
+}
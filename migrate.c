@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "iolimit.h"
+#include "migrate.h"
+#include "repl.h"
+
+#define NO_LINK SIZE_MAX
+#define PROGRESS_INTERVAL 1.
+#define TEMP_SUFFIX ".migrating"
+
+struct migrate_job {
+    char *source;
+    char *target;
+    struct stat st;  /* of the source when planned */
+    size_t link_to;  /* the job whose copy this name links to */
+};
+
+struct migrate_dir {
+    char *target;
+    struct stat st;
+};
+
+struct migration {
+    struct migrate_job *jobs;
+    size_t len;
+    size_t cap;
+    struct migrate_dir *dirs;  /* parents before children */
+    size_t dir_len;
+    size_t dir_cap;
+    char **unlisted;  /* sources without a node of their own */
+    size_t unlisted_len;
+    size_t unlisted_cap;
+    uint64_t total;
+    uint64_t symlinks;
+    /* updated atomically by the workers */
+    size_t next;
+    uint64_t copied;
+    uint64_t unpaced;  /* bytes not charged to IO_COPY yet */
+    unsigned errors;
+    pthread_mutex_t lock;     /* of finished */
+    pthread_cond_t finished;  /* signaled when a worker runs out of jobs */
+};
+
+enum copy_method {
+    COPY_RANGE,  /* in the kernel, and may share extents */
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+};
+
+void migrate_error(struct migration *m, const char *what, const char *path,
+                   int error)
+{
+    __atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "[ERROR] cannot %s %s: %s\n", what, path, strerror(error));
+}
+
+/* Owner first: chown clears the setuid bit that chmod sets. */
+int copy_metadata(int fd, const struct stat *st)
+{
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    if (fchown(fd, st->st_uid, st->st_gid) != 0
+        || fchmod(fd, st->st_mode & 07777) != 0
+        || futimens(fd, times) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+bool same_file_data(const struct stat *a, const struct stat *b)
+{
+    return a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+           && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+void add_job(struct migration *m, const char *source, const char *target,
+             const struct stat *st)
+{
+    if (m->len == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 64;
+        m->jobs = realloc(m->jobs, m->cap * sizeof(*m->jobs));
+    }
+    struct migrate_job *job = &m->jobs[m->len++];
+    job->source = strdup(source);
+    job->target = strdup(target);
+    job->st = *st;
+    job->link_to = NO_LINK;
+    m->total += st->st_size;
+}
+
+void copy_symlink(struct migration *m, const char *source, const char *target,
+                  const struct stat *st)
+{
+    char link[PATH_MAX];
+    ssize_t len = readlink(source, link, sizeof(link) - 1);
+    if (len < 0) {
+        migrate_error(m, "read link", source, errno);
+        return;
+    }
+    link[len] = '\0';
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    char existing[PATH_MAX];
+    if (symlink(link, target) != 0) {
+        /* readlink() may overwrite errno */
+        int error = errno;
+        /* a link left by an earlier attempt is fine if it says the same */
+        if (error != EEXIST
+            || readlink(target, existing, sizeof(existing)) != len
+            || memcmp(existing, link, len) != 0) {
+            migrate_error(m, "create link", target, error);
+            return;
+        }
+    }
+    if (lchown(target, st->st_uid, st->st_gid) != 0
+        || utimensat(AT_FDCWD, target, times, AT_SYMLINK_NOFOLLOW) != 0) {
+        migrate_error(m, "copy metadata to", target, errno);
+        return;
+    }
+    ++m->symlinks;
+}
+
+/* Returns whether source is to be copied; directories are planned by
+ * their nodes. */
+bool plan_path(struct migration *m, const char *source, const char *target)
+{
+    struct stat st;
+    if (lstat(source, &st) != 0) {
+        migrate_error(m, "stat", source, errno);
+    } else if (S_ISREG(st.st_mode)) {
+        add_job(m, source, target, &st);
+        return true;
+    } else if (S_ISLNK(st.st_mode)) {
+        copy_symlink(m, source, target, &st);
+        return true;
+    } else if (!S_ISDIR(st.st_mode)) {
+        migrate_error(m, "migrate", source, ENOTSUP);
+    }
+    return false;
+}
+
+/* The files of a --dirs-only scan that have no node of their own. Their
+ * names are kept, so that only they are removed: the delete engine would
+ * take any file that turned up in the directory since. */
+void plan_unlisted(struct migration *m, struct directory *d,
+                   const char *target)
+{
+    struct fs_dir *dir = fs_opendir(d->file.name);
+    if (!dir) {
+        migrate_error(m, "list", d->file.name, errno);
+        return;
+    }
+    struct fs_dirent *dirent;
+    while ((dirent = fs_readdir(dir))) {
+        if (strcmp(dirent->name, ".") == 0 || strcmp(dirent->name, "..") == 0
+            || next_entity(&d->file, dirent->name)) {
+            continue;
+        }
+        char *source = concat_path(d->file.name, dirent->name);
+        char *child_target = concat_path(target, dirent->name);
+        if (plan_path(m, source, child_target)) {
+            if (m->unlisted_len == m->unlisted_cap) {
+                m->unlisted_cap = m->unlisted_cap ? m->unlisted_cap * 2 : 64;
+                m->unlisted = realloc(m->unlisted, m->unlisted_cap
+                                                   * sizeof(*m->unlisted));
+            }
+            m->unlisted[m->unlisted_len++] = source;
+        } else {
+            free(source);
+        }
+        free(child_target);
+    }
+    fs_closedir(dir);
+}
+
+/* Makes the directories right away, the files become jobs. */
+void plan_node(struct migration *m, struct file *f, const char *target)
+{
+    if (f->type != S_IFDIR >> FILE_TYPE_OFFSET) {
+        plan_path(m, f->name, target);
+        return;
+    }
+    struct stat st;
+    if (lstat(f->name, &st) != 0) {
+        migrate_error(m, "stat", f->name, errno);
+        return;
+    }
+    struct stat existing;
+    if (mkdir(target, 0700) != 0 && (errno != EEXIST
+                                     || lstat(target, &existing) != 0
+                                     || !S_ISDIR(existing.st_mode))) {
+        migrate_error(m, "create directory", target, errno);
+        return;
+    }
+    if (m->dir_len == m->dir_cap) {
+        m->dir_cap = m->dir_cap ? m->dir_cap * 2 : 16;
+        m->dirs = realloc(m->dirs, m->dir_cap * sizeof(*m->dirs));
+    }
+    m->dirs[m->dir_len].target = strdup(target);
+    m->dirs[m->dir_len++].st = st;
+    struct directory *d = (struct directory *) f;
+    for (struct file *child = d->subdirs; child; child = child->next) {
+        if (child->type == FILE_TYPE_COLLAPSED) {
+            plan_unlisted(m, d, target);
+            continue;
+        }
+        char *child_target = concat_path(target, get_file_name(child->name));
+        plan_node(m, child, child_target);
+        free(child_target);
+    }
+}
+
+int compare_job_inodes(const void *a, const void *b)
+{
+    const struct migrate_job *x = *(struct migrate_job *const *) a;
+    const struct migrate_job *y = *(struct migrate_job *const *) b;
+    if (x->st.st_dev != y->st.st_dev) {
+        return x->st.st_dev < y->st.st_dev ? -1 : 1;
+    }
+    if (x->st.st_ino != y->st.st_ino) {
+        return x->st.st_ino < y->st.st_ino ? -1 : 1;
+    }
+    return x < y ? -1 : x > y;
+}
+
+/* Names of one file within the subtree are linked to a single copy. */
+void plan_links(struct migration *m)
+{
+    struct migrate_job **linked = malloc(m->len * sizeof(*linked) + 1);
+    size_t len = 0;
+    for (size_t i = 0; i < m->len; ++i) {
+        if (m->jobs[i].st.st_nlink > 1) {
+            linked[len++] = &m->jobs[i];
+        }
+    }
+    qsort(linked, len, sizeof(*linked), compare_job_inodes);
+    for (size_t i = 1; i < len; ++i) {
+        if (linked[i]->st.st_dev == linked[i - 1]->st.st_dev
+            && linked[i]->st.st_ino == linked[i - 1]->st.st_ino) {
+            struct migrate_job *first = linked[i - 1];
+            while (first->link_to != NO_LINK) {
+                first = &m->jobs[first->link_to];
+            }
+            linked[i]->link_to = first - m->jobs;
+            m->total -= linked[i]->st.st_size;
+        }
+    }
+    free(linked);
+}
+
+/* by bytes, so that small files do not take a chunk each */
+void pace(struct migration *m, off_t n)
+{
+    if (__atomic_add_fetch(&m->unpaced, n, __ATOMIC_RELAXED)
+        >= (uint64_t) MIGRATE_CHUNK) {
+        __atomic_sub_fetch(&m->unpaced, MIGRATE_CHUNK, __ATOMIC_RELAXED);
+        io_throttle(IO_COPY);
+    }
+}
+
+/* Returns the bytes copied, -1 with errno set on a failure. The methods
+ * share the file offsets, so a fallback carries on where the last one
+ * stopped. */
+off_t copy_data(struct migration *m, int in, int out, off_t size)
+{
+    enum copy_method method = COPY_RANGE;
+    char *buffer = NULL;
+    off_t done = 0;
+    while (done < size) {
+        size_t chunk = size - done < MIGRATE_CHUNK ? size - done
+                                                   : MIGRATE_CHUNK;
+        ssize_t n;
+        if (method == COPY_RANGE) {
+            n = copy_file_range(in, NULL, out, NULL, chunk, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                          || errno == EOPNOTSUPP)) {
+                method = COPY_SENDFILE;
+                continue;
+            }
+        } else if (method == COPY_SENDFILE) {
+            n = sendfile(out, in, NULL, chunk);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                method = COPY_READ_WRITE;
+                continue;
+            }
+        } else {
+            if (!buffer) {
+                buffer = malloc(MIGRATE_CHUNK);
+            }
+            n = read(in, buffer, chunk);
+            for (ssize_t written = 0; n > 0 && written < n;) {
+                ssize_t w = write(out, buffer + written, n - written);
+                if (w < 0) {
+                    n = -1;
+                    break;
+                }
+                written += w;
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            int error = errno;
+            free(buffer);
+            errno = error;
+            return -1;
+        } else if (n == 0) {
+            break;  /* the source got shorter */
+        }
+        done += n;
+        __atomic_add_fetch(&m->copied, n, __ATOMIC_RELAXED);
+        pace(m, n);
+    }
+    free(buffer);
+    return done;
+}
+
+/* Returns whether the two files hold the same size bytes, -1 with errno
+ * set if they cannot be read. */
+int same_contents(struct migration *m, int a, int b, off_t size)
+{
+    char *buffers = malloc(2 * MIGRATE_CHUNK);
+    int result = 1;
+    for (off_t done = 0; done < size && result == 1;) {
+        size_t chunk = size - done < MIGRATE_CHUNK ? size - done
+                                                   : MIGRATE_CHUNK;
+        ssize_t n = pread(a, buffers, chunk, done);
+        ssize_t k = n > 0 ? pread(b, buffers + MIGRATE_CHUNK, n, done) : n;
+        if (n < 0 || k < 0) {
+            result = -1;
+        } else if (n == 0 || k != n || memcmp(buffers, buffers + MIGRATE_CHUNK,
+                                              n) != 0) {
+            result = 0;
+        } else {
+            done += n;
+            pace(m, n);
+        }
+    }
+    free(buffers);
+    return result;
+}
+
+/* Copies only get their name once complete, but the name may also be a
+ * file this did not write: it is taken for the copy if it holds the data
+ * of the source, and then gets its metadata. */
+bool copied_before(struct migration *m, const struct migrate_job *job)
+{
+    struct stat st;
+    if (lstat(job->target, &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size != job->st.st_size) {
+        return false;
+    }
+    int in = open(job->source, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int out = open(job->target, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    bool same = in >= 0 && out >= 0
+                && same_contents(m, in, out, job->st.st_size) == 1
+                && copy_metadata(out, &job->st) == 0;
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    return same;
+}
+
+/* where a copy is written until it is complete */
+char *temp_name(const char *target)
+{
+    const char *name = get_file_name(target);
+    size_t len = strlen(target) + sizeof(TEMP_SUFFIX) + 1;
+    char *temp = malloc(len);
+    snprintf(temp, len, "%.*s.%s" TEMP_SUFFIX, (int) (name - target), target,
+             name);
+    return temp;
+}
+
+/* Never replaces a file that took the name meanwhile, except on the
+ * filesystems that can neither rename without replacing nor link. */
+int place_copy(const char *temp, const char *target)
+{
+    if (renameat2(AT_FDCWD, temp, AT_FDCWD, target, RENAME_NOREPLACE) == 0) {
+        return 0;
+    } else if (errno != EINVAL && errno != ENOSYS) {
+        return -1;
+    } else if (link(temp, target) == 0) {
+        return unlink(temp);
+    } else if (errno == EEXIST) {
+        return -1;
+    }
+    return rename(temp, target);
+}
+
+void copy_job(struct migration *m, struct migrate_job *job)
+{
+    struct stat existing;
+    if (lstat(job->target, &existing) == 0) {
+        if (copied_before(m, job)) {
+            __atomic_add_fetch(&m->copied, job->st.st_size, __ATOMIC_RELAXED);
+        } else {
+            migrate_error(m, "create", job->target, EEXIST);
+        }
+        return;
+    }
+    int in = open(job->source, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0) {
+        migrate_error(m, "open", job->source, errno);
+        return;
+    }
+    /* what a killed attempt left under it is no copy of anything */
+    char *temp = temp_name(job->target);
+    int out = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                   0600);
+    if (out < 0) {
+        migrate_error(m, "create", temp, errno);
+        close(in);
+        free(temp);
+        return;
+    }
+    off_t copied = copy_data(m, in, out, job->st.st_size);
+    struct stat source_after, target_st;
+    const char *failed = NULL;
+    const char *path = temp;
+    int error = errno;
+    if (copied < 0) {
+        failed = "copy";
+        path = job->source;
+    } else if (fstat(in, &source_after) != 0 || fstat(out, &target_st) != 0) {
+        failed = "check";
+        error = errno;
+    } else if (!same_file_data(&source_after, &job->st)
+               || target_st.st_size != job->st.st_size) {
+        failed = "copy";
+        path = job->source;
+        error = EAGAIN;  /* written to while copying */
+    } else if (copy_metadata(out, &job->st) != 0) {
+        failed = "copy metadata to";
+        error = errno;
+    } else if (fsync(out) != 0) {
+        failed = "write";
+        error = errno;
+    }
+    if (close(out) != 0 && !failed) {
+        failed = "write";
+        error = errno;
+    }
+    close(in);
+    if (!failed && place_copy(temp, job->target) != 0) {
+        failed = "rename";
+        error = errno;
+    }
+    if (failed) {
+        unlink(temp);
+        migrate_error(m, failed, path, error);
+    }
+    free(temp);
+}
+
+void *migrate_worker(void *arg)
+{
+    struct migration *m = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED);
+        if (i >= m->len) {
+            pthread_mutex_lock(&m->lock);
+            pthread_cond_signal(&m->finished);
+            pthread_mutex_unlock(&m->lock);
+            return NULL;
+        }
+        if (m->jobs[i].link_to == NO_LINK) {
+            copy_job(m, &m->jobs[i]);
+        }
+    }
+}
+
+void run_workers(struct migration *m)
+{
+    pthread_t threads[MIGRATE_THREADS];
+    unsigned spawned = 0;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->finished, NULL);
+    while (spawned < MIGRATE_THREADS
+           && pthread_create(&threads[spawned], NULL, migrate_worker, m) == 0) {
+        ++spawned;
+    }
+    if (!spawned) {
+        migrate_worker(m);
+    }
+    char copied[16], total[16];
+    build_size_representation(total, m->total);
+    /* woken as soon as the jobs run out, not at the next tick */
+    pthread_mutex_lock(&m->lock);
+    while (__atomic_load_n(&m->next, __ATOMIC_RELAXED) < m->len) {
+        struct timespec deadline;
+        deadline_after(&deadline, PROGRESS_INTERVAL);
+        if (pthread_cond_timedwait(&m->finished, &m->lock, &deadline) == 0) {
+            continue;
+        }
+        build_size_representation(copied, __atomic_load_n(&m->copied,
+                                                          __ATOMIC_RELAXED));
+        fprintf(stderr, "[INFO] migrate: %s of %s copied\n", copied, total);
+    }
+    pthread_mutex_unlock(&m->lock);
+    for (unsigned i = 0; i < spawned; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&m->finished);
+    pthread_mutex_destroy(&m->lock);
+}
+
+/* a link made by an earlier attempt */
+bool same_inode(const char *a, const char *b)
+{
+    struct stat x, y;
+    return lstat(a, &x) == 0 && lstat(b, &y) == 0 && x.st_dev == y.st_dev
+           && x.st_ino == y.st_ino;
+}
+
+/* The links once their files are there, then the metadata of the
+ * directories, children first, since every entry made touches the mtime
+ * of its parent. */
+void finish_migration(struct migration *m)
+{
+    for (size_t i = 0; i < m->len; ++i) {
+        struct migrate_job *job = &m->jobs[i];
+        if (job->link_to != NO_LINK
+            && link(m->jobs[job->link_to].target, job->target) != 0
+            && (errno != EEXIST
+                || !same_inode(m->jobs[job->link_to].target, job->target))) {
+            migrate_error(m, "link", job->target, errno);
+        }
+    }
+    for (size_t i = m->dir_len; i-- > 0;) {
+        struct migrate_dir *dir = &m->dirs[i];
+        int fd = open(dir->target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || copy_metadata(fd, &dir->st) != 0) {
+            migrate_error(m, "copy metadata to", dir->target, errno);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void free_migration(struct migration *m)
+{
+    for (size_t i = 0; i < m->len; ++i) {
+        free(m->jobs[i].source);
+        free(m->jobs[i].target);
+    }
+    for (size_t i = 0; i < m->dir_len; ++i) {
+        free(m->dirs[i].target);
+    }
+    for (size_t i = 0; i < m->unlisted_len; ++i) {
+        free(m->unlisted[i]);
+    }
+    free(m->unlisted);
+    free(m->jobs);
+    free(m->dirs);
+}
+
+bool migrate(struct file *f, const char *dest)
+{
+    char *dest_path = realpath(dest, NULL);
+    struct stat dest_st, source_st;
+    if (!dest_path || stat(dest_path, &dest_st) != 0) {
+        fprintf(stderr, "[ERROR] cannot use %s: %s\n", dest, strerror(errno));
+        free(dest_path);
+        return false;
+    }
+    size_t len = strlen(f->name);
+    if (!S_ISDIR(dest_st.st_mode)) {
+        fprintf(stderr, "[ERROR] not a directory: %s\n", dest_path);
+        free(dest_path);
+        return false;
+    } else if (strncmp(dest_path, f->name, len) == 0
+               && (dest_path[len] == '/' || dest_path[len] == '\0')) {
+        fprintf(stderr, "[ERROR] %s is inside %s\n", dest_path, f->name);
+        free(dest_path);
+        return false;
+    } else if (lstat(f->name, &source_st) == 0
+               && source_st.st_dev == dest_st.st_dev) {
+        fprintf(stderr, "[ERROR] %s is on the same filesystem as %s; "
+                "nothing to gain\n", dest_path, f->name);
+        free(dest_path);
+        return false;
+    }
+
+    double start = now_seconds();
+    struct migration m = {0};
+    char *target = concat_path(dest_path, get_file_name(f->name));
+    plan_node(&m, f, target);
+    plan_links(&m);
+    char size[16];
+    build_size_representation(size, m.total);
+    printf("[INFO] migrating %zu files, %s to %s\n", m.len, size, target);
+    fflush(stdout);
+    run_workers(&m);
+    finish_migration(&m);
+    /* the files are synced, their names and the directories not yet */
+    int dest_fd = open(dest_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd < 0 || syncfs(dest_fd) != 0) {
+        migrate_error(&m, "sync", dest_path, errno);
+    }
+    if (dest_fd >= 0) {
+        close(dest_fd);
+    }
+
+    bool removed = false;
+    if (m.errors) {
+        fprintf(stderr, "[ERROR] %u entries could not be migrated; %s is "
+                "kept, run /migrate again to retry\n", m.errors, f->name);
+    } else {
+        printf("migrated %zu files, %llu symlinks and %zu directories, %s, "
+               "in %.1fs; removing the source\n", m.len,
+               (unsigned long long) m.symlinks, m.dir_len, size,
+               now_seconds() - start);
+        fflush(stdout);
+        /* nothing failed, so every planned entry was copied */
+        if (m.unlisted_len > 1) {
+            qsort(m.unlisted, m.unlisted_len, sizeof(*m.unlisted),
+                  compare_paths);
+        }
+        removed = remove_file_listed(f, m.unlisted, m.unlisted_len);
+    }
+    free_migration(&m);
+    free(target);
+    free(dest_path);
+    return removed;
+}
@@ -0,0 +1,22 @@
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+#include <stdbool.h>
+
+#include "tree.h"
+
+/* Moves a subtree to another filesystem: the tree says what to copy, so
+ * nothing is walked twice, and the source goes through the delete engine
+ * only once every entry has been copied and checked. */
+
+#define MIGRATE_THREADS 4
+/* file data is copied in chunks of this size, see IO_COPY */
+#define MIGRATE_CHUNK ((off_t) 8 << 20)
+
+/* Copies f with its metadata into the directory dest, then removes f with
+ * remove_file_listed() if nothing failed, so that files that appeared in
+ * the meantime stay. Entries copied by an earlier attempt are kept, so
+ * that it can simply be run again. Returns whether f was removed. */
+bool migrate(struct file *f, const char *dest);
+
+#endif
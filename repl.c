@@ -0,0 +1,792 @@
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "errors.h"
+#include "fs.h"
+#include "growth.h"
+#include "held.h"
+#include "mem.h"
+#include "migrate.h"
+#include "repl.h"
+#include "scan.h"
+#include "stats.h"
+#include "tree.h"
+
+#define MAX_PRINTED 40
+#define MIN_PERCENTAGE 5.
+#define CONFIDENCE_Z 1.96  /* 95% intervals for estimates */
+#define DEFAULT_GROWING_FILES 100
+#define DEFAULT_GROWING_SECONDS 5.
+#define GROWING_INTERVAL 0.1
+
+struct scanner *scanner = NULL;
+/* what the last /reclaim-held listed, for /reclaim-held confirm */
+static struct held_list held = {NULL, 0, 0, 0};
+
+struct estimated_file {
+    struct file *file;
+    struct size_estimate estimate;
+};
+
+/* what truncating held files gave back, by the process that kept them */
+struct recovered_process {
+    pid_t pid;
+    char comm[HELD_COMM_SIZE];
+    off_t freed;
+};
+
+void build_size_representation(char *str, off_t size)
+{   /* Maximum string size is 3 + 1 + 2 + 2 + 1 = 10*/
+    const static char PREFIXES[] = " kMGTPEZY";
+    double d_size = size;
+    uint32_t prefix_count = 0;
+    while (d_size > 1000.) {
+        d_size /= 1000.;
+        prefix_count += 1;
+    }
+
+    sprintf(str, "%.2f%cB", d_size, PREFIXES[prefix_count]);
+}
+
+void build_time_representation(char *str, uint64_t ns)
+{   /* Maximum string size is 8 + 2 + 1 = 11 for scans under 3 years */
+    if (ns >= 1000000000) {
+        sprintf(str, "%.2fs", ns * 1e-9);
+    } else if (ns >= 1000000) {
+        sprintf(str, "%.2fms", ns * 1e-6);
+    } else {
+        sprintf(str, "%.2fus", ns * 1e-3);
+    }
+}
+
+char *trim_name(const char *name)
+{
+    if (name[0] == '.' && name[1] == '/') {
+        return (char *) (name + 2);
+    } else {
+        return (char *) name;
+    }
+}
+
+char *extract_name(char *line)
+{
+    char *start = line;
+    char *end = line;
+    while (*end) {
+        ++end;
+    }
+    --end;
+    while (*start && isspace(*start)) {
+        ++start;
+    }
+    if (!*start) {
+        return start;  /* empty line */
+    }
+    while (isspace(*end)) {
+        --end;
+    }
+    end[1] = '\0';
+    return start;
+
+}
+
+void build_margin_representation(char *str, struct size_estimate e)
+{   /* Maximum string size is 2 + 10 = 12 */
+    if (!e.bounded) {
+        strcpy(str, "+?");
+    } else if (e.variance == 0) {
+        str[0] = '\0';
+    } else {
+        str[0] = '+';
+        str[1] = '-';
+        build_size_representation(str + 2,
+                                  (off_t) (CONFIDENCE_Z * sqrt(e.variance)));
+    }
+}
+
+int compare_estimates(const void *a, const void *b)
+{
+    double size_a = ((const struct estimated_file *) a)->estimate.size;
+    double size_b = ((const struct estimated_file *) b)->estimate.size;
+    return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+void print_estimate(struct directory *d)
+{
+    char size[10];
+    char margin[12];
+    struct size_estimate total = estimate_size(&d->file);
+    build_size_representation(size, (off_t) total.size);
+    build_margin_representation(margin, total);
+    printf("%s: ~%s %s (estimate, scan in progress)\n",
+           trim_name(d->file.name), size, margin);
+    printf("%64s %8s %6s %11s\n", "file name", "size", "%", "95% CI");
+    for (uint32_t i = 0; i < 92; ++i) {
+        putchar('-');
+    }
+    putchar('\n');
+
+    size_t count = 0;
+    struct file *subdirs = __atomic_load_n(&d->subdirs, __ATOMIC_ACQUIRE);
+    for (struct file *cur = subdirs; cur; cur = cur->next) {
+        ++count;
+    }
+    struct estimated_file *files = malloc(count * sizeof(*files));
+    size_t i = 0;
+    for (struct file *cur = subdirs; cur; cur = cur->next) {
+        files[i].file = cur;
+        files[i].estimate = estimate_size(cur);
+        ++i;
+    }
+    qsort(files, count, sizeof(*files), compare_estimates);
+
+    double explained = 0;
+    for (i = 0; i < count && i < MAX_PRINTED; ++i) {
+        if (explained > 100. - MIN_PERCENTAGE) {
+            break;
+        }
+        build_size_representation(size, (off_t) files[i].estimate.size);
+        build_margin_representation(margin, files[i].estimate);
+        double percentage = total.size > 0
+            ? 100. * files[i].estimate.size / total.size : 0;
+        explained += percentage;
+        printf("%64s %8s %5.1f%% %11s\n", get_file_name(files[i].file->name),
+               size, percentage, margin);
+    }
+    free(files);
+}
+
+void print_histogram(struct collapsed_files *c)
+{
+    char size[16];
+    build_size_representation(size, c->file.size);
+    printf("%s: %s in %llu files\n", trim_name(c->file.name), size,
+           (unsigned long long) c->count);
+    printf("%16s %12s\n", "size below", "files");
+    off_t limit = 1024;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i, limit *= 4) {
+        if (!c->histogram[i]) {
+            continue;
+        }
+        if (i < HISTOGRAM_BUCKETS - 1) {
+            build_size_representation(size, limit);
+        } else {
+            strcpy(size, "-");
+        }
+        printf("%16s %12u\n", size, c->histogram[i]);
+    }
+}
+
+void print_node(struct file *f)
+{
+    char size[10];
+    if (f->type == FILE_TYPE_COLLAPSED) {
+        print_histogram((struct collapsed_files *) f);
+        return;
+    }
+    if (f->type == S_IFDIR >> FILE_TYPE_OFFSET
+        && !directory_complete((struct directory *)f)) {
+        print_estimate((struct directory *)f);
+        return;
+    }
+    build_size_representation(size, f->size);
+    printf("%s: %s\n", trim_name(f->name), size);
+    if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+        struct directory *d = (struct directory *)f;
+        uint32_t printed = 0;
+        double explained = 0;
+        printf("%64s %8s %6s\n", "file name", "size", "%");
+        for (uint32_t i = 0; i < 80; ++i) {
+            putchar('-');
+        }
+        putchar('\n');
+        for (struct file *cur = sorted_subdirs(d); cur; cur=cur->next) {
+            if (++printed > MAX_PRINTED || explained > 100. - MIN_PERCENTAGE) {
+                break;
+            }
+            build_size_representation(size, cur->size);
+            double percentage = 100. * (double) cur->size / (double) f->size;
+            explained += percentage;
+            printf("%64s %8s %5.1f%%\n", get_file_name(cur->name),
+                   size, percentage);
+        }
+    }
+}
+
+void finish_scan(void)
+{
+    if (!scanner) {
+        return;
+    }
+    if (!scan_wait(scanner, 0)) {
+        printf("[INFO] waiting for the scan to finish\n");
+        scan_wait(scanner, -1);
+    }
+    scan_stop(scanner);
+    scanner = NULL;
+    uint64_t errors = errors_count();
+    if (errors) {
+        fprintf(stderr, "[WARNING] %llu entries could not be scanned, see "
+                "/errors\n", (unsigned long long) errors);
+    }
+}
+
+bool is_empty_line(const char *s)
+{
+    if (!s) {
+        return true;
+    }
+    for(; *s; ++s) {
+        if (!isspace(*s)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct file *process_rm(struct file *cur, char *line)
+{
+    struct file *to_remove;
+    if (is_empty_line(line)) {
+        to_remove = cur;
+    } else {
+        to_remove = next_entity(cur, extract_name(line));
+    }
+    if (!to_remove) {
+        fprintf(stderr, "[ERROR] no such file: %s\n", line);
+        return cur;
+    }
+    struct file *parent = &to_remove->parent->file;
+    /* the scanner may still be linking entries below */
+    finish_scan();
+    remove_file(to_remove);
+    if (parent == NULL) {
+        fprintf(stderr, "[INFO] removed root directory; exiting\n");
+    }
+    return parent;
+}
+
+/* /migrate DEST [file] */
+struct file *process_migrate(struct file *cur, char *line)
+{
+    if (!fs_is_native()) {
+        fprintf(stderr, "[ERROR] /migrate needs the real filesystem\n");
+        return cur;
+    }
+    while (line && isspace(*line)) {
+        ++line;
+    }
+    char *dest = line ? strsep(&line, " \t\n") : NULL;
+    if (!dest || !*dest) {
+        fprintf(stderr, "[ERROR] usage: /migrate DEST [file]\n");
+        return cur;
+    }
+    struct file *to_migrate;
+    if (is_empty_line(line)) {
+        to_migrate = cur;
+    } else {
+        to_migrate = next_entity(cur, extract_name(line));
+    }
+    if (!to_migrate) {
+        fprintf(stderr, "[ERROR] no such file: %s\n", line);
+        return cur;
+    }
+    struct file *parent = &to_migrate->parent->file;
+    /* every entry below has to be in the tree to be copied */
+    finish_scan();
+    if (!migrate(to_migrate, dest)) {
+        return cur;
+    }
+    if (parent == NULL) {
+        fprintf(stderr, "[INFO] migrated root directory; exiting\n");
+    }
+    return parent;
+}
+
+void process_help(char *line)
+{
+    if (!is_empty_line(line)) {
+        fprintf(stderr, "[ERROR] wrong command: /help %s\n", line);
+        return;
+    }
+    puts("Enter file name to go to this directory or .. to go up one level");
+    puts("/rm [file] to remove file or current directory if not stated");
+    puts("/mem to show the memory used by the tree");
+    puts("/slow to list subdirectories by the time their scan took");
+    puts("/errors to list the directories where scanning or removing failed");
+    puts("/stats to show scan and delete statistics");
+    puts("/growing [largest|recent] [N] [SECONDS] to find which of the N "
+         "largest or");
+    puts("    most recently modified files here grow, and who writes them");
+    puts("/migrate DEST [file] to copy file or current directory into DEST "
+         "on another");
+    puts("    filesystem, then remove it here");
+    puts("/reclaim-held to list deleted files that processes keep open, "
+         "then");
+    puts("    /reclaim-held confirm to truncate them and free their space");
+    puts("/help to display this message");
+}
+
+void process_mem(char *line)
+{
+    if (!is_empty_line(line)) {
+        fprintf(stderr, "[ERROR] wrong command: /mem %s\n", line);
+        return;
+    }
+    struct mem_stats stats[MEM_KIND_COUNT];
+    mem_get_stats(stats);
+    uint64_t entries = stats[MEM_FILE].objects + stats[MEM_DIRECTORY].objects;
+    struct mem_stats total = {0};
+    char requested[16], allocated[16], per_entry[16];
+    printf("%16s %12s %12s %12s %12s\n", "kind", "objects", "requested",
+           "allocated", "per entry");
+    puts("--------------------------------------------------------------------");
+    for (int kind = 0; kind <= MEM_KIND_COUNT; ++kind) {
+        struct mem_stats *m = kind < MEM_KIND_COUNT ? &stats[kind] : &total;
+        if (kind < MEM_KIND_COUNT) {
+            total.objects += m->objects;
+            total.requested += m->requested;
+            total.allocated += m->allocated;
+        }
+        build_size_representation(requested, m->requested);
+        build_size_representation(allocated, m->allocated);
+        printf("%16s %12llu %12s %12s %11.1fB\n",
+               kind < MEM_KIND_COUNT ? mem_kind_name(kind) : "total",
+               (unsigned long long) m->objects, requested, allocated,
+               entries ? (double) m->allocated / entries : 0.);
+    }
+    build_size_representation(allocated, total.allocated - total.requested);
+    printf("allocator slack: %s\n", allocated);
+    long rss_kb = mem_rss_kb();
+    if (rss_kb >= 0) {
+        build_size_representation(allocated, (off_t) rss_kb * 1024);
+        build_size_representation(per_entry,
+                                  entries ? (off_t) rss_kb * 1024 / entries : 0);
+        printf("resident: %s, %s per entry\n", allocated, per_entry);
+    }
+    uint64_t mapped, resident;
+    mem_map_usage(&mapped, &resident);
+    if (mapped) {
+        build_size_representation(allocated, mapped);
+        build_size_representation(per_entry, resident);
+        printf("node store: %s mapped, %s of it resident\n", allocated,
+               per_entry);
+    }
+}
+
+uint64_t scan_cost(const struct directory *d)
+{
+    return __atomic_load_n(&d->scan_ns, __ATOMIC_RELAXED);
+}
+
+int compare_costs(const void *a, const void *b)
+{
+    uint64_t cost_a = scan_cost(*(struct directory *const *) a);
+    uint64_t cost_b = scan_cost(*(struct directory *const *) b);
+    return cost_a < cost_b ? 1 : cost_a > cost_b ? -1 : 0;
+}
+
+/* Like print_node, but subdirectories by the time it took to scan them. */
+void process_slow(struct file *cur, char *line)
+{
+    if (!is_empty_line(line)) {
+        fprintf(stderr, "[ERROR] wrong command: /slow %s\n", line);
+        return;
+    }
+    if (cur->type != S_IFDIR >> FILE_TYPE_OFFSET) {
+        fprintf(stderr, "[ERROR] not a directory: %s\n", trim_name(cur->name));
+        return;
+    }
+    struct directory *d = (struct directory *) cur;
+    /* the scanner only links entries in front of this, so both walks see
+     * the same ones */
+    struct file *subdirs = __atomic_load_n(&d->subdirs, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+    for (struct file *f = subdirs; f; f = f->next) {
+        count += f->type == S_IFDIR >> FILE_TYPE_OFFSET;
+    }
+    struct directory **dirs = malloc(count * sizeof(*dirs));
+    count = 0;
+    for (struct file *f = subdirs; f; f = f->next) {
+        if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+            dirs[count++] = (struct directory *) f;
+        }
+    }
+    qsort(dirs, count, sizeof(*dirs), compare_costs);
+
+    uint64_t total = scan_cost(d);
+    char scan_time[16], syscall_time[16];
+    build_time_representation(scan_time, total);
+    build_time_representation(syscall_time,
+                              __atomic_load_n(&d->syscall_ns, __ATOMIC_RELAXED));
+    printf("%s: scanned in %s, %s of it in filesystem calls\n",
+           trim_name(cur->name), scan_time, syscall_time);
+    printf("%52s %10s %10s %6s\n", "file name", "scan", "fs calls", "%");
+    for (uint32_t i = 0; i < 80; ++i) {
+        putchar('-');
+    }
+    putchar('\n');
+    uint64_t self = __atomic_load_n(&d->self_scan_ns, __ATOMIC_RELAXED);
+    build_time_representation(scan_time, self);
+    printf("%52s %10s %10s %5.1f%%\n", "(entries of this directory)",
+           scan_time, "", total ? 100. * self / total : 0.);
+    for (size_t i = 0; i < count && i < MAX_PRINTED; ++i) {
+        uint64_t cost = scan_cost(dirs[i]);
+        build_time_representation(scan_time, cost);
+        build_time_representation(syscall_time,
+                                  __atomic_load_n(&dirs[i]->syscall_ns,
+                                                  __ATOMIC_RELAXED));
+        printf("%52s %10s %10s %5.1f%%\n", get_file_name(dirs[i]->file.name),
+               scan_time, syscall_time, total ? 100. * cost / total : 0.);
+    }
+    free(dirs);
+}
+
+void process_errors(char *line)
+{
+    if (!is_empty_line(line)) {
+        fprintf(stderr, "[ERROR] wrong command: /errors %s\n", line);
+        return;
+    }
+    errors_print(stdout, MAX_PRINTED);
+}
+
+void process_stats(char *line)
+{
+    if (!is_empty_line(line)) {
+        fprintf(stderr, "[ERROR] wrong command: /stats %s\n", line);
+        return;
+    }
+    stats_print(stdout);
+    if (scanner) {
+        scan_print_workers(scanner, stdout);
+    }
+}
+
+int compare_held(const void *a, const void *b)
+{
+    off_t x = ((const struct held_file *) a)->allocated;
+    off_t y = ((const struct held_file *) b)->allocated;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* the first holder, and how many more there are */
+void print_holders(const struct held_file *h)
+{
+    printf("%8d %-16s", (int) h->holders[0].pid, h->holders[0].comm);
+    if (h->holder_count > 1) {
+        printf(" +%zu", h->holder_count - 1);
+    }
+}
+
+void list_held(struct file *cur)
+{
+    struct file *root = cur;
+    while (root->parent) {
+        root = &root->parent->file;
+    }
+    struct stat st;
+    if (stat(root->name, &st) != 0) {
+        fprintf(stderr, "[ERROR] cannot stat %s: %s\n", root->name,
+                strerror(errno));
+        return;
+    }
+    held_list_free(&held);
+    held_find(&held, root->name, st.st_dev);
+    qsort(held.items, held.len, sizeof(*held.items), compare_held);
+    off_t total = 0;
+    char size[16];
+    printf("%10s  %8s %-16s  %s\n", "size", "pid", "process", "file");
+    for (uint32_t i = 0; i < 80; ++i) {
+        putchar('-');
+    }
+    putchar('\n');
+    for (size_t i = 0; i < held.len; ++i) {
+        struct held_file *h = &held.items[i];
+        total += h->allocated;
+        if (i < MAX_PRINTED) {
+            build_size_representation(size, h->allocated);
+            printf("%10s  ", size);
+            print_holders(h);
+            printf("  %s\n", h->path);
+        }
+    }
+    if (held.len > MAX_PRINTED) {
+        printf("... and %zu more\n", held.len - MAX_PRINTED);
+    }
+    if (held.unreadable) {
+        fprintf(stderr, "[WARNING] the open files of %u processes could not "
+                "be listed\n", held.unreadable);
+    }
+    build_size_representation(size, total);
+    printf("%zu deleted files held open, %s", held.len, size);
+    puts(held.len ? "; /reclaim-held confirm truncates them, the processes "
+         "lose their contents" : "");
+}
+
+int compare_recovered(const void *a, const void *b)
+{
+    off_t x = ((const struct recovered_process *) a)->freed;
+    off_t y = ((const struct recovered_process *) b)->freed;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Credits freed to every process holding h, once however many of its fds
+ * do; the holders come sorted by pid. */
+void add_recovered(struct recovered_process **procs, size_t *len,
+                   size_t *cap, const struct held_file *h, off_t freed)
+{
+    for (size_t i = 0; i < h->holder_count; ++i) {
+        const struct held_holder *holder = &h->holders[i];
+        if (i > 0 && holder->pid == h->holders[i - 1].pid) {
+            continue;
+        }
+        size_t j = 0;
+        while (j < *len && (*procs)[j].pid != holder->pid) {
+            ++j;
+        }
+        if (j == *len) {
+            if (*len == *cap) {
+                *cap = *cap ? *cap * 2 : 16;
+                *procs = realloc(*procs, *cap * sizeof(**procs));
+            }
+            (*procs)[j].pid = holder->pid;
+            memcpy((*procs)[j].comm, holder->comm, HELD_COMM_SIZE);
+            (*procs)[j].freed = 0;
+            ++*len;
+        }
+        (*procs)[j].freed += freed;
+    }
+}
+
+/* Truncates what the last listing found, each file once, and tells what
+ * every process that held them gave back. A file open in several
+ * processes counts for each of them, but once in the total. */
+void reclaim_held(void)
+{
+    if (!held.len) {
+        fprintf(stderr, "[ERROR] nothing to reclaim; list the files with "
+                "/reclaim-held first\n");
+        return;
+    }
+    off_t total = 0;
+    size_t files = 0;
+    struct recovered_process *procs = NULL;
+    size_t procs_len = 0;
+    size_t procs_cap = 0;
+    char size[16];
+    for (size_t i = 0; i < held.len; ++i) {
+        struct held_file *h = &held.items[i];
+        off_t freed = held_truncate(h);
+        if (freed < 0) {
+            fprintf(stderr, "[ERROR] cannot truncate %s: %s\n", h->path,
+                    errno == ESTALE ? "no holder has the file listed open"
+                                    : strerror(errno));
+            continue;
+        }
+        add_recovered(&procs, &procs_len, &procs_cap, h, freed);
+        total += freed;
+        ++files;
+    }
+    if (procs_len > 1) {
+        qsort(procs, procs_len, sizeof(*procs), compare_recovered);
+    }
+    if (procs_len) {
+        printf("%10s  %8s %-16s\n", "recovered", "pid", "process");
+    }
+    for (size_t i = 0; i < procs_len; ++i) {
+        build_size_representation(size, procs[i].freed);
+        printf("%10s  %8d %-16s\n", size, (int) procs[i].pid,
+               procs[i].comm);
+    }
+    free(procs);
+    build_size_representation(size, total);
+    printf("%s recovered from %zu files\n", size, files);
+    held_list_free(&held);
+}
+
+void process_reclaim_held(struct file *cur, char *line)
+{
+    if (!fs_is_native()) {
+        fprintf(stderr, "[ERROR] /reclaim-held needs the real filesystem\n");
+    } else if (is_empty_line(line)) {
+        list_held(cur);
+    } else {
+        while (isspace(*line)) {
+            ++line;
+        }
+        char *arg = strsep(&line, " \t\n");
+        if (strcmp(arg, "confirm") == 0 && is_empty_line(line)) {
+            reclaim_held();
+        } else {
+            fprintf(stderr, "[ERROR] wrong command: /reclaim-held %s\n", arg);
+        }
+    }
+}
+
+int compare_growth(const void *a, const void *b)
+{
+    off_t grown_a = ((const struct growing_file *) a)->grown;
+    off_t grown_b = ((const struct growing_file *) b)->grown;
+    return grown_a < grown_b ? 1 : grown_a > grown_b ? -1 : 0;
+}
+
+/* /growing [largest|recent] [N] [SECONDS] */
+bool parse_growing(char *line, enum growth_pick *how, size_t *n,
+                   double *seconds)
+{
+    char *arg;
+    int position = 0;
+    while ((arg = strsep(&line, " \t\n"))) {
+        char *end;
+        if (!*arg) {
+            continue;
+        } else if (position == 0 && strcmp(arg, "largest") == 0) {
+            *how = GROWTH_LARGEST;
+        } else if (position == 0 && strcmp(arg, "recent") == 0) {
+            *how = GROWTH_RECENT;
+        } else if (position <= 1) {
+            unsigned long value = strtoul(arg, &end, 10);
+            if (*end || value == 0) {
+                return false;
+            }
+            *n = value;
+            position = 1;
+        } else if (position == 2) {
+            *seconds = strtod(arg, &end);
+            if (*end || !(*seconds > 0)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        ++position;
+    }
+    return true;
+}
+
+void process_growing(struct file *cur, char *line)
+{
+    enum growth_pick how = GROWTH_LARGEST;
+    size_t n = DEFAULT_GROWING_FILES;
+    double seconds = DEFAULT_GROWING_SECONDS;
+    if (!fs_is_native()) {
+        fprintf(stderr, "[ERROR] /growing needs the real filesystem\n");
+        return;
+    }
+    if (line && !parse_growing(line, &how, &n, &seconds)) {
+        fprintf(stderr, "[ERROR] usage: /growing [largest|recent] [N] "
+                "[SECONDS]\n");
+        return;
+    }
+    struct growing_file *files;
+    size_t count = growth_candidates(cur, how, n, &files);
+    printf("[INFO] sampling %zu files every %.0fms for %.1fs\n", count,
+           GROWING_INTERVAL * 1e3, seconds);
+    fflush(stdout);
+    growth_sample(files, count, seconds, GROWING_INTERVAL);
+    unsigned unreadable = growth_attribute(files, count);
+    qsort(files, count, sizeof(*files), compare_growth);
+
+    char rate[16], size[16];
+    printf("%12s %10s  %s\n", "growth", "size", "file");
+    for (uint32_t i = 0; i < 80; ++i) {
+        putchar('-');
+    }
+    putchar('\n');
+    size_t grown = 0;
+    off_t total = 0;
+    for (; grown < count && files[grown].grown > 0; ++grown) {
+        struct growing_file *g = &files[grown];
+        total += g->grown;
+        if (grown >= MAX_PRINTED) {
+            continue;
+        }
+        build_size_representation(rate, (off_t) (g->grown / seconds));
+        build_size_representation(size, g->size);
+        printf("%10s/s %10s  %s%s\n", rate, size, trim_name(g->file->name),
+               g->gone ? " (replaced)" : "");
+        if (!g->writer_count) {
+            printf("%24s  not open for writing\n", "");
+            continue;
+        }
+        printf("%24s  written by", "");
+        for (unsigned i = 0; i < g->writer_count && i < GROWTH_WRITERS; ++i) {
+            printf("%s %d (%s)", i ? "," : "", (int) g->writers[i].pid,
+                   g->writers[i].comm);
+        }
+        if (g->writer_count > GROWTH_WRITERS) {
+            printf(" and %u more", g->writer_count - GROWTH_WRITERS);
+        }
+        putchar('\n');
+    }
+    if (grown > MAX_PRINTED) {
+        printf("... and %zu more\n", grown - MAX_PRINTED);
+    }
+    if (unreadable) {
+        fprintf(stderr, "[WARNING] the open files of %u processes could not "
+                "be listed\n", unreadable);
+    }
+    build_size_representation(rate, (off_t) (total / seconds));
+    printf("%zu of %zu files grew, %s/s in total\n", grown, count, rate);
+    free(files);
+}
+
+struct file *process_command(struct file *cur, char *line)
+{
+    char *cmd = strsep(&line, " \t\n");
+    if (strcmp(cmd, "/rm") == 0) {
+        return process_rm(cur, line);
+    } else if (strcmp(cmd, "/help") == 0) {
+        process_help(line);
+        return cur;
+    } else if (strcmp(cmd, "/mem") == 0) {
+        process_mem(line);
+        return cur;
+    } else if (strcmp(cmd, "/slow") == 0) {
+        process_slow(cur, line);
+        return cur;
+    } else if (strcmp(cmd, "/errors") == 0) {
+        process_errors(line);
+        return cur;
+    } else if (strcmp(cmd, "/stats") == 0) {
+        process_stats(line);
+        return cur;
+    } else if (strcmp(cmd, "/migrate") == 0) {
+        return process_migrate(cur, line);
+    } else if (strcmp(cmd, "/growing") == 0) {
+        process_growing(cur, line);
+        return cur;
+    } else if (strcmp(cmd, "/reclaim-held") == 0) {
+        process_reclaim_held(cur, line);
+        return cur;
+    } else {
+        fprintf(stderr, "command not recognized: %s\n", cmd);
+        return cur;
+    }
+}
+
+struct file *process_line(struct file *cur, char *line)
+{
+    if (*line == '/') {
+        return process_command(cur, line);
+    }
+    char *name = extract_name(line);
+    struct file *nxt = next_entity(cur, name);
+    if (!nxt) {
+        fprintf(stderr, "[ERROR] no such file: %s\n", name);
+        return cur;
+    }
+    if (nxt->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+        /* a background scan gets to what is on screen first */
+        scan_focus(scanner, (struct directory *) nxt);
+    }
+    return nxt;
+}
@@ -0,0 +1,21 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <sys/types.h>
+
+#include "tree.h"
+
+extern struct scanner *scanner;  /* still scanning in the background */
+
+void build_size_representation(char *str, off_t size);
+char *extract_name(char *line);
+bool is_empty_line(const char *s);
+void print_node(struct file *f);
+/* waits for a background scan, so that the tree can be modified */
+void finish_scan(void);
+struct file *process_command(struct file *cur, char *line);
+/* Handles one line typed at the prompt; returns the new current node, or
+ * NULL once the root has been removed. */
+struct file *process_line(struct file *cur, char *line);
+
+#endif
@@ -0,0 +1,1371 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "errors.h"
+#include "fs.h"
+#include "iolimit.h"
+#include "mem.h"
+#include "scan.h"
+#include "sched.h"
+#include "stats.h"
+#include "trace.h"
+
+#define DEFAULT_MAX_JOBS 64
+#define CONTROL_INTERVAL 0.25
+#define CONTROL_GAIN 1.05
+#define CONTROL_LOSS 0.95
+#define CONTROL_LATENCY_RISE 1.5
+#define CONTROL_HOLD 8
+#define INODE_BATCH 16
+/* a directory is split between workers once this many entries are read,
+ * or right away if its own size suggests as much */
+#define SPLIT_ENTRIES 10000
+#define SPLIT_DIR_BYTES (1 << 20)
+#define SPLIT_BATCH 1024
+/* devices past this many share the last queue */
+#define MAX_DEVICES 64
+
+enum control_action {
+    CONTROL_NONE,
+    CONTROL_INCREASE,
+    CONTROL_DECREASE,
+};
+
+/* An entry whose lstat failed with a transient error. It counts as a
+ * pending subdirectory of its parent, or in --dirs-only mode as a part of
+ * it like a batch of a split directory, until it is found or given up. */
+struct retry {
+    char *path;
+    struct directory *parent;
+    struct split_dir *split;  /* the part held in --dirs-only mode */
+    double due;
+    unsigned attempt;
+};
+
+struct retry_list {
+    struct retry *items;
+    size_t len;
+    size_t cap;
+};
+
+struct inode_entry {
+    ino_t ino;
+    size_t owner;  /* index of the directory in the batch */
+    char *path;
+};
+
+/* The largest files of one directory in --dirs-only mode; the others are
+ * only counted. */
+struct file_filter {
+    struct file **largest;  /* min-heap by size */
+    size_t len;
+    size_t cap;
+    uint64_t other_count;
+    off_t other_size;
+    uint32_t histogram[HISTOGRAM_BUCKETS];
+    struct timespec listed;  /* wall clock before the listing */
+};
+
+/* A giant directory that one worker keeps reading while others stat its
+ * entries. Each part links its entries into the directory with a single
+ * compare-and-swap; the last part to finish lets the directory complete. */
+struct split_dir {
+    struct directory *directory;
+    pthread_mutex_t lock;       /* of the filter */
+    struct file_filter filter;  /* merged from the parts in --dirs-only */
+    unsigned parts;             /* the reader and the batches not done */
+};
+
+struct split_batch {
+    struct split_dir *split;
+    struct inode_entry *entries;  /* owner is unused */
+    size_t len;
+};
+
+struct batch_list {
+    struct split_batch *items;
+    size_t len;
+    size_t cap;
+};
+
+/* The directories of one st_dev, found as the scan crosses mount points.
+ * Workers go to the device with the fewest of them, so that every disk of
+ * a multi-disk host is kept busy instead of the one that happens to hold
+ * the next directories. */
+struct device {
+    dev_t dev;
+    struct scheduler sched;   /* directories waiting for a worker */
+    unsigned running;
+};
+
+struct scanner {
+    pthread_mutex_t lock;
+    pthread_cond_t work;      /* queue or limit changed */
+    pthread_cond_t finished;
+    struct device devices[MAX_DEVICES];
+    unsigned device_count;    /* read without the lock by stat_node() */
+    unsigned next_device;     /* round-robin among equally busy ones */
+    unsigned device_jobs;     /* workers on one device, 0 for no limit */
+    enum scan_order order;
+    uint64_t seed;
+    struct directory *focus;
+    struct retry_list retries;
+    struct batch_list batches;
+    size_t pending;           /* queued, retried, batched or in progress */
+    unsigned limit;           /* workers allowed to run at once */
+    unsigned running;
+    unsigned spawned;
+    unsigned max_threads;
+    pthread_t *threads;
+    pthread_t control;
+    bool adaptive;
+    bool inode_order;
+    bool dirs_only;
+    unsigned keep_files;
+    bool done;
+    /* the last change of the worker limit, for /stats */
+    unsigned limit_changes;
+    unsigned limit_from;
+    double limit_throughput;
+    double limit_latency;
+    const char *limit_reason;
+    /* updated atomically by the workers */
+    uint64_t entries;
+    uint64_t stats;
+    uint64_t stat_ns;
+};
+
+struct dir_list {
+    struct directory **dirs;
+    size_t len;
+    size_t cap;
+};
+
+struct controller {
+    double last_time;
+    uint64_t last_entries;
+    uint64_t last_stats;
+    uint64_t last_stat_ns;
+    double prev_throughput;
+    double prev_latency;
+    unsigned prev_limit;
+    enum control_action last_action;
+    bool slow_start;
+    unsigned hold;
+};
+
+void scan_options_init(struct scan_options *opts)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->jobs = 0;
+    opts->inode_order = false;
+    opts->estimate = 0;
+    opts->dirs_only = false;
+    opts->keep_files = 0;
+    opts->order = SCAN_ORDER_AUTO;
+    opts->device_jobs = 0;
+    opts->max_jobs = DEFAULT_MAX_JOBS;
+    if (cpus > 0 && (unsigned long) cpus * 4 > opts->max_jobs) {
+        opts->max_jobs = cpus * 4;
+    }
+}
+
+/* Index of the queue of dev, which is added the first time a directory on
+ * it is found. */
+uint16_t device_index(struct scanner *s, dev_t dev)
+{
+    unsigned count = __atomic_load_n(&s->device_count, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < count; ++i) {
+        if (s->devices[i].dev == dev) {
+            return i;
+        }
+    }
+    pthread_mutex_lock(&s->lock);
+    unsigned i = 0;
+    while (i < s->device_count && s->devices[i].dev != dev) {
+        ++i;
+    }
+    if (i == MAX_DEVICES) {
+        i = MAX_DEVICES - 1;
+    } else if (i == s->device_count) {
+        struct device *device = &s->devices[i];
+        device->dev = dev;
+        sched_init(&device->sched, s->order, s->seed + 2 * i);
+        sched_focus(&device->sched, s->focus);
+        __atomic_store_n(&s->device_count, i + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return i;
+}
+
+/* Adds the latency of the call to *syscall_ns unless that is NULL. */
+struct file *stat_node(struct scanner *s, const char *path,
+                       uint64_t *syscall_ns)
+{
+    struct stat st;
+    io_throttle(IO_STAT);
+    double start = now_seconds();
+    int stat_result = fs_lstat(path, &st);
+    int error = errno;
+    double latency = now_seconds() - start;
+    io_record_latency(IO_STAT, latency);
+    if (syscall_ns) {
+        *syscall_ns += (uint64_t) (latency * 1e9);
+    }
+    if (s) {
+        __atomic_add_fetch(&s->stats, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->stat_ns, (uint64_t) (latency * 1e9),
+                           __ATOMIC_RELAXED);
+    }
+    if (stat_result) {
+        errno = error;
+        return NULL;
+    }
+    STATS_ADD(STATS_ENTRIES, 1);
+    STATS_ADD(STATS_BYTES, st.st_size);
+    struct file *file = new_file(path, st.st_mode, st.st_size);
+    if (s && S_ISDIR(st.st_mode)) {
+        ((struct directory *) file)->device = device_index(s, st.st_dev);
+    }
+    return file;
+}
+
+void dir_list_append(struct dir_list *list, struct directory *directory)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->dirs = realloc(list->dirs, list->cap * sizeof(*list->dirs));
+    }
+    list->dirs[list->len++] = directory;
+}
+
+void retry_append(struct retry_list *list, const char *path,
+                  struct directory *parent, struct split_dir *split,
+                  unsigned attempt)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, list->cap * sizeof(*list->items));
+    }
+    struct retry *retry = &list->items[list->len++];
+    retry->path = strdup(path);
+    retry->parent = parent;
+    retry->split = split;
+    retry->due = now_seconds() + errors_retry_delay(attempt);
+    retry->attempt = attempt;
+}
+
+/* Entries are collected in a private list and published at once, as the
+ * browsing thread may look at the directory while it is being listed. */
+void link_entry(struct directory *directory, struct file **subdirs,
+                struct file *new_file, struct dir_list *found)
+{
+    new_file->parent = directory;
+    new_file->next = *subdirs;
+    *subdirs = new_file;
+    if (new_file->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+        /* the parts of a split directory count concurrently */
+        __atomic_add_fetch(&directory->pending_subdirs, 1, __ATOMIC_RELAXED);
+        dir_list_append(found, (struct directory *) new_file);
+    }
+}
+
+void filter_init(struct file_filter *filter, unsigned keep_files)
+{
+    memset(filter, 0, sizeof(*filter));
+    filter->cap = keep_files;
+    clock_gettime(CLOCK_REALTIME, &filter->listed);
+}
+
+void sift_down(struct file **heap, size_t len, size_t i)
+{
+    for (;;) {
+        size_t smallest = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < len;
+             ++child) {
+            if (heap[child]->size < heap[smallest]->size) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) {
+            return;
+        }
+        struct file *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+void collapse_file(struct file_filter *filter, struct file *file)
+{
+    ++filter->other_count;
+    filter->other_size += file->size;
+    free_file(file);
+}
+
+/* Takes a non-directory entry; keeps it if it is among the largest. */
+void filter_add(struct file_filter *filter, struct file *file)
+{
+    ++filter->histogram[histogram_bucket(file->size)];
+    if (filter->len < filter->cap) {
+        if (!filter->largest) {
+            filter->largest = malloc(filter->cap * sizeof(*filter->largest));
+        }
+        size_t i = filter->len++;
+        filter->largest[i] = file;
+        /* sift up */
+        while (i > 0 && filter->largest[(i - 1) / 2]->size
+                        > filter->largest[i]->size) {
+            struct file *tmp = filter->largest[i];
+            filter->largest[i] = filter->largest[(i - 1) / 2];
+            filter->largest[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    } else if (filter->len && file->size > filter->largest[0]->size) {
+        collapse_file(filter, filter->largest[0]);
+        filter->largest[0] = file;
+        sift_down(filter->largest, filter->len, 0);
+    } else {
+        collapse_file(filter, file);
+    }
+}
+
+/* Folds the filter of one part of a split directory into the shared one. */
+void filter_merge(struct file_filter *into, struct file_filter *from)
+{
+    into->other_count += from->other_count;
+    into->other_size += from->other_size;
+    /* the reader's listing started first */
+    if (from->listed.tv_sec && (from->listed.tv_sec < into->listed.tv_sec
+                                || (from->listed.tv_sec == into->listed.tv_sec
+                                    && from->listed.tv_nsec
+                                       < into->listed.tv_nsec))) {
+        into->listed = from->listed;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        into->histogram[i] += from->histogram[i];
+    }
+    for (size_t i = 0; i < from->len; ++i) {
+        /* filter_add counts it again */
+        --into->histogram[histogram_bucket(from->largest[i]->size)];
+        filter_add(into, from->largest[i]);
+    }
+    free(from->largest);
+}
+
+/* Links the files kept, and one node standing for all the others. */
+void filter_finish(struct file_filter *filter, struct directory *directory,
+                   struct file **subdirs, struct dir_list *found)
+{
+    for (size_t i = 0; i < filter->len; ++i) {
+        link_entry(directory, subdirs, filter->largest[i], found);
+    }
+    if (filter->other_count) {
+        link_entry(directory, subdirs,
+                   new_collapsed(directory->file.name, filter->other_count,
+                                 filter->other_size, filter->histogram,
+                                 &filter->listed),
+                   found);
+    }
+    free(filter->largest);
+}
+
+void add_entry(struct scanner *s, struct directory *directory,
+               struct file **subdirs, struct file_filter *filter,
+               struct file *new_file, struct dir_list *found)
+{
+    if (s->dirs_only && new_file->type != S_IFDIR >> FILE_TYPE_OFFSET) {
+        filter_add(filter, new_file);
+    } else {
+        link_entry(directory, subdirs, new_file, found);
+    }
+}
+
+void add_to_ancestors(struct directory *directory, off_t size)
+{
+    /* other workers are adding to the same ancestors */
+    for (struct directory *d = directory; d; d = d->file.parent) {
+        __atomic_add_fetch(&d->file.size, size, __ATOMIC_RELAXED);
+    }
+}
+
+/* Charges the scan of directory's direct entries to it and its ancestors;
+ * called before publishing, so complete directories have final costs. */
+void add_cost(struct directory *directory, double seconds,
+              uint64_t syscall_ns)
+{
+    uint64_t wall_ns = (uint64_t) (seconds * 1e9);
+    __atomic_add_fetch(&directory->self_scan_ns, wall_ns, __ATOMIC_RELAXED);
+    for (struct directory *d = directory; d; d = d->file.parent) {
+        __atomic_add_fetch(&d->scan_ns, wall_ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&d->syscall_ns, syscall_ns, __ATOMIC_RELAXED);
+    }
+}
+
+struct fs_dir *timed_opendir(const char *path, uint64_t *syscall_ns)
+{
+    double start = now_seconds();
+    struct fs_dir *result = fs_opendir(path);
+    *syscall_ns += (uint64_t) ((now_seconds() - start) * 1e9);
+    return result;
+}
+
+struct fs_dirent *timed_readdir(struct fs_dir *dir, uint64_t *syscall_ns)
+{
+    double start = now_seconds();
+    struct fs_dirent *result = fs_readdir(dir);
+    *syscall_ns += (uint64_t) ((now_seconds() - start) * 1e9);
+    return result;
+}
+
+void complete_directory(struct directory *directory)
+{
+    while (directory) {
+        __atomic_store_n(&directory->scan_state, SCAN_COMPLETE,
+                         __ATOMIC_RELEASE);
+        directory = directory->file.parent;
+        if (directory && __atomic_sub_fetch(&directory->pending_subdirs, 1,
+                                            __ATOMIC_ACQ_REL) != 0) {
+            break;
+        }
+    }
+}
+
+void publish_directory(struct directory *directory, struct file *subdirs,
+                       off_t total)
+{
+    __atomic_store_n(&directory->subdirs, subdirs, __ATOMIC_RELEASE);
+    add_to_ancestors(directory, total);
+    /* subdirectories are queued only after this, so nothing below can
+     * complete before the count is final */
+    if (directory->pending_subdirs == 0) {
+        complete_directory(directory);
+    } else {
+        __atomic_store_n(&directory->scan_state, SCAN_LISTED,
+                         __ATOMIC_RELEASE);
+    }
+}
+
+int compare_inodes(const void *a, const void *b)
+{
+    ino_t ino_a = ((const struct inode_entry *) a)->ino;
+    ino_t ino_b = ((const struct inode_entry *) b)->ino;
+    return ino_a < ino_b ? -1 : ino_a > ino_b;
+}
+
+/* Prepends a chain of entries to a directory that others may be reading
+ * or adding to; the browser does not reorder an incomplete directory. */
+void splice_entries(struct directory *directory, struct file *first)
+{
+    if (!first) {
+        return;
+    }
+    struct file *last = first;
+    while (last->next) {
+        last = last->next;
+    }
+    last->next = __atomic_load_n(&directory->subdirs, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&directory->subdirs, &last->next,
+                                        first, true, __ATOMIC_RELEASE,
+                                        __ATOMIC_ACQUIRE)) {
+    }
+}
+
+struct split_dir *split_start(struct scanner *s, struct directory *directory)
+{
+    struct split_dir *split = calloc(1, sizeof(*split));
+    split->directory = directory;
+    pthread_mutex_init(&split->lock, NULL);
+    filter_init(&split->filter, s->keep_files);
+    split->parts = 1;
+    /* held until the last part is in */
+    __atomic_add_fetch(&directory->pending_subdirs, 1, __ATOMIC_RELAXED);
+    return split;
+}
+
+void push_batch(struct scanner *s, struct split_dir *split,
+                struct inode_entry *entries, size_t len)
+{
+    __atomic_add_fetch(&split->parts, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&s->lock);
+    struct batch_list *list = &s->batches;
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, list->cap * sizeof(*list->items));
+    }
+    list->items[list->len++] = (struct split_batch) { split, entries, len };
+    ++s->pending;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Adds what one part of a split directory found; the last part links the
+ * files kept in --dirs-only mode and lets the directory complete. */
+void split_merge(struct split_dir *split, struct file *subdirs, off_t total,
+                 struct file_filter *filter, struct dir_list *found)
+{
+    struct directory *directory = split->directory;
+    splice_entries(directory, subdirs);
+    add_to_ancestors(directory, total);
+    if (filter->len || filter->other_count) {
+        pthread_mutex_lock(&split->lock);
+        filter_merge(&split->filter, filter);
+        pthread_mutex_unlock(&split->lock);
+    } else {
+        free(filter->largest);
+    }
+    if (__atomic_sub_fetch(&split->parts, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    struct file *kept = NULL;
+    filter_finish(&split->filter, directory, &kept, found);
+    splice_entries(directory, kept);
+    pthread_mutex_destroy(&split->lock);
+    free(split);
+    __atomic_store_n(&directory->scan_state, SCAN_LISTED, __ATOMIC_RELEASE);
+    if (__atomic_sub_fetch(&directory->pending_subdirs, 1,
+                           __ATOMIC_ACQ_REL) == 0) {
+        complete_directory(directory);
+    }
+}
+
+/* Retries the entry later if the error may go away, records it otherwise;
+ * called before the directory is published. In --dirs-only mode a file
+ * found on a retry has to go through the filter of the directory, so the
+ * retry holds a part of it, and *split is started for that if need be. */
+void stat_failed(struct scanner *s, struct directory *directory,
+                 struct split_dir **split, const char *path, int error,
+                 struct retry_list *retries)
+{
+    if (!errors_transient(error)) {
+        errors_record(FS_LSTAT, path, error);
+    } else if (s->dirs_only) {
+        if (!*split) {
+            *split = split_start(s, directory);
+        }
+        __atomic_add_fetch(&(*split)->parts, 1, __ATOMIC_RELAXED);
+        retry_append(retries, path, directory, *split, 1);
+    } else {
+        __atomic_add_fetch(&directory->pending_subdirs, 1, __ATOMIC_RELAXED);
+        retry_append(retries, path, directory, NULL, 1);
+    }
+}
+
+/* Stats one batch of a split directory. */
+void scan_split_batch(struct scanner *s, struct split_batch *batch,
+                      struct dir_list *found, struct retry_list *retries)
+{
+    struct directory *directory = batch->split->directory;
+    uint64_t span = trace_begin(TRACE_STAT_BATCH);
+    double start = now_seconds();
+    uint64_t syscall_ns = 0;
+    if (s->inode_order) {
+        qsort(batch->entries, batch->len, sizeof(*batch->entries),
+              compare_inodes);
+    }
+    off_t total = 0;
+    struct file *subdirs = NULL;
+    struct file_filter filter;
+    filter_init(&filter, s->keep_files);
+    for (size_t i = 0; i < batch->len; ++i) {
+        char *path = batch->entries[i].path;
+        struct file *new_file = stat_node(s, path, &syscall_ns);
+        if (new_file) {
+            total += new_file->size;
+            add_entry(s, directory, &subdirs, &filter, new_file, found);
+        } else {
+            stat_failed(s, directory, &batch->split, path, errno, retries);
+        }
+        free(path);
+    }
+    free(batch->entries);
+    add_cost(directory, now_seconds() - start, syscall_ns);
+    trace_end(TRACE_STAT_BATCH, span, directory->file.name, batch->len);
+    split_merge(batch->split, subdirs, total, &filter, found);
+}
+
+/* Lists one directory and links its entries; subdirectories are appended
+ * to found for the caller to queue. A giant directory is split: from
+ * some point on its entries are only read here, and stat'ed in batches
+ * by other workers. */
+void scan_directory(struct scanner *s, struct directory *directory,
+                    struct dir_list *found, struct retry_list *retries)
+{
+    io_throttle(IO_READDIR);
+    uint64_t span = trace_begin(TRACE_SCAN_DIR);
+    double start = now_seconds();
+    uint64_t syscall_ns = 0;
+    struct file_filter filter;
+    filter_init(&filter, s->keep_files);
+    struct fs_dir *dir = timed_opendir(directory->file.name, &syscall_ns);
+    if (!dir) {
+        errors_record(FS_OPENDIR, directory->file.name, errno);
+        directory->file.type |= DIRECTORY_UNLISTABLE;
+        add_cost(directory, now_seconds() - start, syscall_ns);
+        trace_end(TRACE_SCAN_DIR, span, directory->file.name, 0);
+        publish_directory(directory, NULL, 0);
+        return;
+    }
+    size_t entries = 0;
+    off_t total = 0;
+    struct file *subdirs = NULL;
+    struct split_dir *split = NULL;
+    bool batching = false;
+    struct inode_entry *batch = NULL;
+    size_t batch_len = 0;
+    struct fs_dirent *dirent;
+    while ((dirent = timed_readdir(dir, &syscall_ns))) {
+        if (strcmp(dirent->name, ".") == 0
+            || strcmp(dirent->name, "..") == 0) {
+            continue;
+        }
+        char *subpath = concat_path(directory->file.name, dirent->name);
+        ++entries;
+        __atomic_add_fetch(&s->entries, 1, __ATOMIC_RELAXED);
+        if (!batching && s->max_threads > 1
+            && (entries > SPLIT_ENTRIES
+                || directory->self_size >= SPLIT_DIR_BYTES)) {
+            if (!split) {
+                split = split_start(s, directory);
+            }
+            batching = true;
+        }
+        if (batching) {
+            if (!batch) {
+                batch = malloc(SPLIT_BATCH * sizeof(*batch));
+            }
+            batch[batch_len].ino = dirent->ino;
+            batch[batch_len].path = subpath;
+            if (++batch_len == SPLIT_BATCH) {
+                push_batch(s, split, batch, batch_len);
+                batch = NULL;
+                batch_len = 0;
+            }
+            continue;
+        }
+        struct file *new_file = stat_node(s, subpath, &syscall_ns);
+        if (new_file) {
+            total += new_file->size;
+            add_entry(s, directory, &subdirs, &filter, new_file, found);
+        } else {
+            stat_failed(s, directory, &split, subpath, errno, retries);
+        }
+        free(subpath);
+    }
+    fs_closedir(dir);
+    add_cost(directory, now_seconds() - start, syscall_ns);
+    trace_end(TRACE_SCAN_DIR, span, directory->file.name, entries);
+    if (split) {
+        if (batch_len) {
+            push_batch(s, split, batch, batch_len);
+        }
+        split_merge(split, subdirs, total, &filter, found);
+        return;
+    }
+    filter_finish(&filter, directory, &subdirs, found);
+    publish_directory(directory, subdirs, total);
+}
+
+/* Links an entry found on a retry into its already published parent; the
+ * browser does not reorder the entries of a directory before it is
+ * complete, and the retry keeps it from completing. In --dirs-only mode
+ * the entry is merged like a part of a split directory instead. */
+void retry_entry(struct scanner *s, struct retry *retry,
+                 struct dir_list *found, struct retry_list *retries)
+{
+    struct directory *parent = retry->parent;
+    struct file *new_file = stat_node(s, retry->path, NULL);
+    int error = errno;
+    if (!new_file && errors_transient(error)
+        && errors_retry_delay(retry->attempt + 1) >= 0) {
+        retry_append(retries, retry->path, parent, retry->split,
+                     retry->attempt + 1);
+        free(retry->path);
+        return;
+    }
+    errors_retried(new_file != NULL);
+    if (!new_file) {
+        errors_record(FS_LSTAT, retry->path, error);
+    }
+    free(retry->path);
+    if (retry->split) {
+        struct file *subdirs = NULL;
+        struct file_filter filter;
+        filter_init(&filter, s->keep_files);
+        off_t total = 0;
+        if (new_file) {
+            total = new_file->size;
+            add_entry(s, parent, &subdirs, &filter, new_file, found);
+        }
+        split_merge(retry->split, subdirs, total, &filter, found);
+        return;
+    }
+    if (new_file) {
+        new_file->parent = parent;
+        new_file->next = __atomic_load_n(&parent->subdirs, __ATOMIC_ACQUIRE);
+        /* the only other writer is another retry of the same directory */
+        while (!__atomic_compare_exchange_n(&parent->subdirs, &new_file->next,
+                                            new_file, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_ACQUIRE)) {
+        }
+        add_to_ancestors(parent, new_file->size);
+        if (new_file->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+            /* still pending, now as a subdirectory to scan */
+            dir_list_append(found, (struct directory *) new_file);
+            return;
+        }
+    }
+    if (__atomic_sub_fetch(&parent->pending_subdirs, 1, __ATOMIC_ACQ_REL) == 0) {
+        complete_directory(parent);
+    }
+}
+
+/* Reads all directories of the batch before stat'ing anything, then stats
+ * the entries sorted by inode number, so that a rotational disk sweeps the
+ * inode table instead of seeking back and forth. */
+void scan_batch_inode_order(struct scanner *s, struct directory **batch,
+                            size_t n, struct dir_list *found,
+                            struct retry_list *retries)
+{
+    struct inode_entry *entries = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    off_t totals[INODE_BATCH] = {0};
+    struct file *subdirs[INODE_BATCH] = {NULL};
+    struct file_filter filters[INODE_BATCH];
+    /* the entries of the batch are interleaved, so a directory is charged
+     * its own listing plus the latency of stat'ing its entries */
+    uint64_t syscall_ns[INODE_BATCH] = {0};
+    double elapsed[INODE_BATCH] = {0};
+    for (size_t i = 0; i < n; ++i) {
+        filter_init(&filters[i], s->keep_files);
+        io_throttle(IO_READDIR);
+        uint64_t span = trace_begin(TRACE_LIST);
+        double start = now_seconds();
+        struct fs_dir *dir = timed_opendir(batch[i]->file.name,
+                                           &syscall_ns[i]);
+        if (!dir) {
+            errors_record(FS_OPENDIR, batch[i]->file.name, errno);
+            elapsed[i] = now_seconds() - start;
+            trace_end(TRACE_LIST, span, batch[i]->file.name, 0);
+            batch[i]->file.type |= DIRECTORY_UNLISTABLE;
+            continue;
+        }
+        size_t listed = len;
+        struct fs_dirent *dirent;
+        while ((dirent = timed_readdir(dir, &syscall_ns[i]))) {
+            if (strcmp(dirent->name, ".") == 0
+                || strcmp(dirent->name, "..") == 0) {
+                continue;
+            }
+            if (len == cap) {
+                cap = cap ? cap * 2 : 256;
+                entries = realloc(entries, cap * sizeof(*entries));
+            }
+            entries[len].ino = dirent->ino;
+            entries[len].owner = i;
+            entries[len].path = concat_path(batch[i]->file.name,
+                                            dirent->name);
+            ++len;
+        }
+        fs_closedir(dir);
+        elapsed[i] = now_seconds() - start;
+        trace_end(TRACE_LIST, span, batch[i]->file.name, len - listed);
+    }
+
+    uint64_t span = trace_begin(TRACE_STAT_BATCH);
+    if (len > 1) {
+        qsort(entries, len, sizeof(*entries), compare_inodes);
+    }
+    /* giant directories are stat'ed by other workers as well, in runs of
+     * the sorted entries */
+    struct split_dir *splits[INODE_BATCH] = {NULL};
+    bool batching[INODE_BATCH] = {false};
+    struct inode_entry *runs[INODE_BATCH] = {NULL};
+    size_t run_lens[INODE_BATCH] = {0};
+    if (s->max_threads > 1) {
+        size_t counts[INODE_BATCH] = {0};
+        for (size_t i = 0; i < len; ++i) {
+            ++counts[entries[i].owner];
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (counts[i] > SPLIT_ENTRIES
+                || (counts[i] && batch[i]->self_size >= SPLIT_DIR_BYTES)) {
+                splits[i] = split_start(s, batch[i]);
+                batching[i] = true;
+            }
+        }
+    }
+    for (size_t i = 0; i < len; ++i) {
+        size_t owner = entries[i].owner;
+        if (batching[owner]) {
+            if (!runs[owner]) {
+                runs[owner] = malloc(SPLIT_BATCH * sizeof(*runs[owner]));
+            }
+            runs[owner][run_lens[owner]] = entries[i];
+            if (++run_lens[owner] == SPLIT_BATCH) {
+                push_batch(s, splits[owner], runs[owner], run_lens[owner]);
+                runs[owner] = NULL;
+                run_lens[owner] = 0;
+            }
+            continue;
+        }
+        uint64_t before = syscall_ns[owner];
+        struct file *new_file = stat_node(s, entries[i].path,
+                                          &syscall_ns[owner]);
+        elapsed[owner] += (syscall_ns[owner] - before) * 1e-9;
+        if (new_file) {
+            totals[owner] += new_file->size;
+            add_entry(s, batch[owner], &subdirs[owner], &filters[owner],
+                      new_file, found);
+        } else {
+            stat_failed(s, batch[owner], &splits[owner], entries[i].path,
+                        errno, retries);
+        }
+        free(entries[i].path);
+    }
+    __atomic_add_fetch(&s->entries, len, __ATOMIC_RELAXED);
+    free(entries);
+    trace_end(TRACE_STAT_BATCH, span, batch[0]->file.name, len);
+    for (size_t i = 0; i < n; ++i) {
+        add_cost(batch[i], elapsed[i], syscall_ns[i]);
+        if (splits[i]) {
+            if (run_lens[i]) {
+                push_batch(s, splits[i], runs[i], run_lens[i]);
+            }
+            split_merge(splits[i], subdirs[i], totals[i], &filters[i], found);
+            continue;
+        }
+        filter_finish(&filters[i], batch[i], &subdirs[i], found);
+        publish_directory(batch[i], subdirs[i], totals[i]);
+    }
+}
+
+void push_directories(struct scanner *s, struct directory **dirs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        sched_push(&s->devices[dirs[i]->device].sched, dirs[i]);
+    }
+    s->pending += n;
+}
+
+/* must be called with s->lock held */
+size_t queued_directories(struct scanner *s)
+{
+    size_t len = 0;
+    for (unsigned i = 0; i < s->device_count; ++i) {
+        len += sched_len(&s->devices[i].sched);
+    }
+    return len;
+}
+
+/* The device to take directories from: one with the subtree on screen if
+ * any, else the one with the fewest workers, taking turns on ties. -1 if
+ * no device has both queued directories and room for another worker. The
+ * turn only passes when a directory is taken from it. Must be called with
+ * s->lock held. */
+int pick_device(struct scanner *s)
+{
+    int best = -1;
+    for (unsigned k = 0; k < s->device_count; ++k) {
+        unsigned i = (s->next_device + k) % s->device_count;
+        struct device *device = &s->devices[i];
+        if (!sched_len(&device->sched)
+            || (s->device_jobs && device->running >= s->device_jobs)) {
+            continue;
+        }
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+        struct device *other = &s->devices[best];
+        bool boosted = device->sched.boosted.len > 0;
+        bool other_boosted = other->sched.boosted.len > 0;
+        if (boosted != other_boosted ? boosted
+            : device->running < other->running) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void push_retries(struct scanner *s, struct retry_list *list)
+{
+    for (size_t i = 0; i < list->len; ++i) {
+        struct retry *item = &list->items[i];
+        retry_append(&s->retries, item->path, item->parent, item->split,
+                     item->attempt);
+        free(item->path);
+    }
+    s->pending += list->len;
+    free(list->items);
+}
+
+/* index of a retry that is due, -1 if none is */
+ssize_t due_retry(struct scanner *s)
+{
+    double now = now_seconds();
+    for (size_t i = 0; i < s->retries.len; ++i) {
+        if (s->retries.items[i].due <= now) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Sets *device to the one to take directories from, as pick_device()
+ * does, and *retry to a retry that is due if there is nothing else; must
+ * be called with s->lock held. */
+bool has_work(struct scanner *s, int *device, ssize_t *retry)
+{
+    *device = -1;
+    *retry = -1;
+    if (s->running >= s->limit) {
+        return false;
+    }
+    return (*device = pick_device(s)) >= 0 || s->batches.len > 0
+           || (*retry = due_retry(s)) >= 0;
+}
+
+/* Sleeps until woken, or until the next retry is due. */
+void wait_for_work(struct scanner *s)
+{
+    if (s->retries.len == 0 || s->running >= s->limit) {
+        pthread_cond_wait(&s->work, &s->lock);
+        return;
+    }
+    double due = s->retries.items[0].due;
+    for (size_t i = 1; i < s->retries.len; ++i) {
+        if (s->retries.items[i].due < due) {
+            due = s->retries.items[i].due;
+        }
+    }
+    struct timespec deadline;
+    deadline_after(&deadline, due > now_seconds() ? due - now_seconds() : 0);
+    pthread_cond_timedwait(&s->work, &s->lock, &deadline);
+}
+
+void *scan_worker(void *arg)
+{
+    struct scanner *s = arg;
+    trace_thread_name("scan worker");
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        uint64_t span = trace_begin(TRACE_IDLE);
+        int picked;
+        ssize_t due;
+        while (!s->done && !has_work(s, &picked, &due)) {
+            wait_for_work(s);
+        }
+        trace_end(TRACE_IDLE, span, NULL, 0);
+        if (s->done) {
+            break;
+        }
+        struct directory *batch[INODE_BATCH];
+        size_t n = 0;
+        struct device *device = NULL;
+        struct retry retry;
+        struct split_batch split_batch = { NULL, NULL, 0 };
+        if (due >= 0) {
+            retry = s->retries.items[due];
+            s->retries.items[due] = s->retries.items[--s->retries.len];
+            n = 1;
+        } else if (s->batches.len) {
+            /* ahead of whole directories, they hold up a reader's tail */
+            span = trace_begin(TRACE_STEAL);
+            split_batch = s->batches.items[--s->batches.len];
+            trace_end(TRACE_STEAL, span, split_batch.split->directory->file.name,
+                      split_batch.len);
+            n = 1;
+        } else {
+            span = trace_begin(TRACE_POP);
+            device = &s->devices[picked];
+            s->next_device = (picked + 1) % s->device_count;
+            do {
+                batch[n++] = sched_pop(&device->sched);
+            } while (s->inode_order && n < INODE_BATCH
+                     && sched_len(&device->sched) > s->limit);
+            trace_end(TRACE_POP, span, batch[0]->file.name, n);
+            ++device->running;
+        }
+        ++s->running;
+        pthread_mutex_unlock(&s->lock);
+
+        struct dir_list found = { NULL, 0, 0 };
+        struct retry_list retries = { NULL, 0, 0 };
+        if (due >= 0) {
+            retry_entry(s, &retry, &found, &retries);
+        } else if (split_batch.split) {
+            scan_split_batch(s, &split_batch, &found, &retries);
+        } else if (s->inode_order) {
+            scan_batch_inode_order(s, batch, n, &found, &retries);
+            /* pop the subdirectories in inode order too */
+            for (size_t i = 0; i < found.len / 2; ++i) {
+                struct directory *tmp = found.dirs[i];
+                found.dirs[i] = found.dirs[found.len - 1 - i];
+                found.dirs[found.len - 1 - i] = tmp;
+            }
+        } else {
+            scan_directory(s, batch[0], &found, &retries);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        push_directories(s, found.dirs, found.len);
+        push_retries(s, &retries);
+        free(found.dirs);
+        if (device) {
+            --device->running;
+        }
+        --s->running;
+        s->pending -= n;
+        if (s->pending == 0) {
+            s->done = true;
+            pthread_cond_broadcast(&s->work);
+            pthread_cond_broadcast(&s->finished);
+        } else if (queued_directories(s) || s->batches.len || retries.len) {
+            pthread_cond_broadcast(&s->work);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* must be called with s->lock held */
+void set_limit(struct scanner *s, unsigned limit)
+{
+    s->limit = limit;
+    while (s->spawned < limit) {
+        if (pthread_create(&s->threads[s->spawned], NULL, scan_worker, s)) {
+            if (s->spawned == 0) {
+                err(1, "[ERROR] cannot start scanner thread");
+            }
+            s->limit = s->spawned;
+            break;
+        }
+        ++s->spawned;
+    }
+    pthread_cond_broadcast(&s->work);
+}
+
+/* AIMD on the number of running workers: grow while throughput grows
+ * (doubling until the first loss), shrink by a quarter when it falls or
+ * stat latency climbs without a gain, then probe upwards again. */
+void control_step(struct scanner *s, struct controller *c, unsigned max_jobs)
+{
+    double now = now_seconds();
+    uint64_t entries = __atomic_load_n(&s->entries, __ATOMIC_RELAXED);
+    uint64_t stats = __atomic_load_n(&s->stats, __ATOMIC_RELAXED);
+    uint64_t stat_ns = __atomic_load_n(&s->stat_ns, __ATOMIC_RELAXED);
+    double throughput = (entries - c->last_entries) / (now - c->last_time);
+    double latency = stats == c->last_stats ? 0
+        : (stat_ns - c->last_stat_ns) * 1e-9 / (stats - c->last_stats);
+    c->last_time = now;
+    c->last_entries = entries;
+    c->last_stats = stats;
+    c->last_stat_ns = stat_ns;
+
+    unsigned limit = s->limit;
+    enum control_action action = CONTROL_NONE;
+    const char *reason = NULL;
+    if (c->hold) {
+        --c->hold;
+    } else if (c->last_action == CONTROL_INCREASE && c->prev_throughput > 0) {
+        if (throughput > c->prev_throughput * CONTROL_GAIN) {
+            action = CONTROL_INCREASE;
+            reason = "throughput rising";
+        } else if (throughput < c->prev_throughput * CONTROL_LOSS) {
+            action = CONTROL_DECREASE;
+            reason = "throughput falling";
+        } else {
+            limit = c->prev_limit;
+            c->slow_start = false;
+            c->hold = CONTROL_HOLD;
+            reason = "no gain";
+        }
+    } else if (c->prev_latency > 0
+               && latency > c->prev_latency * CONTROL_LATENCY_RISE
+               && throughput <= c->prev_throughput) {
+        action = CONTROL_DECREASE;
+        reason = "stat latency rising";
+    } else if (queued_directories(s) > 0 || s->batches.len > 0) {
+        action = CONTROL_INCREASE;
+        reason = c->slow_start ? "slow start" : "probing";
+    }
+
+    if (action == CONTROL_INCREASE) {
+        limit = c->slow_start ? limit * 2 : limit + 1;
+        if (limit > max_jobs) {
+            limit = max_jobs;
+        }
+    } else if (action == CONTROL_DECREASE) {
+        limit -= limit / 4;
+        if (limit < 1) {
+            limit = 1;
+        }
+        c->slow_start = false;
+    }
+    c->prev_throughput = throughput;
+    c->prev_latency = latency;
+    c->prev_limit = s->limit;
+    c->last_action = limit > s->limit ? CONTROL_INCREASE : action;
+    if (limit != s->limit) {
+        /* up to every CONTROL_INTERVAL, too often to print in the REPL */
+        ++s->limit_changes;
+        s->limit_from = s->limit;
+        s->limit_throughput = throughput;
+        s->limit_latency = latency;
+        s->limit_reason = reason;
+        set_limit(s, limit);
+    }
+}
+
+void *scan_control(void *arg)
+{
+    struct scanner *s = arg;
+    struct controller c = {
+        .last_time = now_seconds(),
+        .slow_start = true,
+        .last_action = CONTROL_NONE,
+    };
+    pthread_mutex_lock(&s->lock);
+    while (!s->done) {
+        struct timespec deadline;
+        deadline_after(&deadline, CONTROL_INTERVAL);
+        pthread_cond_timedwait(&s->finished, &s->lock, &deadline);
+        if (!s->done && s->adaptive) {
+            control_step(s, &c, s->max_threads);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+struct scanner *scan_start(const char *path, const struct scan_options *opts,
+                           struct file **root)
+{
+    mem_map_advise(MEM_ACCESS_SCAN);
+    struct scanner *s = calloc(1, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+    /* a uniform order makes the listed subdirectories of every directory
+     * an unbiased sample for estimate_size() */
+    s->order = opts->order;
+    if (s->order == SCAN_ORDER_AUTO) {
+        s->order = opts->estimate > 0 ? SCAN_RANDOM : SCAN_DEPTH_FIRST;
+    }
+    s->seed = (uint64_t) time(NULL) << 1;
+    /* the root brings the first device */
+    *root = stat_node(s, path, NULL);
+    if (!*root || (*root)->type != S_IFDIR >> FILE_TYPE_OFFSET) {
+        for (unsigned i = 0; i < s->device_count; ++i) {
+            sched_free(&s->devices[i].sched);
+        }
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        return NULL;
+    }
+
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->finished, NULL);
+    s->adaptive = !opts->jobs;
+    s->inode_order = opts->inode_order;
+    s->dirs_only = opts->dirs_only;
+    s->keep_files = opts->keep_files;
+    s->device_jobs = opts->device_jobs;
+    s->max_threads = opts->jobs ? opts->jobs : opts->max_jobs;
+    unsigned initial = opts->jobs;
+    if (!initial) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        initial = cpus > 0 ? cpus : 1;
+        if (initial > s->max_threads) {
+            initial = s->max_threads;
+        }
+    }
+    s->threads = malloc(s->max_threads * sizeof(*s->threads));
+
+    pthread_mutex_lock(&s->lock);
+    struct directory *directory = (struct directory *) *root;
+    push_directories(s, &directory, 1);
+    set_limit(s, initial);
+    pthread_mutex_unlock(&s->lock);
+    if (pthread_create(&s->control, NULL, scan_control, s)) {
+        err(1, "[ERROR] cannot start scanner thread");
+    }
+    return s;
+}
+
+bool scan_wait(struct scanner *s, double timeout)
+{
+    if (!s) {
+        return true;
+    }
+    struct timespec deadline;
+    if (timeout >= 0) {
+        deadline_after(&deadline, timeout);
+    }
+    pthread_mutex_lock(&s->lock);
+    while (!s->done) {
+        if (timeout < 0) {
+            pthread_cond_wait(&s->finished, &s->lock);
+        } else if (pthread_cond_timedwait(&s->finished, &s->lock,
+                                          &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool done = s->done;
+    pthread_mutex_unlock(&s->lock);
+    return done;
+}
+
+void scan_focus(struct scanner *s, struct directory *directory)
+{
+    if (!s) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->focus = directory;
+    for (unsigned i = 0; i < s->device_count; ++i) {
+        sched_focus(&s->devices[i].sched, directory);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void scan_print_workers(struct scanner *s, FILE *out)
+{
+    pthread_mutex_lock(&s->lock);
+    fprintf(out, "%16s %16u\n", "scan workers", s->limit);
+    if (s->limit_changes) {
+        fprintf(out, "%16s %16u; last %u -> %u, %.0f entries/s, stat %.3fms "
+                "(%s)\n", "limit changes", s->limit_changes, s->limit_from,
+                s->limit, s->limit_throughput, s->limit_latency * 1e3,
+                s->limit_reason);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void scan_stop(struct scanner *s)
+{
+    if (!s) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->done = true;
+    pthread_cond_broadcast(&s->work);
+    pthread_cond_broadcast(&s->finished);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->control, NULL);
+    for (unsigned i = 0; i < s->spawned; ++i) {
+        pthread_join(s->threads[i], NULL);
+    }
+    pthread_cond_destroy(&s->finished);
+    pthread_cond_destroy(&s->work);
+    pthread_mutex_destroy(&s->lock);
+    free(s->threads);
+    for (unsigned i = 0; i < s->device_count; ++i) {
+        sched_free(&s->devices[i].sched);
+    }
+    /* retries and batches left of an abandoned scan still have to let go
+     * of their split directories */
+    for (size_t i = 0; i < s->retries.len; ++i) {
+        free(s->retries.items[i].path);
+        if (s->retries.items[i].split) {
+            struct file_filter filter = { NULL };
+            struct dir_list found = { NULL, 0, 0 };
+            split_merge(s->retries.items[i].split, NULL, 0, &filter, &found);
+            free(found.dirs);
+        }
+    }
+    free(s->retries.items);
+    for (size_t i = 0; i < s->batches.len; ++i) {
+        struct split_batch *batch = &s->batches.items[i];
+        for (size_t j = 0; j < batch->len; ++j) {
+            free(batch->entries[j].path);
+        }
+        free(batch->entries);
+        struct file_filter filter = { NULL };
+        struct dir_list found = { NULL, 0, 0 };
+        split_merge(batch->split, NULL, 0, &filter, &found);
+        free(found.dirs);
+    }
+    free(s->batches.items);
+    free(s);
+    mem_map_advise(MEM_ACCESS_BROWSE);
+}
+
+struct file *build_tree(const char *path, const struct scan_options *opts)
+{
+    struct file *root;
+    struct scanner *s = scan_start(path, opts, &root);
+    scan_wait(s, -1);
+    scan_stop(s);
+    return root;
+}
+
+/* Extrapolates the size of a partially scanned subtree. The listed
+ * subdirectories of a directory are a uniform sample of all of them, so
+ * the rest is estimated from their mean, with the variance of a sample
+ * mean drawn without replacement plus the variance of the sampled
+ * estimates themselves. */
+struct size_estimate estimate_size(struct file *f)
+{
+    struct size_estimate e = { file_size(f), 0, true };
+    if (f->type != S_IFDIR >> FILE_TYPE_OFFSET) {
+        return e;
+    }
+    struct directory *d = (struct directory *) f;
+    uint8_t state = __atomic_load_n(&d->scan_state, __ATOMIC_ACQUIRE);
+    if (state == SCAN_COMPLETE) {
+        return e;
+    } else if (state == SCAN_QUEUED) {
+        e.bounded = false;
+        return e;
+    }
+
+    double n = 0;
+    double m = 0;
+    double sum = 0;
+    double sum_sq = 0;
+    double nested_variance = 0;
+    double unsampled = 0;
+    e.size = d->self_size;
+    struct file *subdirs = __atomic_load_n(&d->subdirs, __ATOMIC_ACQUIRE);
+    for (struct file *cur = subdirs; cur; cur = cur->next) {
+        if (cur->type != S_IFDIR >> FILE_TYPE_OFFSET) {
+            e.size += file_size(cur);
+            continue;
+        }
+        ++n;
+        struct size_estimate sub = estimate_size(cur);
+        if (!sub.bounded) {
+            unsampled += sub.size;
+            continue;
+        }
+        ++m;
+        sum += sub.size;
+        sum_sq += sub.size * sub.size;
+        nested_variance += sub.variance;
+    }
+    if (m == 0) {
+        e.size += unsampled;
+        e.bounded = n == 0;
+        return e;
+    }
+    double mean = sum / m;
+    double sample_variance = m > 1
+        ? fmax(sum_sq - m * mean * mean, 0) / (m - 1)
+        : mean * mean;  /* no spread known yet; assume it is large */
+    e.size += n * mean;
+    e.variance = n * n * (1 - m / n) * sample_variance / m
+                 + (n / m) * (n / m) * nested_variance;
+    return e;
+}
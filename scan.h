@@ -0,0 +1,47 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdio.h>
+
+#include "sched.h"
+#include "tree.h"
+
+struct scan_options {
+    unsigned jobs;      /* fixed number of workers; 0 lets the controller decide */
+    unsigned max_jobs;  /* upper bound for the controller */
+    bool inode_order;   /* stat batches of directories sorted by d_ino */
+    double estimate;    /* seconds of sampling before browsing; 0 waits for
+                           the full scan */
+    bool dirs_only;     /* keep nodes only for directories and ... */
+    unsigned keep_files; /* ... this many of the largest files in each */
+    enum scan_order order;
+    unsigned device_jobs; /* workers on one st_dev at once; 0 for no limit */
+};
+
+struct size_estimate {
+    double size;
+    double variance;
+    bool bounded;       /* false while no sampled subdirectory backs it */
+};
+
+struct scanner;
+
+void scan_options_init(struct scan_options *opts);
+/* Starts scanning path in the background; *root is NULL if path cannot be
+ * stat'ed. Returns NULL when there is nothing to scan beyond the root. */
+struct scanner *scan_start(const char *path, const struct scan_options *opts,
+                           struct file **root);
+/* Waits up to timeout seconds, forever if negative; true once finished. */
+bool scan_wait(struct scanner *s, double timeout);
+/* Scans the subtree of directory ahead of everything else, for the part
+ * of the tree the user is looking at. */
+void scan_focus(struct scanner *s, struct directory *directory);
+/* Writes the number of workers for /stats, and why it last changed. */
+void scan_print_workers(struct scanner *s, FILE *out);
+/* Abandons the remaining work, joins the threads and frees the scanner. */
+void scan_stop(struct scanner *s);
+struct file *build_tree(const char *path, const struct scan_options *opts);
+
+struct size_estimate estimate_size(struct file *f);
+
+#endif
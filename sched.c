@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "sched.h"
+
+#define MIN_QUEUE_CAP 64
+#define MIN_HINTS_SIZE 1024
+
+struct hint {
+    char *path;
+    off_t size;  /* of the whole subtree */
+};
+
+static const char *const order_names[SCAN_ORDER_COUNT] = {
+    "auto", "depth-first", "breadth-first", "largest-first", "random",
+};
+
+/* open addressing by path, grown at half load */
+static struct hint *hints = NULL;
+static size_t hints_size = 0;
+static size_t hints_len = 0;
+
+const char *scan_order_name(enum scan_order order)
+{
+    return order_names[order];
+}
+
+int scan_order_parse(const char *name)
+{
+    for (int order = 0; order < SCAN_ORDER_COUNT; ++order) {
+        if (strcmp(order_names[order], name) == 0) {
+            return order;
+        }
+    }
+    return -1;
+}
+
+uint64_t hash_hint(const char *path, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct hint *find_hint(struct hint *table, size_t size, const char *path,
+                       size_t len)
+{
+    size_t i = hash_hint(path, len) & (size - 1);
+    while (table[i].path && (strncmp(table[i].path, path, len) != 0
+                             || table[i].path[len] != '\0')) {
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+void add_hint(const char *path, size_t len, off_t size)
+{
+    if (2 * (hints_len + 1) > hints_size) {
+        size_t new_size = hints_size ? hints_size * 2 : MIN_HINTS_SIZE;
+        struct hint *table = calloc(new_size, sizeof(*table));
+        for (size_t i = 0; i < hints_size; ++i) {
+            if (hints[i].path) {
+                *find_hint(table, new_size, hints[i].path,
+                           strlen(hints[i].path)) = hints[i];
+            }
+        }
+        free(hints);
+        hints = table;
+        hints_size = new_size;
+    }
+    struct hint *hint = find_hint(hints, hints_size, path, len);
+    if (!hint->path) {
+        hint->path = strndup(path, len);
+        ++hints_len;
+    }
+    hint->size += size;
+}
+
+long sched_load_hints(FILE *manifest)
+{
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    long count = 0;
+    while ((len = getline(&line, &line_cap, manifest)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        char type;
+        long long size;
+        unsigned long long ino;
+        int path_offset = 0;
+        if (sscanf(line, "%c %lld %llu %n", &type, &size, &ino,
+                   &path_offset) != 3 || !path_offset) {
+            count = -1;
+            break;
+        }
+        /* every directory on the way down holds the entry */
+        const char *path = line + path_offset;
+        size_t path_len = strlen(path);
+        if (type == 'd') {
+            add_hint(path, path_len, size);
+        }
+        for (size_t i = path_len; i > 1; --i) {
+            if (path[i - 1] == '/') {
+                add_hint(path, i - 1, size);
+            }
+        }
+        ++count;
+    }
+    free(line);
+    return count;
+}
+
+off_t size_hint(struct directory *directory)
+{
+    if (!hints_len) {
+        return directory->self_size;
+    }
+    const char *path = directory->file.name;
+    struct hint *hint = find_hint(hints, hints_size, path, strlen(path));
+    return hint->path ? hint->size : 0;
+}
+
+struct queue_item *item_at(struct dir_queue *q, size_t i)
+{
+    return &q->items[(q->head + i) % q->cap];
+}
+
+void append_item(struct dir_queue *q, struct queue_item item)
+{
+    if (q->len == q->cap) {
+        size_t old_cap = q->cap;
+        q->cap = q->cap ? q->cap * 2 : MIN_QUEUE_CAP;
+        q->items = mem_realloc(MEM_INDEX, q->items,
+                               old_cap * sizeof(*q->items),
+                               q->cap * sizeof(*q->items));
+        /* the part of a wrapped ring before head goes behind the old end */
+        if (q->head + q->len > old_cap) {
+            memcpy(q->items + old_cap, q->items,
+                   (q->head + q->len - old_cap) * sizeof(*q->items));
+        }
+    }
+    *item_at(q, q->len++) = item;
+}
+
+struct queue_item take_last(struct dir_queue *q, uint64_t *rng)
+{
+    return *item_at(q, --q->len);
+}
+
+struct queue_item take_first(struct dir_queue *q, uint64_t *rng)
+{
+    struct queue_item item = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    if (--q->len == 0) {
+        q->head = 0;
+    }
+    return item;
+}
+
+struct queue_item take_random(struct dir_queue *q, uint64_t *rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    struct queue_item *item = item_at(q, *rng % q->len);
+    struct queue_item result = *item;
+    *item = *item_at(q, --q->len);
+    return result;
+}
+
+void swap_items(struct queue_item *a, struct queue_item *b)
+{
+    struct queue_item tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* a max-heap by priority, head stays at 0 */
+void push_heap(struct dir_queue *q, struct queue_item item)
+{
+    append_item(q, item);
+    size_t i = q->len - 1;
+    while (i > 0 && q->items[(i - 1) / 2].priority < q->items[i].priority) {
+        swap_items(&q->items[(i - 1) / 2], &q->items[i]);
+        i = (i - 1) / 2;
+    }
+}
+
+struct queue_item pop_heap(struct dir_queue *q, uint64_t *rng)
+{
+    struct queue_item result = q->items[0];
+    q->items[0] = q->items[--q->len];
+    size_t i = 0;
+    for (;;) {
+        size_t largest = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < q->len;
+             ++child) {
+            if (q->items[child].priority > q->items[largest].priority) {
+                largest = child;
+            }
+        }
+        if (largest == i) {
+            return result;
+        }
+        swap_items(&q->items[i], &q->items[largest]);
+        i = largest;
+    }
+}
+
+static const struct scan_policy policies[SCAN_ORDER_COUNT] = {
+    [SCAN_DEPTH_FIRST] = {append_item, take_last},
+    [SCAN_BREADTH_FIRST] = {append_item, take_first},
+    [SCAN_LARGEST_FIRST] = {push_heap, pop_heap},
+    [SCAN_RANDOM] = {append_item, take_random},
+};
+
+void sched_init(struct scheduler *sched, enum scan_order order, uint64_t seed)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->policy = &policies[order == SCAN_ORDER_AUTO ? SCAN_DEPTH_FIRST
+                                                       : order];
+    sched->rng = seed | 1;
+}
+
+void sched_free(struct scheduler *sched)
+{
+    mem_free(MEM_INDEX, sched->queue.items,
+             sched->queue.cap * sizeof(*sched->queue.items));
+    mem_free(MEM_INDEX, sched->boosted.items,
+             sched->boosted.cap * sizeof(*sched->boosted.items));
+}
+
+size_t sched_len(const struct scheduler *sched)
+{
+    return sched->queue.len + sched->boosted.len;
+}
+
+bool in_focus(const struct scheduler *sched, const struct directory *d)
+{
+    for (; sched->focus && d; d = d->file.parent) {
+        if (d == sched->focus) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void route(struct scheduler *sched, struct queue_item item)
+{
+    sched->policy->push(in_focus(sched, item.directory) ? &sched->boosted
+                                                        : &sched->queue,
+                        item);
+}
+
+void sched_push(struct scheduler *sched, struct directory *directory)
+{
+    struct queue_item item = {directory, 0};
+    if (sched->policy == &policies[SCAN_LARGEST_FIRST]) {
+        item.priority = size_hint(directory);
+    }
+    route(sched, item);
+}
+
+struct directory *sched_pop(struct scheduler *sched)
+{
+    struct dir_queue *q = sched->boosted.len ? &sched->boosted
+                                             : &sched->queue;
+    return sched->policy->pop(q, &sched->rng).directory;
+}
+
+void sched_focus(struct scheduler *sched, struct directory *directory)
+{
+    if (directory && !directory->file.parent) {
+        directory = NULL;  /* everything is below the root */
+    }
+    if (directory == sched->focus) {
+        return;
+    }
+    /* both queues are sorted out again, once per navigation */
+    size_t len = sched_len(sched);
+    struct queue_item *items = malloc(len * sizeof(*items) + 1);
+    size_t n = 0;
+    struct dir_queue *queues[] = {&sched->queue, &sched->boosted};
+    for (int i = 0; i < 2; ++i) {
+        for (size_t j = 0; j < queues[i]->len; ++j) {
+            items[n++] = *item_at(queues[i], j);
+        }
+        queues[i]->len = 0;
+        queues[i]->head = 0;
+    }
+    sched->focus = directory;
+    for (size_t i = 0; i < n; ++i) {
+        route(sched, items[i]);
+    }
+    free(items);
+}
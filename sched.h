@@ -0,0 +1,69 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tree.h"
+
+/* The order in which the scanner takes directories from its queue. A
+ * policy only decides which queued directory goes next; on top of any of
+ * them, the subtree the user is looking at is served first. */
+
+enum scan_order {
+    SCAN_ORDER_AUTO,     /* random with --estimate, depth-first otherwise */
+    SCAN_DEPTH_FIRST,    /* keeps the queue short */
+    SCAN_BREADTH_FIRST,  /* the top levels are known first */
+    SCAN_LARGEST_FIRST,  /* by size hint, else by directory inode size */
+    SCAN_RANDOM,         /* unbiased samples for estimate_size() */
+    SCAN_ORDER_COUNT
+};
+
+struct queue_item {
+    struct directory *directory;
+    off_t priority;
+};
+
+/* A ring, so that breadth-first can take from the front; the other
+ * policies keep head at 0. */
+struct dir_queue {
+    struct queue_item *items;
+    size_t head;
+    size_t len;
+    size_t cap;
+};
+
+struct scan_policy {
+    void (*push)(struct dir_queue *q, struct queue_item item);
+    struct queue_item (*pop)(struct dir_queue *q, uint64_t *rng);
+};
+
+struct scheduler {
+    const struct scan_policy *policy;
+    struct dir_queue queue;
+    struct dir_queue boosted;  /* below focus */
+    struct directory *focus;
+    uint64_t rng;
+};
+
+const char *scan_order_name(enum scan_order order);
+/* -1 if name is not an order */
+int scan_order_parse(const char *name);
+
+/* Reads subtree sizes for largest-first from the output of
+ * find -printf '%y %s %i %p\n' of an earlier scan. Returns the number of
+ * entries read, or -1 on a malformed line. */
+long sched_load_hints(FILE *manifest);
+
+void sched_init(struct scheduler *sched, enum scan_order order, uint64_t seed);
+void sched_free(struct scheduler *sched);
+size_t sched_len(const struct scheduler *sched);
+void sched_push(struct scheduler *sched, struct directory *directory);
+/* must not be called on an empty scheduler */
+struct directory *sched_pop(struct scheduler *sched);
+/* Serves the subtree of directory first from now on; the root or NULL
+ * ends the boost. */
+void sched_focus(struct scheduler *sched, struct directory *directory);
+
+#endif
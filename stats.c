@@ -0,0 +1,113 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#ifdef NO_STATS
+
+void stats_print(FILE *out)
+{
+    fprintf(out, "[INFO] statistics are not compiled in (STATS=0)\n");
+}
+
+#else
+
+static const char *const counter_names[STATS_COUNTER_COUNT] = {
+    "lstat", "opendir", "readdir", "unlink", "rmdir", "truncate", "entries",
+    "bytes", "allocations", "allocated bytes", "sorts", "sorted entries",
+};
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "stat", "list", "sort", "delete",
+};
+
+__thread struct stats_slot *stats_local = NULL;
+
+/* slots outlive their threads, so that nothing is lost from the totals,
+ * and are handed on to new threads, so that the scanner starting and
+ * stopping workers does not grow the list */
+static struct stats_slot *slots = NULL;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+/* called when a thread that has a slot exits */
+void release_slot(void *slot)
+{
+    pthread_mutex_lock(&slots_lock);
+    ((struct stats_slot *) slot)->idle = true;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+void create_slot_key(void)
+{
+    if (pthread_key_create(&slot_key, release_slot)) {
+        abort();
+    }
+}
+
+struct stats_slot *stats_register(void)
+{
+    pthread_once(&slot_key_once, create_slot_key);
+    pthread_mutex_lock(&slots_lock);
+    struct stats_slot *slot = slots;
+    while (slot && !slot->idle) {
+        slot = slot->next;
+    }
+    if (slot) {
+        slot->idle = false;
+    } else {
+        if (posix_memalign((void **) &slot, STATS_CACHE_LINE, sizeof(*slot))) {
+            abort();
+        }
+        memset(slot, 0, sizeof(*slot));
+        slot->next = slots;
+        __atomic_store_n(&slots, slot, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&slots_lock);
+    pthread_setspecific(slot_key, slot);
+    stats_local = slot;
+    return slot;
+}
+
+uint64_t stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_print(FILE *out)
+{
+    uint64_t counters[STATS_COUNTER_COUNT] = {0};
+    uint64_t phase_ns[PHASE_COUNT] = {0};
+    unsigned threads = 0;
+    for (struct stats_slot *slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+         slot; slot = slot->next) {
+        for (int i = 0; i < STATS_COUNTER_COUNT; ++i) {
+            counters[i] += __atomic_load_n(&slot->counters[i],
+                                           __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < PHASE_COUNT; ++i) {
+            phase_ns[i] += __atomic_load_n(&slot->phase_ns[i],
+                                           __ATOMIC_RELAXED);
+        }
+        ++threads;
+    }
+    for (int i = 0; i < STATS_COUNTER_COUNT; ++i) {
+        fprintf(out, "%16s %16llu\n", counter_names[i],
+                (unsigned long long) counters[i]);
+    }
+    /* summed over threads, so they can exceed the wall clock time */
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        fprintf(out, "%11s time %15.3fs\n", phase_names[i],
+                phase_ns[i] * 1e-9);
+    }
+    /* at most this many at once, the slots are reused */
+    fprintf(out, "%16s %16u\n", "threads", threads);
+}
+
+#endif
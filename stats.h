@@ -0,0 +1,80 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Hot path counters. Every thread adds to its own cache line, readers sum
+ * the lines of all threads. Building with -DNO_STATS (make STATS=0)
+ * compiles the updates out entirely. */
+
+enum stats_counter {
+    /* one per enum fs_op, in the same order */
+    STATS_LSTAT,
+    STATS_OPENDIR,
+    STATS_READDIR,
+    STATS_UNLINK,
+    STATS_RMDIR,
+    STATS_TRUNCATE,
+    STATS_ENTRIES,      /* entries stat'ed by the scanner */
+    STATS_BYTES,        /* their sizes */
+    STATS_ALLOCS,       /* allocations for the tree, see mem.h */
+    STATS_ALLOC_BYTES,
+    STATS_SORTS,        /* directories sorted by size */
+    STATS_SORTED,       /* entries in them */
+    STATS_COUNTER_COUNT
+};
+
+enum stats_phase {
+    PHASE_STAT,
+    PHASE_LIST,         /* opendir and readdir */
+    PHASE_SORT,
+    PHASE_DELETE,
+    PHASE_COUNT
+};
+
+#define STATS_CACHE_LINE 64
+
+struct stats_slot {
+    uint64_t counters[STATS_COUNTER_COUNT];
+    uint64_t phase_ns[PHASE_COUNT];
+    struct stats_slot *next;
+    bool idle;  /* its thread has exited; the next new thread takes it */
+} __attribute__((aligned(STATS_CACHE_LINE)));
+
+/* Writes the totals of all threads as a table. */
+void stats_print(FILE *out);
+
+#ifdef NO_STATS
+
+#define STATS_ADD(counter, n) ((void) 0)
+#define STATS_START(var)
+#define STATS_END(phase, var) ((void) 0)
+
+#else
+
+extern __thread struct stats_slot *stats_local;
+
+struct stats_slot *stats_register(void);
+uint64_t stats_clock(void);
+
+static inline void stats_add(uint64_t *value, uint64_t n)
+{
+    /* only this thread writes, the atomic store keeps readers tear-free */
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+static inline struct stats_slot *stats_slot(void)
+{
+    return stats_local ? stats_local : stats_register();
+}
+
+#define STATS_ADD(counter, n) stats_add(&stats_slot()->counters[counter], (n))
+#define STATS_START(var) uint64_t var = stats_clock()
+#define STATS_END(phase, var) \
+    stats_add(&stats_slot()->phase_ns[phase], stats_clock() - (var))
+
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_NAME_MAX 39
+#define TRACE_THREAD_NAME_MAX 32
+
+struct trace_event {
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t arg;
+    uint8_t kind;
+    char name[TRACE_NAME_MAX];  /* 64 bytes in total */
+};
+
+struct trace_ring {
+    struct trace_event *events;
+    uint64_t written;   /* ever recorded; the ring keeps the last ones */
+    uint64_t begun[TRACE_KIND_COUNT];
+    unsigned tid;
+    char thread_name[TRACE_THREAD_NAME_MAX];
+    struct trace_ring *next;
+    bool idle;  /* its thread has exited; the next new thread takes it */
+};
+
+static const char *const kind_names[TRACE_KIND_COUNT] = {
+    "idle", "pop", "steal", "scan_dir", "list", "stat_batch", "sort", "unlink",
+    "rmdir", "truncate",
+};
+
+bool trace_enabled = false;
+
+static __thread struct trace_ring *local_ring = NULL;
+/* rings are handed on to new threads, so that the scanner starting and
+ * stopping workers does not grow the list; a tid is a worker slot then */
+static struct trace_ring *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static unsigned ring_count = 0;
+static uint64_t ring_mask;
+static unsigned sample_every = 1;
+static uint64_t min_ns = 0;
+static uint64_t epoch_ns;
+
+uint64_t trace_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_init(unsigned events_per_thread, unsigned sample, double min_seconds)
+{
+    uint64_t size = 1;
+    while (size < events_per_thread) {
+        size *= 2;
+    }
+    ring_mask = size - 1;
+    sample_every = sample ? sample : 1;
+    min_ns = (uint64_t) (min_seconds * 1e9);
+    epoch_ns = trace_clock();
+    trace_enabled = true;
+}
+
+/* called when a thread that has a ring exits */
+void release_ring(void *ring)
+{
+    pthread_mutex_lock(&rings_lock);
+    ((struct trace_ring *) ring)->idle = true;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+void create_ring_key(void)
+{
+    if (pthread_key_create(&ring_key, release_ring)) {
+        abort();
+    }
+}
+
+struct trace_ring *get_ring(void)
+{
+    if (local_ring) {
+        return local_ring;
+    }
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_mutex_lock(&rings_lock);
+    struct trace_ring *ring = rings;
+    while (ring && !ring->idle) {
+        ring = ring->next;
+    }
+    if (ring) {
+        /* the spans of the thread before stay */
+        ring->idle = false;
+        memset(ring->begun, 0, sizeof(ring->begun));
+    } else {
+        ring = calloc(1, sizeof(*ring));
+        ring->events = malloc((ring_mask + 1) * sizeof(*ring->events));
+        ring->tid = ++ring_count;
+        ring->next = rings;
+        rings = ring;
+    }
+    snprintf(ring->thread_name, sizeof(ring->thread_name), "thread %u",
+             ring->tid);
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+void trace_thread_name(const char *name)
+{
+    if (trace_enabled) {
+        snprintf(get_ring()->thread_name, TRACE_THREAD_NAME_MAX, "%s %u", name,
+                 get_ring()->tid);
+    }
+}
+
+uint64_t trace_begin_sampled(enum trace_kind kind)
+{
+    struct trace_ring *ring = get_ring();
+    if (ring->begun[kind]++ % sample_every) {
+        return 0;
+    }
+    return trace_clock();
+}
+
+void trace_end_sampled(enum trace_kind kind, uint64_t start, const char *name,
+                       uint64_t arg)
+{
+    uint64_t duration = trace_clock() - start;
+    if (duration < min_ns) {
+        return;
+    }
+    struct trace_ring *ring = local_ring;
+    struct trace_event *event = &ring->events[ring->written & ring_mask];
+    event->start_ns = start;
+    event->duration_ns = duration;
+    event->arg = arg;
+    event->kind = kind;
+    event->name[0] = '\0';
+    if (name) {
+        size_t len = strlen(name);
+        /* the end of a path says more than its beginning */
+        if (len >= TRACE_NAME_MAX) {
+            name += len - (TRACE_NAME_MAX - 1);
+            /* not in the middle of a UTF-8 character */
+            while (((unsigned char) *name & 0xc0) == 0x80) {
+                ++name;
+            }
+        }
+        strcpy(event->name, name);
+    }
+    __atomic_store_n(&ring->written, ring->written + 1, __ATOMIC_RELEASE);
+}
+
+/* the length of the UTF-8 character at s, 0 if it is not a valid one */
+size_t utf8_length(const unsigned char *s)
+{
+    size_t len;
+    uint32_t code;
+    uint32_t min;
+    if (s[0] < 0x80) {
+        return 1;
+    } else if ((s[0] & 0xe0) == 0xc0) {
+        len = 2;
+        code = s[0] & 0x1f;
+        min = 0x80;
+    } else if ((s[0] & 0xf0) == 0xe0) {
+        len = 3;
+        code = s[0] & 0x0f;
+        min = 0x800;
+    } else if ((s[0] & 0xf8) == 0xf0) {
+        len = 4;
+        code = s[0] & 0x07;
+        min = 0x10000;
+    } else {
+        return 0;
+    }
+    for (size_t i = 1; i < len; ++i) {
+        /* stops at the terminating null too */
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        code = code << 6 | (s[i] & 0x3f);
+    }
+    if (code < min || code > 0x10ffff || (code >= 0xd800 && code < 0xe000)) {
+        return 0;
+    }
+    return len;
+}
+
+/* UTF-8 goes through as is; names need not be UTF-8, so any other byte
+ * is escaped as the code point of the same value */
+void write_json_string(FILE *out, const char *s)
+{
+    putc('"', out);
+    while (*s) {
+        unsigned char c = *s;
+        size_t len = utf8_length((const unsigned char *) s);
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20 || c == 0x7f || !len) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fwrite(s, 1, len, out);
+            s += len;
+            continue;
+        }
+        ++s;
+    }
+    putc('"', out);
+}
+
+int trace_write(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return -1;
+    }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    bool first = true;
+    pthread_mutex_lock(&rings_lock);
+    for (struct trace_ring *ring = rings; ring; ring = ring->next) {
+        fprintf(out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+                "\"tid\":%u,\"args\":{\"name\":", first ? "" : ",\n",
+                ring->tid);
+        write_json_string(out, ring->thread_name);
+        fputs("}}", out);
+        first = false;
+        uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+        uint64_t begin = written > ring_mask ? written - ring_mask - 1 : 0;
+        for (uint64_t i = begin; i < written; ++i) {
+            struct trace_event *event = &ring->events[i & ring_mask];
+            fprintf(out, ",\n{\"ph\":\"X\",\"cat\":\"cleaner\",\"name\":\"%s\","
+                    "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"n\":%llu,\"path\":", kind_names[event->kind],
+                    ring->tid, (event->start_ns - epoch_ns) * 1e-3,
+                    event->duration_ns * 1e-3,
+                    (unsigned long long) event->arg);
+            write_json_string(out, event->name);
+            fputs("}}", out);
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fputs("\n]}\n", out);
+    return fclose(out) == 0 ? 0 : -1;
+}
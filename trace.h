@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Timeline of what every thread did, written as Chrome trace-event JSON
+ * (chrome://tracing, ui.perfetto.dev). Each thread records spans into its
+ * own ring buffer without locking; when a ring is full the oldest spans
+ * are overwritten. Sampling keeps huge scans cheap: only every n-th span
+ * of a kind is timed at all, and spans shorter than a minimum are
+ * dropped. */
+
+enum trace_kind {
+    TRACE_IDLE,       /* waiting for work */
+    TRACE_POP,        /* taking directories off the shared queue */
+    TRACE_STEAL,      /* taking a batch of a directory another one reads */
+    TRACE_SCAN_DIR,   /* listing and stat'ing one directory */
+    TRACE_LIST,       /* listing one directory of an inode order batch */
+    TRACE_STAT_BATCH, /* stat'ing a batch in inode order */
+    TRACE_SORT,
+    TRACE_UNLINK,
+    TRACE_RMDIR,
+    TRACE_TRUNCATE,   /* one step of shrinking a big file */
+    TRACE_KIND_COUNT
+};
+
+extern bool trace_enabled;
+
+/* events_per_thread is rounded up to a power of two */
+void trace_init(unsigned events_per_thread, unsigned sample_every,
+                double min_seconds);
+void trace_thread_name(const char *name);
+/* Writes every ring; returns 0 on success. */
+int trace_write(const char *path);
+
+uint64_t trace_begin_sampled(enum trace_kind kind);
+void trace_end_sampled(enum trace_kind kind, uint64_t start, const char *name,
+                       uint64_t arg);
+
+/* Returns 0 if the span is not recorded; pass the result to trace_end. */
+static inline uint64_t trace_begin(enum trace_kind kind)
+{
+    return trace_enabled ? trace_begin_sampled(kind) : 0;
+}
+
+/* name (a path, the end is kept) and arg are shown with the span */
+static inline void trace_end(enum trace_kind kind, uint64_t start,
+                             const char *name, uint64_t arg)
+{
+    if (start) {
+        trace_end_sampled(kind, start, name, arg);
+    }
+}
+
+#endif
@@ -0,0 +1,659 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "errors.h"
+#include "fs.h"
+#include "iolimit.h"
+#include "mem.h"
+#include "stats.h"
+#include "trace.h"
+#include "tree.h"
+
+/* directories with this many entries are sorted by several threads */
+#define PARALLEL_SORT_MIN 100000
+/* smaller directories are not worth listing again before a delete */
+#define INODE_DELETE_MIN 256
+/* seconds of retry pauses one remove_file() may spend in total */
+#define RETRY_BUDGET 5.
+/* inode times lag the wall clock by up to a tick */
+#define CTIME_SLACK_NS 20000000
+
+struct sort_task {
+    struct file *files;
+    off_t n;
+    unsigned threads;
+};
+
+/* A hash is enough to find the inode of a child: a collision only costs
+ * the order, not what gets removed. */
+struct listed_inode {
+    uint64_t name_hash;
+    ino_t ino;
+};
+
+struct child_inode {
+    struct file *file;
+    ino_t ino;
+    size_t index;
+};
+
+static const char *const delete_order_names[DELETE_ORDER_COUNT] = {
+    "tree", "inode", "auto",
+};
+
+/* another listing only pays off where seeks cost */
+static enum delete_order delete_order = DELETE_TREE_ORDER;
+/* what is left of RETRY_BUDGET for the current remove_file() */
+static double retry_budget = 0;
+/* what remove_collapsed() may take if limited, else all it finds */
+static bool collapsed_limited = false;
+static char *const *collapsed_paths = NULL;
+static size_t collapsed_count = 0;
+
+char *concat_path(const char *path_a, const char *path_b)
+{
+    size_t size_a = strlen(path_a);
+    size_t size_b = strlen(path_b);
+    uint8_t add_slash = (path_a[size_a - 1] != '/');
+    char *result = malloc(size_a + add_slash + size_b + 1);
+    char *p = stpncpy(result, path_a, size_a + 1);
+    if (add_slash) {
+        *(p++) = '/';
+    }
+    strncpy(p, path_b, size_b + 1);
+    return result;
+}
+
+char *get_file_name(const char *path)
+{
+    const char *result = path;
+    uint8_t prev = 0;
+    for (const char *p = path; *p; ++p) {
+        if (*p == '/') {
+            prev = 1;
+        } else {
+            if (prev) {
+                result = p;
+            }
+            prev = 0;
+        }
+    }
+    return (char *) result;
+}
+
+struct file *new_file(const char *path, mode_t mode, off_t size)
+{
+    struct file *file;
+    struct directory *directory;
+    if (S_ISDIR(mode)) {
+        directory = mem_alloc(MEM_DIRECTORY, sizeof(struct directory));
+        file = &directory->file;
+        directory->subdirs = NULL;
+        directory->self_size = size;
+        directory->self_scan_ns = 0;
+        directory->scan_ns = 0;
+        directory->syscall_ns = 0;
+        directory->pending_subdirs = 0;
+        directory->scan_state = SCAN_QUEUED;
+        directory->subdirs_sorted = false;
+        directory->device = 0;
+    } else {
+        file = mem_alloc(MEM_FILE, sizeof(struct file));
+    }
+
+    file->next = NULL;
+    file->parent = NULL;
+    file->name = mem_strdup(path);
+    file->type = (mode & S_IFMT) >> FILE_TYPE_OFFSET;
+    file->size = size;
+    return file;
+}
+
+struct file *new_collapsed(const char *dir, uint64_t count, off_t size,
+                           const uint32_t histogram[HISTOGRAM_BUCKETS],
+                           const struct timespec *listed)
+{
+    char name[48];
+    sprintf(name, "<%llu other files>", (unsigned long long) count);
+    char *path = concat_path(dir, name);
+    struct collapsed_files *collapsed = mem_alloc(MEM_FILE, sizeof(*collapsed));
+    collapsed->file.next = NULL;
+    collapsed->file.parent = NULL;
+    collapsed->file.name = mem_strdup(path);
+    collapsed->file.type = FILE_TYPE_COLLAPSED;
+    collapsed->file.size = size;
+    collapsed->count = count;
+    memcpy(collapsed->histogram, histogram, sizeof(collapsed->histogram));
+    collapsed->listed = *listed;
+    free(path);
+    return &collapsed->file;
+}
+
+unsigned histogram_bucket(off_t size)
+{
+    unsigned bucket = 0;
+    for (off_t limit = 1024; size >= limit && bucket < HISTOGRAM_BUCKETS - 1;
+         limit *= 4) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+void free_file(struct file *file)
+{
+    mem_free(MEM_NAME, file->name, strlen(file->name) + 1);
+    if ((file->type & ~DIRECTORY_UNLISTABLE) == S_IFDIR >> FILE_TYPE_OFFSET) {
+        mem_free(MEM_DIRECTORY, file, sizeof(struct directory));
+    } else if (file->type == FILE_TYPE_COLLAPSED) {
+        mem_free(MEM_FILE, file, sizeof(struct collapsed_files));
+    } else {
+        mem_free(MEM_FILE, file, sizeof(struct file));
+    }
+}
+
+void deallocate_files(struct file *file)
+{
+    /* siblings in a loop, huge directories would overflow the stack */
+    while (file) {
+        struct file *next = file->next;
+        if (file->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+            /* directory is both listable and listed */
+            struct directory *directory = (struct directory *)file;  /* XXX: sz */
+            deallocate_files(directory->subdirs);
+        }
+        free_file(file);
+        file = next;
+    }
+}
+
+struct file *reverse(struct file *f)
+{
+    if (!f) {
+        return f;
+    }
+    struct file *p = f, *x = f->next;
+    f->next = NULL;
+    while (x) {
+        struct file *c = x->next;
+        x->next = p;
+        p = x;
+        x = c;
+    }
+    return p;
+}
+
+struct file *merge(struct file *a, struct file *b)
+{
+    struct file *result = NULL;
+    while (a != NULL || b != NULL) {
+        struct file *old_result = result;
+        if (b == NULL || a != NULL && a->size > b->size) {
+            result = a;
+            a = a->next;
+        } else {
+            result = b;
+            b = b->next;
+        }
+        result->next = old_result;
+    }
+
+    return reverse(result);
+}
+
+struct file *do_merge_sort(struct file *files, off_t n)
+{
+    if (n == 0) {
+        assert(!files);
+        return files;
+    } else if (n == 1) {
+        assert(files->next == NULL);
+        return files;
+    }
+    off_t m = n / 2;
+    struct file *middle = files;
+    for (off_t i = 1; i < m; ++i) {
+        middle = middle->next;
+    }
+    struct file *rest = middle->next;
+    middle->next = NULL;
+    return merge(do_merge_sort(files, m), do_merge_sort(rest, n - m));
+}
+
+void *sort_task(void *arg)
+{
+    struct sort_task *task = arg;
+    if (task->threads < 2 || task->n < 2) {
+        task->files = do_merge_sort(task->files, task->n);
+        return NULL;
+    }
+    off_t m = task->n / 2;
+    struct file *middle = task->files;
+    for (off_t i = 1; i < m; ++i) {
+        middle = middle->next;
+    }
+    struct sort_task halves[2] = {
+        {task->files, m, task->threads / 2},
+        {middle->next, task->n - m, task->threads - task->threads / 2},
+    };
+    middle->next = NULL;
+    pthread_t thread;
+    bool spawned = pthread_create(&thread, NULL, sort_task, &halves[0]) == 0;
+    if (!spawned) {
+        sort_task(&halves[0]);
+    }
+    sort_task(&halves[1]);
+    if (spawned) {
+        pthread_join(thread, NULL);
+    }
+    task->files = merge(halves[0].files, halves[1].files);
+    return NULL;
+}
+
+struct file *do_parallel_merge_sort(struct file *files, off_t n,
+                                    unsigned threads)
+{
+    struct sort_task task = {files, n, threads};
+    sort_task(&task);
+    return task.files;
+}
+
+struct file *sorted_subdirs(struct directory *directory)
+{
+    if (!directory->subdirs_sorted) {
+        off_t count = 0;
+        for (struct file *cur = directory->subdirs; cur; cur = cur->next) {
+            ++count;
+        }
+        STATS_START(start);
+        uint64_t span = trace_begin(TRACE_SORT);
+        long cpus = count >= PARALLEL_SORT_MIN
+                    ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        directory->subdirs = do_parallel_merge_sort(
+            directory->subdirs, count,
+            cpus > MAX_SORT_THREADS ? MAX_SORT_THREADS : cpus > 1 ? cpus : 1);
+        trace_end(TRACE_SORT, span, directory->file.name, count);
+        STATS_END(PHASE_SORT, start);
+        STATS_ADD(STATS_SORTS, 1);
+        STATS_ADD(STATS_SORTED, count);
+        /* sizes below keep changing until the scan gets here */
+        directory->subdirs_sorted = directory_complete(directory);
+    }
+    return directory->subdirs;
+}
+
+struct file *next_entity(struct file *f, const char *s)
+{
+    if (strcmp("..", s) == 0) {
+        return &f->parent->file;
+    }
+    if (f->type == S_IFDIR >> FILE_TYPE_OFFSET) {
+        struct directory *d = (struct directory *)f;
+        for (struct file *cur = d->subdirs; cur; cur = cur->next) {
+            if (strcmp(get_file_name(cur->name), s) == 0) {
+                return cur;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void update_size(struct directory *d)
+{
+    assert(d);
+    d->subdirs_sorted = false;
+    d->file.size = d->self_size;
+    for (struct file *f = d->subdirs; f; f = f->next) {
+        d->file.size += f->size;
+    }
+}
+
+/* Calls remove (fs_unlink or fs_rmdir) again after a pause for as long as
+ * it fails with an error that may go away. The pauses come out of the
+ * budget of the whole remove_file(), so that a tree full of stale entries
+ * does not hold the prompt for the full schedule of every one of them. */
+int remove_path(int (*remove)(const char *), const char *path)
+{
+    unsigned attempt = 1;
+    while (remove(path) != 0) {
+        double delay = errors_retry_delay(attempt);
+        if (!errors_transient(errno) || delay < 0 || delay > retry_budget) {
+            int error = errno;
+            if (attempt > 1) {
+                errors_retried(false);
+            }
+            errno = error;
+            return -1;
+        }
+        sleep_seconds(delay);
+        retry_budget -= delay;
+        ++attempt;
+    }
+    if (attempt > 1) {
+        errors_retried(true);
+    }
+    return 0;
+}
+
+const char *delete_order_name(enum delete_order order)
+{
+    return delete_order_names[order];
+}
+
+int delete_order_parse(const char *name)
+{
+    for (int order = 0; order < DELETE_ORDER_COUNT; ++order) {
+        if (strcmp(delete_order_names[order], name) == 0) {
+            return order;
+        }
+    }
+    return -1;
+}
+
+void set_delete_order(enum delete_order order)
+{
+    delete_order = order;
+}
+
+uint64_t hash_entry_name(const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = name; *p; ++p) {
+        hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int compare_listed(const void *a, const void *b)
+{
+    uint64_t x = ((const struct listed_inode *) a)->name_hash;
+    uint64_t y = ((const struct listed_inode *) b)->name_hash;
+    return x < y ? -1 : x > y;
+}
+
+int compare_child_inodes(const void *a, const void *b)
+{
+    const struct child_inode *x = a;
+    const struct child_inode *y = b;
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Relinks the children of d by inode number, which ext4 and XFS roughly
+ * follow on disk: unlinking in that order walks the inode table and the
+ * journal sequentially instead of seeking for every entry. Children that
+ * are not listed keep their order, behind the others. */
+void order_by_inode(struct directory *d)
+{
+    size_t count = 0;
+    for (struct file *cur = d->subdirs; cur; cur = cur->next) {
+        ++count;
+    }
+    if (count < INODE_DELETE_MIN) {
+        return;
+    }
+    struct stat st;
+    if (delete_order == DELETE_AUTO_ORDER
+        && (fs_lstat(d->file.name, &st) != 0 || !fs_is_rotational(st.st_dev))) {
+        return;
+    }
+    struct fs_dir *dir = fs_opendir(d->file.name);
+    if (!dir) {
+        return;  /* the delete itself will report it */
+    }
+    uint64_t span = trace_begin(TRACE_SORT);
+    struct listed_inode *listed = malloc(count * sizeof(*listed));
+    size_t len = 0;
+    size_t cap = count;
+    struct fs_dirent *dirent;
+    while ((dirent = fs_readdir(dir))) {
+        if (len == cap) {
+            cap *= 2;
+            listed = realloc(listed, cap * sizeof(*listed));
+        }
+        listed[len].name_hash = hash_entry_name(dirent->name);
+        listed[len++].ino = dirent->ino;
+    }
+    fs_closedir(dir);
+    qsort(listed, len, sizeof(*listed), compare_listed);
+
+    struct child_inode *children = malloc(count * sizeof(*children));
+    size_t i = 0;
+    for (struct file *cur = d->subdirs; cur; cur = cur->next, ++i) {
+        struct listed_inode key = {hash_entry_name(get_file_name(cur->name)),
+                                   0};
+        struct listed_inode *found = bsearch(&key, listed, len,
+                                             sizeof(*listed), compare_listed);
+        children[i].file = cur;
+        children[i].ino = found ? found->ino : (ino_t) -1;
+        children[i].index = i;
+    }
+    qsort(children, count, sizeof(*children), compare_child_inodes);
+    for (i = 0; i + 1 < count; ++i) {
+        children[i].file->next = children[i + 1].file;
+    }
+    children[count - 1].file->next = NULL;
+    d->subdirs = children[0].file;
+    d->subdirs_sorted = false;
+    trace_end(TRACE_SORT, span, d->file.name, count);
+    free(children);
+    free(listed);
+}
+
+/* A big file to shrink once it is unlinked, NULL for anything else. It is
+ * opened before the unlink, so that it can still be reached after. */
+struct fs_file *open_big_file(struct file *f)
+{
+    if (f->type != S_IFREG >> FILE_TYPE_OFFSET || f->size < TRUNCATE_MIN_SIZE) {
+        return NULL;
+    }
+    return fs_open_file(f->name);
+}
+
+/* Frees the extents of an unlinked file a step at a time, paced by the
+ * I/O limits, instead of all of them in one journal transaction when the
+ * last reference goes. Files that still have a name keep their data. */
+void shrink_unlinked(struct fs_file *file, const char *path)
+{
+    struct stat st;
+    if (fs_fstat(file, &st) != 0 || st.st_nlink != 0) {
+        return;
+    }
+    off_t length = st.st_size;
+    while (length > TRUNCATE_STEP) {
+        length -= TRUNCATE_STEP;
+        io_throttle(IO_TRUNCATE);
+        uint64_t span = trace_begin(TRACE_TRUNCATE);
+        int result = fs_truncate(file, length);
+        trace_end(TRACE_TRUNCATE, span, path, 0);
+        if (result != 0) {
+            break;  /* closing frees the rest */
+        }
+    }
+}
+
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* whether the inode changed after the listing, give or take the coarse
+ * clock the kernel stamps inodes with */
+bool changed_since(const struct stat *st, const struct timespec *listed)
+{
+    int64_t ctime_ns = (int64_t) st->st_ctim.tv_sec * 1000000000
+                       + st->st_ctim.tv_nsec;
+    int64_t listed_ns = (int64_t) listed->tv_sec * 1000000000
+                        + listed->tv_nsec;
+    return ctime_ns + CTIME_SLACK_NS >= listed_ns;
+}
+
+/* The names of collapsed files are not known, so the directory is listed
+ * again; every non-directory without a node of its own goes, unless the
+ * removal is limited to collapsed_paths or the file changed after the
+ * scan counted it, which the size shown did not include. */
+bool remove_collapsed(struct file *f)
+{
+    struct directory *parent = f->parent;
+    struct fs_dir *dir = fs_opendir(parent->file.name);
+    if (!dir) {
+        errors_record(FS_OPENDIR, parent->file.name, errno);
+        fprintf(stderr, "[ERROR] cannot list %s: %s; skipping\n",
+                parent->file.name, strerror(errno));
+        return false;
+    }
+    bool result = true;
+    struct fs_dirent *dirent;
+    while ((dirent = fs_readdir(dir))) {
+        if (strcmp(dirent->name, ".") == 0 || strcmp(dirent->name, "..") == 0
+            || next_entity(&parent->file, dirent->name)) {
+            continue;
+        }
+        char *path = concat_path(parent->file.name, dirent->name);
+        struct stat st;
+        if (fs_lstat(path, &st) != 0 || S_ISDIR(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (collapsed_limited
+            && (!collapsed_count || !bsearch(&path, collapsed_paths, collapsed_count,
+                        sizeof(*collapsed_paths), compare_paths))) {
+            fprintf(stderr, "[WARNING] keeping %s, which is not among the "
+                    "files to remove\n", path);
+            result = false;
+        } else if (!collapsed_limited
+                   && changed_since(&st, &((struct collapsed_files *) f)
+                                             ->listed)) {
+            fprintf(stderr, "[WARNING] keeping %s, which changed after the "
+                    "scan\n", path);
+            result = false;
+        } else {
+            io_throttle(IO_UNLINK);
+            uint64_t span = trace_begin(TRACE_UNLINK);
+            int removed = remove_path(fs_unlink, path);
+            trace_end(TRACE_UNLINK, span, path, 0);
+            if (removed != 0) {
+                errors_record(FS_UNLINK, path, errno);
+                fprintf(stderr, "[ERROR] cannot remove %s: %s; skipping\n",
+                        path, strerror(errno));
+                result = false;
+            }
+        }
+        free(path);
+    }
+    fs_closedir(dir);
+    return result;
+}
+
+bool remove_file_internal(struct file *f, bool remove_parent)
+{
+    bool result = true;
+    if (f->type & (S_IFDIR >> FILE_TYPE_OFFSET)) {
+        struct directory *d = (struct directory *)f;
+        if (delete_order != DELETE_TREE_ORDER) {
+            order_by_inode(d);
+        }
+        struct file **subdirs = &d->subdirs;
+        while (*subdirs) {
+            struct file *nxt = (*subdirs)->next;
+            if (remove_file_internal(*subdirs, false)) {
+                free_file(*subdirs);
+                *subdirs = nxt;
+            } else {
+                subdirs = &(*subdirs)->next;
+                result = false;
+            }
+        }
+
+        if (!result) {
+            fprintf(stderr, "[WARNING] skipping %s; not all children removed\n",
+                f->name);
+        } else {
+            io_throttle(IO_UNLINK);
+            uint64_t span = trace_begin(TRACE_RMDIR);
+            int removed = remove_path(fs_rmdir, f->name);
+            trace_end(TRACE_RMDIR, span, f->name, 0);
+            if (removed != 0) {
+                errors_record(FS_RMDIR, f->name, errno);
+                fprintf(stderr, "[ERROR] cannot remove %s: %s; skipping\n",
+                        f->name, strerror(errno));
+                result = false;
+            }
+        }
+        update_size(d);
+    } else if (f->type == FILE_TYPE_COLLAPSED) {
+        result = remove_collapsed(f);
+    } else {
+        struct fs_file *big = open_big_file(f);
+        io_throttle(IO_UNLINK);
+        uint64_t span = trace_begin(TRACE_UNLINK);
+        int removed = remove_path(fs_unlink, f->name);
+        trace_end(TRACE_UNLINK, span, f->name, 0);
+        if (removed != 0) {
+            int error = errno;
+            if (remove_path(fs_rmdir, f->name) != 0) {
+                errors_record(FS_UNLINK, f->name, error);
+                fprintf(stderr, "[ERROR] cannot remove %s: %s; skipping\n",
+                        f->name, strerror(error));
+                result = false;
+            }
+        }
+        if (big) {
+            if (removed == 0) {
+                shrink_unlinked(big, f->name);
+            }
+            fs_close_file(big);
+        }
+    }
+    struct directory *parent = f->parent;
+    if (result && remove_parent) {
+        struct directory *d = parent;
+        if (d) {
+            struct file **subdirs = &d->subdirs;
+            while (*subdirs) {
+                struct file *nxt = (*subdirs)->next;
+                if (*subdirs == f) {
+                    *subdirs = nxt;
+                } else {
+                    subdirs = &(*subdirs)->next;
+                }
+            }
+        }
+        free_file(f);
+    }
+
+    if (remove_parent) {
+        struct directory *d = parent;
+        while (d) {
+            update_size(d);
+            d = d->file.parent;
+        }
+    }
+    return result;
+}
+
+bool remove_file(struct file *f)
+{
+    retry_budget = RETRY_BUDGET;
+    return remove_file_internal(f, true);
+}
+
+bool remove_file_listed(struct file *f, char *const *paths, size_t n)
+{
+    collapsed_limited = true;
+    collapsed_paths = paths;
+    collapsed_count = n;
+    bool result = remove_file(f);
+    collapsed_limited = false;
+    collapsed_paths = NULL;
+    collapsed_count = 0;
+    return result;
+}
@@ -0,0 +1,112 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define FILE_TYPE_OFFSET 12
+#define DIRECTORY_UNLISTABLE 020
+/* "<N other files>", the files of a --dirs-only scan that got no node */
+#define FILE_TYPE_COLLAPSED 0
+#define HISTOGRAM_BUCKETS 16    /* file sizes by powers of 4 from 1kB */
+/* files this big give their space back in steps when removed */
+#define TRUNCATE_MIN_SIZE ((off_t) 1 << 30)
+#define TRUNCATE_STEP ((off_t) 64 << 20)
+/* threads of do_parallel_merge_sort() at most, whatever the CPUs */
+#define MAX_SORT_THREADS 16
+
+struct file {
+    struct file *next;
+    struct directory *parent;
+    char *name;
+    off_t size;
+    uint8_t type;
+};
+
+enum scan_state {
+    SCAN_QUEUED,
+    SCAN_LISTED,    /* direct entries are known, some subdirectories are not */
+    SCAN_COMPLETE,  /* the whole subtree is known */
+};
+
+struct directory {
+    struct file file;
+    struct file *subdirs;
+    off_t self_size;
+    /* wall time spent on the direct entries, on the whole subtree, and
+     * the latency of the filesystem calls in the latter */
+    uint64_t self_scan_ns;
+    uint64_t scan_ns;
+    uint64_t syscall_ns;
+    uint32_t pending_subdirs;  /* subdirectories not complete yet */
+    uint8_t scan_state;
+    bool subdirs_sorted;
+    uint16_t device;  /* queue of the scanner, by st_dev */
+};
+
+enum delete_order {
+    DELETE_TREE_ORDER,   /* as the children are linked */
+    DELETE_INODE_ORDER,  /* by d_ino of the children of big directories */
+    DELETE_AUTO_ORDER,   /* inode order on rotational disks, tree elsewhere */
+    DELETE_ORDER_COUNT
+};
+
+struct collapsed_files {
+    struct file file;
+    uint64_t count;
+    uint32_t histogram[HISTOGRAM_BUCKETS];
+    struct timespec listed;  /* files changed since were not counted */
+};
+
+/* sizes grow while a background scan is running */
+static inline off_t file_size(const struct file *f)
+{
+    return __atomic_load_n(&f->size, __ATOMIC_RELAXED);
+}
+
+static inline bool directory_complete(struct directory *d)
+{
+    return __atomic_load_n(&d->scan_state, __ATOMIC_ACQUIRE) == SCAN_COMPLETE;
+}
+
+char *concat_path(const char *path_a, const char *path_b);
+char *get_file_name(const char *path);
+/* A node for path, not linked anywhere yet; directories start queued. */
+struct file *new_file(const char *path, mode_t mode, off_t size);
+struct file *new_collapsed(const char *dir, uint64_t count, off_t size,
+                           const uint32_t histogram[HISTOGRAM_BUCKETS],
+                           const struct timespec *listed);
+unsigned histogram_bucket(off_t size);
+/* frees one node, not its children */
+void free_file(struct file *file);
+void deallocate_files(struct file *file);
+
+struct file *reverse(struct file *f);
+struct file *merge(struct file *a, struct file *b);
+struct file *do_merge_sort(struct file *files, off_t n);
+/* The same order as do_merge_sort(), ties included: the halves are split
+ * and merged alike, only sorted on threads of their own while threads
+ * remain. */
+struct file *do_parallel_merge_sort(struct file *files, off_t n,
+                                    unsigned threads);
+struct file *sorted_subdirs(struct directory *directory);
+struct file *next_entity(struct file *f, const char *s);
+
+void update_size(struct directory *d);
+const char *delete_order_name(enum delete_order order);
+/* -1 if name is not an order */
+int delete_order_parse(const char *name);
+/* for every remove_file() from now on; tree order by default */
+void set_delete_order(enum delete_order order);
+bool remove_file_internal(struct file *f, bool remove_parent);
+bool remove_file(struct file *f);
+/* strcmp of two char * elements, for qsort and bsearch */
+int compare_paths(const void *a, const void *b);
+/* Like remove_file(), but of the files that only collapsed nodes stand
+ * for, removes just those in paths (sorted with compare_paths) instead of
+ * every one a new listing finds; the others and their directories stay. */
+bool remove_file_listed(struct file *f, char *const *paths, size_t n);
+
+#endif